@@ -25,27 +25,95 @@
  */
 
 #include <limits.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include "spatial.h"
+#include "spatial/grisu3.h"
 #include "util.h"
 #include "tairgis.h"
+#include "workers.h"
 
 int matchSearch(
-        geom g, geomPolyMap *targetMap,
+        spatialEntry *e, geomPolyMap *targetMap,
         int targetType, int searchType,
-        geomCoord center, double meters
+        geomCoord center, double meters, spatial *cache
 );
 
+/* The polymap cache keeps the decoded polymap of a member on its entry so
+ * that repeated queries do not rebuild it for every candidate. The total
+ * size of the cached polymaps is bounded by spatialPolyMapCacheLimit, once
+ * it is reached new polymaps are built per query as before. The usage is
+ * changed atomically: a key freed lazily drops its polymaps on the bio
+ * thread while the main thread caches others. */
+size_t spatialPolyMapCacheLimit = 0;
+static size_t spatialPolyMapCacheUsed = 0;
+static int spatialPolyMapCacheFrozen = 0;  // non zero while other threads read the entries.
+
+/* The rtree flags of new keys, see rtreeNewWithFlags. GIS.INDEX changes
+ * them for a single key. */
+int spatialRTreeFlags = 0;
+
+/* The write buffer size of new keys, see spatialTypeSet. */
+int spatialWriteBuffer = 0;
+
+/* Keys with at least this many members are searched on the workers, see
+ * spatialTypeSearch. */
+long long spatialParallelMinMembers = SPATIAL_PARALLEL_MIN_MEMBERS;
+
+/* Keys with at least this many members are searched on a snapshot off the
+ * main thread, when there are threads for it, see spatialSnapshotNew. */
+long long spatialSnapshotMinMembers = SPATIAL_SNAPSHOT_MIN_MEMBERS;
+
+size_t spatialPolyMapCacheMemUsage() {
+    return __atomic_load_n(&spatialPolyMapCacheUsed, __ATOMIC_RELAXED);
+}
+
+#define SPATIAL_STRING_OVERHEAD 20  // the string object, the sds header and the terminator.
+#define SPATIAL_DICT_KEY_OVERHEAD 24 // the rax node, child and value pointers of a key.
+
+static size_t spatialStringMemUsage(RedisModuleString *str) {
+    size_t len;
+    RedisModule_StringPtrLen(str, &len);
+    return len + SPATIAL_STRING_OVERHEAD;
+}
+
+/* the bytes held by a member: the entry, its strings, its key in the dict
+ * and its cached polymap. Kept up to date in spatial.used for the members
+ * of the dict, so that the memory of a key is known without walking it. */
+static size_t spatialEntryMemUsage(spatialEntry *e) {
+    size_t len;
+    RedisModule_StringPtrLen(e->field, &len);
+    return sizeof(spatialEntry) + spatialStringMemUsage(e->field) + spatialStringMemUsage(e->value) +
+           len + SPATIAL_DICT_KEY_OVERHEAD + geomPolyMapMemUsage(e->m);
+}
+
+/* the rtree of the members, linked to the entries so that moves can be
+ * done in place, see spatialTypeSet. */
+static rtree *spatialNewIndex(int flags) {
+    rtree *tr = rtreeNewWithFlags(flags);
+    if (tr) {
+        rtreeLinkItems(tr, offsetof(spatialEntry, leaf));
+    }
+    return tr;
+}
+
 spatial *spatialNew() {
     spatial *s = RedisModule_Alloc(sizeof(spatial));
     if (!s) return NULL;
     s->h = RedisModule_CreateDict(NULL);
-    s->keyhash = RedisModule_CreateDict(NULL);
-    s->idxhash = RedisModule_CreateDict(NULL);
-    s->tr = rtreeNew();
-    s->fences = NULL;
+    s->tr = spatialNewIndex(spatialRTreeFlags);
+    s->pending = NULL;
+    s->pcap = s->plen = 0;
+    s->pmax = spatialWriteBuffer;
+    s->gen = s->shared = 0;
+    s->retired = NULL;
+    s->rcap = s->rlen = 0;
+    s->live = NULL;
+    s->lcap = s->llen = 0;
+    s->refs = 1;
+    s->used = 0;
     if (!s->tr) {
         spatialFree(s);
         return NULL;
@@ -53,84 +121,816 @@ spatial *spatialNew() {
     return s;
 }
 
-void redisModuleDictFree(RedisModuleDict *h) {
+static void spatialEntryDropPolyMap(spatialEntry *e) {
+    if (e->m) {
+        __atomic_sub_fetch(&spatialPolyMapCacheUsed, geomPolyMapMemUsage(e->m), __ATOMIC_RELAXED);
+        geomFreePolyMap(e->m);
+        e->m = NULL;
+    }
+}
+
+/* returns the polymap of the entry, building it if it is not cached yet
+ * and caching it unless cache, the key of the entry, is NULL. when *cached
+ * is set to 0 the caller owns the polymap and must free it. */
+static geomPolyMap *spatialEntryPolyMap(spatialEntry *e, int *cached, spatial *cache) {
+    if (e->m) {
+        *cached = 1;
+        return e->m;
+    }
+    *cached = 0;
+    geom g = (geom) RedisModule_StringPtrLen(e->value, NULL);
+    geomPolyMap *m = geomNewPolyMap(g);
+    if (!m || !cache || geomIsSimplePoint(g) || spatialPolyMapCacheFrozen) {
+        /* points are cheap to map, keep the budget for the shapes */
+        return m;
+    }
+    size_t usage = geomPolyMapMemUsage(m);
+    size_t used = __atomic_load_n(&spatialPolyMapCacheUsed, __ATOMIC_RELAXED);
+    while (used + usage <= spatialPolyMapCacheLimit) {
+        if (__atomic_compare_exchange_n(&spatialPolyMapCacheUsed, &used, used + usage, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            cache->used += usage;
+            e->m = m;
+            *cached = 1;
+            break;
+        }
+    }
+    return m;
+}
+
+static void spatialEntryFree(spatialEntry *e) {
+    if (!e) return;
+    spatialEntryDropPolyMap(e);
+    GisModule_FreeStringSafe(NULL, e->field);
+    GisModule_FreeStringSafe(NULL, e->value);
+    RedisModule_Free(e);
+}
+
+static void spatialDictFree(RedisModuleDict *h) {
     if (!h) return;
     size_t keylen;
     void *data;
     RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(
             h, "^", NULL, 0);
     while (RedisModule_DictNextC(iter, &keylen, &data)) {
-        GisModule_FreeStringSafe(NULL, (RedisModuleString *) data);
+        spatialEntryFree(data);
     }
-    RedisModule_FreeDict(NULL, h);
     RedisModule_DictIteratorStop(iter);
+    RedisModule_FreeDict(NULL, h);
 }
 
+/* Drops a reference on s, the last one frees it. The key holds one and each
+ * live snapshot another, see spatialSnapshotFree. The key may be freed on
+ * the bio thread by a lazy free or an async flush while the main thread
+ * releases a snapshot, so the count is atomic and nothing else of s is
+ * touched here until it drops to 0. */
 void spatialFree(spatial *s) {
-    if (s) {
-        if (s->h) redisModuleDictFree(s->h);
-        if (s->keyhash) redisModuleDictFree(s->keyhash);
-        if (s->idxhash) redisModuleDictFree(s->idxhash);
-        if (s->tr) rtreeFree(s->tr);
-        /* do not free the fence object, only the array.
-         * seems there exists some mem leak */
-        if (s->fences) RedisModule_Free(s->fences);
-        RedisModule_Free(s);
+    if (!s || __atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
     }
+    if (s->h) spatialDictFree(s->h);
+    if (s->tr) rtreeFree(s->tr);
+    if (s->pending) RedisModule_Free(s->pending);
+    for (int i = 0; i < s->rlen; i++) {
+        spatialEntryFree(s->retired[i].e);
+    }
+    if (s->retired) RedisModule_Free(s->retired);
+    if (s->live) RedisModule_Free(s->live);
+    RedisModule_Free(s);
+}
+
+/* Returns the bytes held by the key: the members, the index, the write
+ * buffer and the entries kept for the snapshots. */
+size_t spatialMemUsage(spatial *s) {
+    size_t usage = sizeof(spatial) + s->used + rtreeMemUsage(s->tr);
+    usage += (size_t) s->pcap * sizeof(spatialPending);
+    usage += (size_t) s->rcap * sizeof(spatialRetired) + (size_t) s->lcap * sizeof(unsigned long long);
+    for (int i = 0; i < s->rlen; i++) {
+        usage += spatialEntryMemUsage(s->retired[i].e);
+    }
+    return usage;
 }
 
-// get an sds based on the key.
-// return value must be freed by the caller.
-static RedisModuleString * hashTypeGetRedisModuleString(RedisModuleDict *o, RedisModuleString *key) {
+/* Describes the key for GIS.INFO. The index and the members are walked, the
+ * write buffer is left as it is. */
+void spatialTypeInfo(spatial *s, spatialInfo *info) {
+    memset(info, 0, sizeof(spatialInfo));
+    info->members = (long long) RedisModule_DictSize(s->h);
+    info->pending = s->plen;
+    info->memory = spatialMemUsage(s);
+    info->indexMemory = rtreeMemUsage(s->tr);
+    rtreeGetStats(s->tr, &info->index);
+
+    void *data;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(s->h, "^", NULL, 0);
+    while (RedisModule_DictNextC(iter, NULL, &data)) {
+        spatialEntry *e = data;
+        geomType type = geomGetType((geom) RedisModule_StringPtrLen(e->value, NULL));
+        info->types[GEOM_VALID_TYPE(type) ? type : GEOM_UNKNOWN]++;
+    }
+    RedisModule_DictIteratorStop(iter);
+}
+
+// returns the entry of the field, or NULL if it does not exist.
+spatialEntry *spatialTypeGetEntry(spatial *s, RedisModuleString *field) {
     int nokey = 0;
-    RedisModuleString *vstr = RedisModule_DictGet(o, key, &nokey);
-    if (nokey == 1 || !vstr) return NULL;
-    return vstr;
+    spatialEntry *e = RedisModule_DictGet(s->h, field, &nokey);
+    if (nokey == 1) return NULL;
+    return e;
+}
+
+static void spatialEntrySetBounds(spatialEntry *e) {
+    geomRect r = geomBounds((geom) RedisModule_StringPtrLen(e->value, NULL));
+    e->minX = r.min.x;
+    e->minY = r.min.y;
+    e->maxX = r.max.x;
+    e->maxY = r.max.y;
 }
 
-// returns a raw pointer to the value
-static const void *hashTypeGetRaw(RedisModuleDict *o, RedisModuleString *key) {
+/* the entries a snapshot may read are never changed, see
+ * spatialSnapshotNew. */
+static inline int spatialEntryShared(spatial *s, spatialEntry *e) {
+    return e->gen < s->shared;
+}
+
+/* frees an entry taken out of the key, or keeps it until the snapshots
+ * that may read it are gone. */
+static void spatialEntryRelease(spatial *s, spatialEntry *e) {
+    if (!spatialEntryShared(s, e)) {
+        spatialEntryFree(e);
+        return;
+    }
+    if (s->rlen == s->rcap) {
+        s->rcap = s->rcap ? s->rcap * 2 : 16;
+        s->retired = RedisModule_Realloc(s->retired, sizeof(spatialRetired) * s->rcap);
+    }
+    s->retired[s->rlen].e = e;
+    s->retired[s->rlen].gen = s->gen;
+    s->rlen++;
+}
+
+/* ========================== Fences ==================================== */
+
+void fenceFree(fence *f) {
+    if (!f) return;
+    if (f->channel) GisModule_FreeStringSafe(NULL, f->channel);
+    if (f->pattern) RedisModule_Free(f->pattern);
+    if (f->m) geomFreePolyMap(f->m);
+    if (f->g) geomFree(f->g);
+    RedisModule_Free(f);
+}
+
+/* The fences of the areas, keyed by the db and the name of the area. They
+ * are kept out of the keyspace, which is persisted and replicated while
+ * the fences are not: an area with fences and no members is not a key, and
+ * the fences stay on the name of an area deleted and created again. */
+static RedisModuleDict *spatialFenceSets = NULL;
+
+static char *fenceSetKey(RedisModuleCtx *ctx, RedisModuleString *area, size_t *keylen) {
+    size_t len;
+    const char *name = RedisModule_StringPtrLen(area, &len);
+    char prefix[16];
+    int plen = snprintf(prefix, sizeof(prefix), "%d:", RedisModule_GetSelectedDb(ctx));
+    char *key = RedisModule_Alloc(plen + len);
+    memcpy(key, prefix, plen);
+    memcpy(key + plen, name, len);
+    *keylen = plen + len;
+    return key;
+}
+
+static void fenceSetFree(fenceSet *fs) {
+    for (int i = 0; i < fs->flen; i++) {
+        fenceFree(fs->fences[i]);
+    }
+    if (fs->fences) RedisModule_Free(fs->fences);
+    if (fs->outside) RedisModule_Free(fs->outside);
+    if (fs->ftr) rtreeFree(fs->ftr);
+    RedisModule_Free(fs);
+}
+
+/* Returns the fences of the area in the selected db, NULL if it has none
+ * unless create is set. */
+fenceSet *spatialFenceSet(RedisModuleCtx *ctx, RedisModuleString *area, int create) {
+    if (!create && (!spatialFenceSets || RedisModule_DictSize(spatialFenceSets) == 0)) {
+        /* no lookup on the writes while there are no fences */
+        return NULL;
+    }
+    if (!spatialFenceSets) {
+        spatialFenceSets = RedisModule_CreateDict(NULL);
+    }
+    size_t keylen;
+    char *key = fenceSetKey(ctx, area, &keylen);
     int nokey = 0;
-    RedisModuleString *vstr = RedisModule_DictGet(o, key, &nokey);
-    if (nokey == 1 || !vstr) return NULL;
-    return RedisModule_StringPtrLen(vstr, NULL);
+    fenceSet *fs = RedisModule_DictGetC(spatialFenceSets, key, keylen, &nokey);
+    if (nokey) {
+        fs = NULL;
+    }
+    if (!fs && create) {
+        fs = RedisModule_Calloc(1, sizeof(fenceSet));
+        RedisModule_DictSetC(spatialFenceSets, key, keylen, fs);
+    }
+    RedisModule_Free(key);
+    return fs;
+}
+
+static void spatialFenceUnlink(fenceSet *fs, int i) {
+    fence *f = fs->fences[i];
+    rtreeRemove(fs->ftr, f->bounds.min.x, f->bounds.min.y, f->bounds.max.x, f->bounds.max.y, f);
+    if (f->detect & FENCE_OUTSIDE) {
+        for (int j = 0; j < fs->olen; j++) {
+            if (fs->outside[j] == f) {
+                fs->outside[j] = fs->outside[--fs->olen];
+                break;
+            }
+        }
+    }
+    fs->fences[i] = fs->fences[--fs->flen];
+}
+
+static int spatialFenceFind(fenceSet *fs, RedisModuleString *channel) {
+    for (int i = 0; i < fs->flen; i++) {
+        if (!RedisModule_StringCompare(fs->fences[i]->channel, channel)) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-int spatialTypeSet(ExGisObj *o, RedisModuleString *field, RedisModuleString *val) {
-    geom g;
+/* Takes ownership of the fence. A fence already registered on the same
+ * channel is replaced. Returns 1 when the fence is new, 0 when it replaced
+ * another one. */
+int spatialFenceAdd(fenceSet *fs, fence *f) {
+    int added = 1;
+    int i = spatialFenceFind(fs, f->channel);
+    if (i != -1) {
+        fence *old = fs->fences[i];
+        spatialFenceUnlink(fs, i);
+        fenceFree(old);
+        added = 0;
+    }
+    if (!fs->ftr) {
+        fs->ftr = rtreeNew();
+    }
+    if (fs->flen == fs->fcap) {
+        fs->fcap = fs->fcap == 0 ? 4 : fs->fcap * 2;
+        fs->fences = RedisModule_Realloc(fs->fences, fs->fcap * sizeof(fence *));
+    }
+    fs->fences[fs->flen++] = f;
+    rtreeInsert(fs->ftr, f->bounds.min.x, f->bounds.min.y, f->bounds.max.x, f->bounds.max.y, f);
+    if (f->detect & FENCE_OUTSIDE) {
+        if (fs->olen == fs->ocap) {
+            fs->ocap = fs->ocap == 0 ? 4 : fs->ocap * 2;
+            fs->outside = RedisModule_Realloc(fs->outside, fs->ocap * sizeof(fence *));
+        }
+        fs->outside[fs->olen++] = f;
+    }
+    return added;
+}
+
+/* Removes the fence of the channel from the area, the fences of an area
+ * are freed with the last of them. */
+int spatialFenceRemove(RedisModuleCtx *ctx, RedisModuleString *area, RedisModuleString *channel) {
+    fenceSet *fs = spatialFenceSet(ctx, area, 0);
+    int i = fs ? spatialFenceFind(fs, channel) : -1;
+    if (i == -1) {
+        return 0;
+    }
+    fence *f = fs->fences[i];
+    spatialFenceUnlink(fs, i);
+    fenceFree(f);
+    if (fs->flen == 0) {
+        size_t keylen;
+        char *key = fenceSetKey(ctx, area, &keylen);
+        RedisModule_DictDelC(spatialFenceSets, key, keylen, NULL);
+        RedisModule_Free(key);
+        fenceSetFree(fs);
+    }
+    return 1;
+}
+
+static int fenceFieldMatch(fence *f, RedisModuleString *field) {
+    if (f->allfields) {
+        return 1;
+    }
+    size_t len;
+    const char *str = RedisModule_StringPtrLen(field, &len);
+    return globMatch(&f->match, str, (int) len);
+}
+
+static int fenceMatch(spatial *s, fence *f, spatialEntry *e) {
+    return fenceFieldMatch(f, e->field) &&
+           matchSearch(e, f->m, f->targetType, f->searchType, f->center, f->meters, s);
+}
+
+/* fenceEval carries the state of the fences around a change of a member:
+ * the fences whose bounds overlap the former or the new bounds of the
+ * member, and whether the member matched each of them before the change. */
+typedef struct fenceEval {
+    fence **hits;
+    int *before;
+    int len, cap;
+    int moved;      // the member was a point and stays a point.
+    geomCoord from; // the former position of the point.
+} fenceEval;
+
+static int fenceCollectIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
+
+    fenceEval *fe = userdata;
+    if (fe->len == fe->cap) {
+        fe->cap = fe->cap == 0 ? 4 : fe->cap * 2;
+        fe->hits = RedisModule_Realloc(fe->hits, fe->cap * sizeof(fence *));
+        fe->before = RedisModule_Realloc(fe->before, fe->cap * sizeof(int));
+    }
+    fe->hits[fe->len++] = item;
+    return 1;
+}
+
+/* Called before e changes. next is the new value, NULL when e is deleted. */
+static void fenceBegin(spatial *s, fenceSet *fs, spatialEntry *e, RedisModuleString *next, fenceEval *fe) {
+    memset(fe, 0, sizeof(fenceEval));
+    fs->fepoch++;
+
     geomRect r;
-    RedisModuleString *sidx;
-    uint64_t nidx;
+    if (next) {
+        geom g = (geom) RedisModule_StringPtrLen(next, NULL);
+        r = geomBounds(g);
+        if (e && geomIsSimplePoint(g) && geomIsSimplePoint((geom) RedisModule_StringPtrLen(e->value, NULL))) {
+            fe->moved = 1;
+            fe->from = geomCenter((geom) RedisModule_StringPtrLen(e->value, NULL));
+        }
+        if (e) {
+            r.min.x = fmin(r.min.x, e->minX);
+            r.min.y = fmin(r.min.y, e->minY);
+            r.max.x = fmax(r.max.x, e->maxX);
+            r.max.y = fmax(r.max.y, e->maxY);
+        }
+    } else {
+        r.min.x = e->minX;
+        r.min.y = e->minY;
+        r.max.x = e->maxX;
+        r.max.y = e->maxY;
+    }
+    rtreeSearch(fs->ftr, r.min.x, r.min.y, r.max.x, r.max.y, fenceCollectIterator, fe);
+
+    for (int i = 0; i < fe->len; i++) {
+        fe->hits[i]->epoch = fs->fepoch;
+        fe->before[i] = e ? fenceMatch(s, fe->hits[i], e) : 0;
+    }
+}
+
+static void fencePublish(RedisModuleCtx *ctx, fence *f, const char *event, RedisModuleString *field) {
+    size_t len;
+    const char *str = RedisModule_StringPtrLen(field, &len);
+    RedisModuleString *msg = RedisModule_CreateString(ctx, event, strlen(event));
+    RedisModule_StringAppendBuffer(ctx, msg, " ", 1);
+    RedisModule_StringAppendBuffer(ctx, msg, str, len);
+    RedisModule_PublishMessage(ctx, f->channel, msg);
+    RedisModule_FreeString(ctx, msg);
+}
+
+/* Whether a point moving in a straight line from -> to crossed the area of
+ * the fence. Only polygonal areas can be crossed. */
+static int fenceCrossed(fence *f, geomCoord from, geomCoord to) {
+    polyPoint a = {from.x, from.y};
+    polyPoint b = {to.x, to.y};
+    for (int i = 0; i < f->m->polygonCount; i++) {
+        if (f->m->types[i] == GEOM_POLYGON &&
+            polyLineIntersect(a, b, f->m->polygons[i], f->m->holes[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Called after the change, e is NULL when the member was deleted. Publishes
+ * the detected events and releases fe. */
+static void fenceEnd(RedisModuleCtx *ctx, spatial *s, fenceSet *fs, spatialEntry *e, RedisModuleString *field,
+                     fenceEval *fe) {
+    for (int i = 0; i < fe->len; i++) {
+        fence *f = fe->hits[i];
+        int before = fe->before[i];
+        if (!fenceFieldMatch(f, field)) {
+            continue;
+        }
+        if (!e) {
+            if (before && (f->detect & FENCE_FIELDDEL)) fencePublish(ctx, f, "del", field);
+            continue;
+        }
+        int after = fenceMatch(s, f, e);
+        if (!before && after) {
+            if (f->detect & FENCE_ENTER) fencePublish(ctx, f, "enter", field);
+        } else if (before && !after) {
+            if (f->detect & FENCE_EXIT) fencePublish(ctx, f, "exit", field);
+        } else if (before && after) {
+            if (f->detect & FENCE_INSIDE) fencePublish(ctx, f, "inside", field);
+        } else if ((f->detect & FENCE_CROSS) && fe->moved &&
+                   fenceCrossed(f, fe->from, geomCenter((geom) RedisModule_StringPtrLen(e->value, NULL)))) {
+            fencePublish(ctx, f, "cross", field);
+        } else if (f->detect & FENCE_OUTSIDE) {
+            fencePublish(ctx, f, "outside", field);
+        }
+    }
+
+    /* the fences that are not near the member only see it outside, only
+     * the ones detecting it are walked */
+    if (e) {
+        for (int i = 0; i < fs->olen; i++) {
+            fence *f = fs->outside[i];
+            if (f->epoch != fs->fepoch && fenceFieldMatch(f, field)) {
+                fencePublish(ctx, f, "outside", field);
+            }
+        }
+    }
+
+    RedisModule_Free(fe->hits);
+    RedisModule_Free(fe->before);
+}
+
+/* ========================== Write buffer ============================== */
+
+/* With a write buffer, spatialTypeSet records the members it changes here
+ * instead of updating the rtree, like the memtable of an LSM tree. A member
+ * moving many times between two merges costs a single rtree update, and
+ * the merge rebuilds the whole tree with a bulk load when the buffer is
+ * large next to the key. The rtree keeps the buffered entries at their
+ * former bounds: spatialSearch skips them there and checks the buffer
+ * instead, which is a linear scan kept short by the size of the buffer. */
+
+static void spatialBufferAdd(spatial *s, spatialEntry *e, double minX, double minY, double maxX, double maxY,
+                             int indexed) {
+    if (s->plen == s->pcap) {
+        s->pcap = s->pcap ? s->pcap * 2 : 16;
+        if (s->pcap > s->pmax) s->pcap = s->pmax;
+        s->pending = RedisModule_Realloc(s->pending, sizeof(spatialPending) * s->pcap);
+    }
+    spatialPending *p = &s->pending[s->plen++];
+    p->e = e;
+    p->minX = minX;
+    p->minY = minY;
+    p->maxX = maxX;
+    p->maxY = maxY;
+    p->indexed = indexed;
+    e->pending = s->plen;
+    if (s->plen >= s->pmax) {
+        spatialTypeFlush(s);
+    }
+}
+
+/* takes the entry out of the buffer and of the rtree. */
+static void spatialBufferRemove(spatial *s, spatialEntry *e) {
+    spatialPending *p = &s->pending[e->pending - 1];
+    if (p->indexed) {
+        rtreeRemove(s->tr, p->minX, p->minY, p->maxX, p->maxY, e);
+    }
+    *p = s->pending[--s->plen];
+    p->e->pending = e->pending;
+    e->pending = 0;
+}
+
+static void spatialBuildIndex(spatial *s);
+
+/* Merges the write buffer into the rtree. */
+void spatialTypeFlush(spatial *s) {
+    if (s->plen == 0) {
+        return;
+    }
+    if ((uint64_t) s->plen * 4 >= RedisModule_DictSize(s->h)) {
+        spatialBuildIndex(s);
+        return;
+    }
+    for (int i = 0; i < s->plen; i++) {
+        spatialPending *p = &s->pending[i];
+        spatialEntry *e = p->e;
+        e->pending = 0;
+        if (p->indexed) {
+            rtreeUpdate(s->tr, p->minX, p->minY, p->maxX, p->maxY, e->minX, e->minY, e->maxX, e->maxY, e);
+        } else {
+            rtreeInsert(s->tr, e->minX, e->minY, e->maxX, e->maxY, e);
+        }
+    }
+    s->plen = 0;
+}
+
+/* Resizes the write buffer of the key, 0 merges it and turns it off. */
+void spatialTypeSetWriteBuffer(ExGisObj *o, int size) {
     spatial *s = o->s;
+    spatialTypeFlush(s);
+    s->pmax = size;
+    if (s->pcap > size) {
+        RedisModule_Free(s->pending);
+        s->pending = NULL;
+        s->pcap = 0;
+    }
+}
+
+typedef struct bufferedSearch {
+    rtreeSearchFunc iterator;
+    void *userdata;
+} bufferedSearch;
+
+static int bufferedSearchIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    bufferedSearch *bs = userdata;
+    if (((spatialEntry *) item)->pending) {
+        return 1;
+    }
+    return bs->iterator(minX, minY, maxX, maxY, item, bs->userdata);
+}
+
+/* rtreeSearch over the members of the key, write buffer included. */
+int spatialSearch(spatial *s, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator,
+                  void *userdata) {
+    if (s->plen == 0) {
+        return rtreeSearch(s->tr, minX, minY, maxX, maxY, iterator, userdata);
+    }
+    bufferedSearch bs = {iterator, userdata};
+    int count = rtreeSearch(s->tr, minX, minY, maxX, maxY, bufferedSearchIterator, &bs);
+    for (int i = 0; i < s->plen; i++) {
+        spatialEntry *e = s->pending[i].e;
+        if (e->minX > maxX || e->maxX < minX || e->minY > maxY || e->maxY < minY) {
+            continue;
+        }
+        if (!iterator(e->minX, e->minY, e->maxX, e->maxY, e, userdata)) {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+/* Sets a field. fs holds the fences of the area, NULL if there are none,
+ * their events are published on ctx. */
+int spatialTypeSet(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString *field, RedisModuleString *val) {
+    spatial *s = o->s;
+    spatialEntry *e = spatialTypeGetEntry(s, field);
+
+    fenceEval fe;
+    int fences = ctx && fs;
+    if (fences) {
+        fenceBegin(s, fs, e, val, &fe);
+    }
+
+    if (e && spatialEntryShared(s, e)) {
+        /* a snapshot may read the entry, a new one takes its place. The
+         * snapshots flush the write buffer, the entry is not in it. */
+        rtreeRemove(s->tr, e->minX, e->minY, e->maxX, e->maxY, e);
+        RedisModule_DictDel(s->h, field, NULL);
+        s->used -= spatialEntryMemUsage(e);
+        spatialEntryRelease(s, e);
+        e = NULL;
+    }
+
+    if (e) {
+        /* the field already exists, reuse the entry and move it in the
+         * rtree from the bounds of the former value. A small move stays
+         * in its leaf and does not touch the rest of the tree. */
+        double minX = e->minX, minY = e->minY, maxX = e->maxX, maxY = e->maxY;
+        s->used -= spatialEntryMemUsage(e);
+        spatialEntryDropPolyMap(e);
+        GisModule_FreeStringSafe(NULL, e->value);
+        e->value = RedisModule_CreateStringFromString(NULL, val);
+        s->used += spatialEntryMemUsage(e);
+        spatialEntrySetBounds(e);
+        if (e->pending) {
+            /* buffered already, the rtree still has the bounds kept in
+             * the buffer and the moves coalesce. */
+        } else if (s->pmax) {
+            spatialBufferAdd(s, e, minX, minY, maxX, maxY, 1);
+        } else {
+            rtreeUpdate(s->tr, minX, minY, maxX, maxY, e->minX, e->minY, e->maxX, e->maxY, e);
+        }
+    } else {
+        e = RedisModule_Alloc(sizeof(spatialEntry));
+        e->field = RedisModule_CreateStringFromString(NULL, field);
+        e->m = NULL;
+        e->leaf = NULL;
+        e->pending = 0;
+        e->gen = s->gen;
+        RedisModule_DictSet(s->h, field, e);
+        e->value = RedisModule_CreateStringFromString(NULL, val);
+        s->used += spatialEntryMemUsage(e);
+        spatialEntrySetBounds(e);
+        if (s->pmax) {
+            spatialBufferAdd(s, e, 0, 0, 0, 0, 0);
+        } else {
+            rtreeInsert(s->tr, e->minX, e->minY, e->maxX, e->maxY, e);
+        }
+    }
+
+    if (fences) {
+        fenceEnd(ctx, s, fs, e, field, &fe);
+    }
+    return 1;
+}
+
+static spatialEntry *spatialAppend(spatial *s, RedisModuleString *field, RedisModuleString *val) {
+    spatialEntry *e = RedisModule_Alloc(sizeof(spatialEntry));
+    e->field = field;
+    e->value = val;
+    e->m = NULL;
+    e->leaf = NULL;
+    e->pending = 0;
+    e->gen = s->gen;
+    if (RedisModule_DictSet(s->h, field, e) != REDISMODULE_OK) {
+        spatialEntryFree(e);
+        return NULL;
+    }
+    s->used += spatialEntryMemUsage(e);
+    return e;
+}
 
-    g = (geom) RedisModule_StringPtrLen(val, NULL);
-    r = geomBounds(g);
+/* Adds a new field without indexing it, the entry takes the ownership of
+ * both strings. Used to fill a key in bulk, spatialTypeBuildIndex must be
+ * called once all the fields are added. */
+int spatialTypeAppend(ExGisObj *o, RedisModuleString *field, RedisModuleString *val) {
+    spatialEntry *e = spatialAppend(o->s, field, val);
+    if (!e) {
+        return 0;
+    }
+    spatialEntrySetBounds(e);
+    return 1;
+}
+
+/* Loading a key.
+ *
+ * The members of a key being loaded come in batches: the loading thread
+ * reads a batch, the workers compute the bounds the batch lacks, which for
+ * large polygons is most of the work, and the loading thread adds the
+ * batch to the dict, which only it may change. The index is built once at
+ * the end, see spatialTypeLoadIndex. */
+#define LOAD_BOUNDS_PER_TASK 64
+
+typedef struct loadBatch {
+    RedisModuleString **vals;
+    rtreeItem *items;
+    const unsigned char *known;
+    int count;
+} loadBatch;
+
+static void loadBoundsTask(void *arg, int worker, int task) {
+    REDISMODULE_NOT_USED(worker);
+    loadBatch *b = arg;
+    int end = (task + 1) * LOAD_BOUNDS_PER_TASK;
+    if (end > b->count) {
+        end = b->count;
+    }
+    for (int i = task * LOAD_BOUNDS_PER_TASK; i < end; i++) {
+        if (b->known && b->known[i]) {
+            continue;
+        }
+        geomRect r = geomBounds((geom) RedisModule_StringPtrLen(b->vals[i], NULL));
+        b->items[i].minX = r.min.x;
+        b->items[i].minY = r.min.y;
+        b->items[i].maxX = r.max.x;
+        b->items[i].maxY = r.max.y;
+    }
+}
 
-    /* try to delete the former existing data for 'field'
-     * also remove what's exiting in rtree */
-    spatialTypeDelete(o, field, &r, NULL);
+/* Adds a batch of at most SPATIAL_LOAD_BATCH new fields without indexing
+ * them, like spatialTypeAppend. The bounds of the values are taken from
+ * items when known[i] is set, known may be NULL, and computed otherwise.
+ * items[i].item is set to the entry, NULL when the field was already set
+ * and the member dropped. Returns the number of members dropped. */
+int spatialTypeAppendBatch(ExGisObj *o, RedisModuleString **fields, RedisModuleString **vals, rtreeItem *items,
+                           const unsigned char *known, int count) {
+    loadBatch b = {vals, items, known, count};
+    int tasks = (count + LOAD_BOUNDS_PER_TASK - 1) / LOAD_BOUNDS_PER_TASK;
+    if (workersCount() > 1 && tasks > 1) {
+        workersRunTasks(tasks, loadBoundsTask, &b);
+    } else {
+        for (int i = 0; i < tasks; i++) {
+            loadBoundsTask(&b, 0, i);
+        }
+    }
 
-    /* create a new idx / field entry */
-    s->idx++;
-    nidx = (uint64_t) s->idx;
-    sidx = RedisModule_CreateString(NULL, (const char *) &nidx, 8);
+    int dropped = 0;
+    for (int i = 0; i < count; i++) {
+        spatialEntry *e = spatialAppend(o->s, fields[i], vals[i]);
+        items[i].item = e;
+        if (!e) {
+            dropped++;
+            continue;
+        }
+        e->minX = items[i].minX;
+        e->minY = items[i].minY;
+        e->maxX = items[i].maxX;
+        e->maxY = items[i].maxY;
+    }
+    return dropped;
+}
 
-    GisModule_DictInsertOrUpdate(s->idxhash, sidx, field);
-    GisModule_DictInsertOrUpdate(s->keyhash, field, sidx);
-    GisModule_FreeStringSafe(NULL, sidx);
+/* Builds the index of a key filled with spatialTypeAppendBatch keeping
+ * the leaves of the index it was saved from, see rtreeLoadLeaves. items
+ * holds all the entries of the key in leaf order, the ones past the
+ * leaves are inserted one by one. Falls back to a bulk load of the entries
+ * when the leaves do not fit. */
+void spatialTypeLoadIndex(ExGisObj *o, rtreeItem *items, int count, const int *counts, int leaves) {
+    spatial *s = o->s;
+    long long packed = 0;
+    for (int i = 0; i < leaves; i++) {
+        packed += counts[i];
+    }
+    if (packed > count || (uint64_t) count != RedisModule_DictSize(s->h) ||
+        !rtreeLoadLeaves(s->tr, items, counts, leaves)) {
+        spatialBuildIndex(s);
+        return;
+    }
+    for (int i = (int) packed; i < count; i++) {
+        rtreeInsert(s->tr, items[i].minX, items[i].minY, items[i].maxX, items[i].maxY, items[i].item);
+    }
+}
 
-    GisModule_DictInsertOrUpdate(s->h, field, val);
+/* Rebuilds the rtree from all the entries with a packed bulk load. */
+void spatialTypeBuildIndex(ExGisObj *o) {
+    spatialBuildIndex(o->s);
+}
 
-    /* update the rtree */
-    rtreeInsert(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, s->idx);
+static void spatialBuildIndex(spatial *s) {
+    uint64_t size = RedisModule_DictSize(s->h);
+    rtreeItem *items = RedisModule_Alloc(sizeof(rtreeItem) * (size ? size : 1));
+    int count = 0;
 
+    size_t keylen;
+    spatialEntry *e;
+    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(s->h, "^", NULL, 0);
+    while (RedisModule_DictNextC(iter, &keylen, (void **) &e) != NULL) {
+        items[count].minX = e->minX;
+        items[count].minY = e->minY;
+        items[count].maxX = e->maxX;
+        items[count].maxY = e->maxY;
+        items[count].item = e;
+        count++;
+        e->pending = 0;
+    }
+    RedisModule_DictIteratorStop(iter);
+    s->plen = 0;
+
+    rtreeLoad(s->tr, items, count);
+    RedisModule_Free(items);
+}
+
+/* Changes the rtree flags of the key, rebuilding the rtree when its
+ * precision changes. Returns 0 when out of memory, the old rtree is then
+ * kept. */
+int spatialTypeSetIndexFlags(ExGisObj *o, int flags) {
+    spatial *s = o->s;
+    if (rtreeSetFlags(s->tr, flags)) {
+        return 1;
+    }
+    rtree *tr = spatialNewIndex(flags);
+    if (!tr) {
+        return 0;
+    }
+    rtreeFree(s->tr);
+    s->tr = tr;
+    spatialTypeBuildIndex(o);
     return 1;
 }
 
-RedisModuleString *decodeOrReply(RedisModuleCtx *ctx, const char *value) {
+/* Sets many fields at once. When the batch is at least as large as the key
+ * the rtree is rebuilt with a bulk load instead of inserting one by one. */
+int spatialTypeMSet(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString **fields,
+                    RedisModuleString **vals, int count) {
+    spatial *s = o->s;
+    /* the fences need to see every member change on its own */
+    if ((uint64_t) count < RedisModule_DictSize(s->h) || (ctx && fs)) {
+        for (int i = 0; i < count; i++) {
+            spatialTypeSet(ctx, o, fs, fields[i], vals[i]);
+        }
+        return count;
+    }
+
+    for (int i = 0; i < count; i++) {
+        spatialEntry *e = spatialTypeGetEntry(s, fields[i]);
+        if (e && spatialEntryShared(s, e)) {
+            /* replaced for the snapshots, the rtree is rebuilt below */
+            RedisModule_DictDel(s->h, fields[i], NULL);
+            s->used -= spatialEntryMemUsage(e);
+            spatialEntryRelease(s, e);
+            e = NULL;
+        }
+        if (e) {
+            s->used -= spatialEntryMemUsage(e);
+            spatialEntryDropPolyMap(e);
+            GisModule_FreeStringSafe(NULL, e->value);
+            e->value = RedisModule_CreateStringFromString(NULL, vals[i]);
+            s->used += spatialEntryMemUsage(e);
+            spatialEntrySetBounds(e);
+        } else {
+            spatialTypeAppend(o, RedisModule_CreateStringFromString(NULL, fields[i]),
+                              RedisModule_CreateStringFromString(NULL, vals[i]));
+        }
+    }
+    spatialTypeBuildIndex(o);
+    return count;
+}
+
+/* Decodes a WKT, GeoJSON or WKB value, WKB may hold NUL bytes so the
+ * length of the value is needed. */
+RedisModuleString *decodeOrReply(RedisModuleCtx *ctx, const char *value, size_t len) {
     geom g = NULL;
     int sz = 0;
-    geomErr err = geomDecode(value, strlen(value), 0, &g, &sz);
+    geomErr err = geomDecode(value, len, 0, &g, &sz);
     if (err != GEOM_ERR_NONE) {
         RedisModule_ReplyWithError(ctx, "ERR invalid geometry");
         return NULL;
@@ -141,15 +941,17 @@ RedisModuleString *decodeOrReply(RedisModuleCtx *ctx, const char *value) {
 }
 
 int matchSearch(
-        geom g, geomPolyMap *targetMap,
+        spatialEntry *e, geomPolyMap *targetMap,
         int targetType, int searchType,
-        geomCoord center, double meters
+        geomCoord center, double meters, spatial *cache
 ) {
     int match = 0;
+    geom g = (geom) RedisModule_StringPtrLen(e->value, NULL);
     if (geomIsSimplePoint(g) && targetType == RADIUS) {
         match = geomCoordWithinRadius(geomCenter(g), center, meters);
     } else {
-        geomPolyMap *m = geomNewPolyMap(g);
+        int cached = 0;
+        geomPolyMap *m = spatialEntryPolyMap(e, &cached, cache);
         if (!m) {
             return 0;
         }
@@ -162,55 +964,130 @@ int matchSearch(
         } else if(searchType == EX_INTERSECTS) {
             match = geomPolyMapExIntersects(m,targetMap);
         }
-        geomFreePolyMap(m);
+        if (!cached) geomFreePolyMap(m);
     }
     return match;
 }
 
-int RedisModule_StringPtrIsEmpty(const char *str) {
-    return strcmp(str, "(NULL string reply referenced in module)");
+/* the distance from center to the points of a rect is the largest at one
+ * of its corners, as long as the rect stays on the side of the meridian
+ * opposite to the center. */
+static int rectWithinRadius(double minX, double minY, double maxX, double maxY, geomCoord center, double meters) {
+    if (minX - center.x < -180 || maxX - center.x > 180) {
+        return 0;
+    }
+    geomCoord corner;
+    memset(&corner, 0, sizeof(geomCoord));
+    for (int i = 0; i < 4; i++) {
+        corner.x = i & 1 ? maxX : minX;
+        corner.y = i & 2 ? maxY : minY;
+        if (!geomCoordWithinRadius(corner, center, meters)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-int spatialTypeDelete(ExGisObj *o, RedisModuleString *field, geomRect *rin, int *isEmpty) {
-    geomRect r;
-    RedisModuleString *sidx;
-    char *idx;
-    int res;
-    spatial *s = o->s;
-    const char *cstr = NULL;
-    size_t len = 0;
+static int countClassify(double minX, double minY, double maxX, double maxY, void *userdata) {
+    searchContext *ctx = userdata;
+    geomRect b = ctx->bounds;
+    if (minX > b.max.x || maxX < b.min.x || minY > b.max.y || maxY < b.min.y) {
+        return RTREE_OUTSIDE;
+    }
+    if (minX < b.min.x || maxX > b.max.x || minY < b.min.y || maxY > b.max.y) {
+        return RTREE_PARTIAL;
+    }
+    /* the points are matched against the circle, the other members
+     * against its polygon: a rect inside both holds only matches. */
+    if (ctx->targetType == RADIUS && !rectWithinRadius(minX, minY, maxX, maxY, ctx->center, ctx->meters)) {
+        return RTREE_PARTIAL;
+    }
+    geomRect rect;
+    memset(&rect, 0, sizeof(geomRect));
+    rect.min.x = minX;
+    rect.min.y = minY;
+    rect.max.x = maxX;
+    rect.max.y = maxY;
+    int sz = 0;
+    geom g = geomNewRectPolygon(rect, &sz);
+    if (!g) {
+        return RTREE_PARTIAL;
+    }
+    int within = 0;
+    geomPolyMap *m = geomNewPolyMap(g);
+    if (m) {
+        within = geomPolyMapWithin(m, ctx->m);
+        geomFreePolyMap(m);
+    }
+    geomFree(g);
+    return within ? RTREE_INSIDE : RTREE_PARTIAL;
+}
 
-    /* get the idx */
-    sidx = hashTypeGetRedisModuleString(s->keyhash, field);
-    cstr = RedisModule_StringPtrLen(sidx, &len);
-    if (!RedisModule_StringPtrIsEmpty(cstr) || len != 8) return 0;
-    idx = (char *) (*((uint64_t *) cstr));
+static int countMatch(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
+    searchContext *ctx = userdata;
+    return matchSearch(item, ctx->m, ctx->targetType, INTERSECTS, ctx->center, ctx->meters, ctx->s);
+}
 
-    geom g = NULL;
-    if (rin) {
-        r = *rin;
-    } else {
-        const void *raw = hashTypeGetRaw(s->h, field);
-        if (!raw) return 0;
-        g = (geom) raw;
-        r = geomBounds(g);
+#define COUNT_SAMPLES 4
+
+/* the fraction of a grid of COUNT_SAMPLES x COUNT_SAMPLES points of the
+ * rect that lies in the target. */
+static double countEstimate(double minX, double minY, double maxX, double maxY, void *userdata) {
+    searchContext *ctx = userdata;
+    geomCoord c;
+    memset(&c, 0, sizeof(geomCoord));
+    int inside = 0;
+    for (int i = 0; i < COUNT_SAMPLES; i++) {
+        c.x = minX + (maxX - minX) * (i + 0.5) / COUNT_SAMPLES;
+        for (int j = 0; j < COUNT_SAMPLES; j++) {
+            c.y = minY + (maxY - minY) * (j + 0.5) / COUNT_SAMPLES;
+            if (ctx->targetType == RADIUS) {
+                inside += geomCoordWithinRadius(c, ctx->center, ctx->meters);
+            } else {
+                inside += geomPolyMapCoordWithin(ctx->m, c);
+            }
+        }
     }
+    return (double) inside / (COUNT_SAMPLES * COUNT_SAMPLES);
+}
 
-    rtreeRemove(s->tr, r.min.x, r.min.y, r.max.x, r.max.y, idx);
+/* Counts the members intersecting the target of ctx, see rtreeCountIn. */
+void spatialTypeCount(searchContext *ctx, int approx, long long *count, long long *error) {
+    spatialTypeFlush(ctx->s);
+    rtreeCountIn(ctx->s->tr, ctx->bounds.min.x, ctx->bounds.min.y, ctx->bounds.max.x, ctx->bounds.max.y,
+                 countClassify, countMatch, countEstimate, ctx, approx, count, error);
+}
 
-    RedisModuleString *o1 = NULL, *o2 = NULL, *o3 = NULL;
-    res = RedisModule_DictDel(s->h, field, &o1) || RedisModule_DictDel(s->idxhash, sidx, &o2) ||
-          RedisModule_DictDel(s->keyhash, field, &o3);
+int spatialTypeDelete(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString *field, int *isEmpty) {
+    spatial *s = o->s;
+    spatialEntry *e = NULL;
+
+    if (RedisModule_DictDel(s->h, field, &e) != REDISMODULE_OK) return 0;
 
-    GisModule_FreeStringSafe(NULL, o1);
-    GisModule_FreeStringSafe(NULL, o2);
-    GisModule_FreeStringSafe(NULL, o3);
+    fenceEval fe;
+    int fences = ctx && fs;
+    if (fences) {
+        fenceBegin(s, fs, e, NULL, &fe);
+    }
 
-    if (RedisModule_DictSize(s->keyhash) == 0 && isEmpty) {
+    if (e->pending) {
+        spatialBufferRemove(s, e);
+    } else {
+        rtreeRemove(s->tr, e->minX, e->minY, e->maxX, e->maxY, e);
+    }
+    s->used -= spatialEntryMemUsage(e);
+    spatialEntryRelease(s, e);
+
+    if (fences) {
+        fenceEnd(ctx, s, fs, NULL, field, &fe);
+    }
+
+    if (RedisModule_DictSize(s->h) == 0 && isEmpty) {
         *isEmpty = 1;
     }
 
-    return res == REDISMODULE_OK ? 1 : 0;
+    return 1;
 }
 
 /* Importing some stuff from t_hash.c but these should exist in server.h */
@@ -224,23 +1101,96 @@ void addGeomReplyBulkCBuffer(RedisModuleCtx *ctx, const void *p) {
     geomFreeWKT(wkt);
 }
 
+/* Reply with a stored geometry. WKB is the stored form so it is replied
+ * as is, without encoding or copying. */
+void addGeomValueToReply(RedisModuleCtx *ctx, RedisModuleString *value, int wkb) {
+    if (wkb) {
+        RedisModule_ReplyWithString(ctx, value);
+        return;
+    }
+    addGeomReplyBulkCBuffer(ctx, RedisModule_StringPtrLen(value, NULL));
+}
+
+static void addReplyCoord(RedisModuleCtx *ctx, double d) {
+    char dbuf[32];
+    int dlen = dtoa_grisu3(d, dbuf);
+    RedisModule_ReplyWithStringBuffer(ctx, dbuf, dlen);
+}
+
+/* Reply with the projection of a geometry selected by OUTPUT. The
+ * projections other than WKT and JSON are computed from the center or the
+ * cached bounds of the member and never walk the whole geometry. */
+void addGeomOutputToReply(RedisModuleCtx *ctx, spatialEntry *e, int output, int precision) {
+    const char *value = RedisModule_StringPtrLen(e->value, NULL);
+    geomCoord c;
+    char buf[32];
+
+    switch (output) {
+        case OUTPUT_WKB:
+            addGeomValueToReply(ctx, e->value, 1);
+            break;
+        case OUTPUT_JSON: {
+            char *json = geomEncodeJSON((geom) value);
+            if (!json) {
+                RedisModule_ReplyWithError(ctx, "ERR failed to encode json");
+                break;
+            }
+            RedisModule_ReplyWithStringBuffer(ctx, json, strlen(json));
+            geomFreeJSON(json);
+            break;
+        }
+        case OUTPUT_POINT:
+            c = geomCenter((geom) value);
+            RedisModule_ReplyWithArray(ctx, 2);
+            addReplyCoord(ctx, c.x);
+            addReplyCoord(ctx, c.y);
+            break;
+        case OUTPUT_BOUNDS:
+            RedisModule_ReplyWithArray(ctx, 4);
+            addReplyCoord(ctx, e->minX);
+            addReplyCoord(ctx, e->minY);
+            addReplyCoord(ctx, e->maxX);
+            addReplyCoord(ctx, e->maxY);
+            break;
+        case OUTPUT_HASH:
+            c = geomCenter((geom) value);
+            hashEncode(c.y, c.x, precision, buf);
+            RedisModule_ReplyWithStringBuffer(ctx, buf, strlen(buf));
+            break;
+        case OUTPUT_QUAD:
+            c = geomCenter((geom) value);
+            bingLatLongToQuadKey(c.y, c.x, precision, buf);
+            RedisModule_ReplyWithStringBuffer(ctx, buf, precision);
+            break;
+        case OUTPUT_TILE: {
+            int tileX, tileY;
+            c = geomCenter((geom) value);
+            bingLatLonToTileXY(c.y, c.x, precision, &tileX, &tileY);
+            RedisModule_ReplyWithArray(ctx, 2);
+            RedisModule_ReplyWithLongLong(ctx, tileX);
+            RedisModule_ReplyWithLongLong(ctx, tileY);
+            break;
+        }
+        default:
+            addGeomValueToReply(ctx, e->value, 0);
+            break;
+    }
+}
+
 /* These are direct copies from t_hash.c because they're defined as static and
  * I didn't want to change the source file. */
-void addGeomHashFieldToReply(RedisModuleCtx *ctx, ExGisObj *o, RedisModuleString *field) {
+void addGeomHashFieldToReply(RedisModuleCtx *ctx, ExGisObj *o, RedisModuleString *field, int flag) {
     if (o == NULL) {
         RedisModule_ReplyWithNull(ctx);
         return;
     }
-    RedisModuleString *vstr = NULL;
-    int nokey = 0;
-
-    vstr = RedisModule_DictGet(o->s->h, field, &nokey);
-    if (nokey == 1 || !vstr) {
+    spatialEntry *e = spatialTypeGetEntry(o->s, field);
+    if (!e) {
         RedisModule_ReplyWithNull(ctx);
         return;
     }
 
-    addGeomReplyBulkCBuffer(ctx, RedisModule_StringPtrLen(vstr, NULL));
+    addGeomValueToReply(ctx, e->value, flag & GIS_WITHWKB);
 }
 
 void addGeomHashAllToReply(RedisModuleCtx *ctx, ExGisObj *o, int flag) {
@@ -252,23 +1202,115 @@ void addGeomHashAllToReply(RedisModuleCtx *ctx, ExGisObj *o, int flag) {
     long size = (long) RedisModule_DictSize(o->s->h);
     RedisModule_ReplyWithArray(ctx, flag & GIS_WITHVALUE ? size * 2 : size);
 
-    void *field, *val;
+    size_t keylen;
+    spatialEntry *e;
     RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(
             o->s->h, "^", NULL, 0);
-    while ((field = RedisModule_DictNext(NULL, iter, &val)) != NULL) {
-        RedisModule_ReplyWithString(ctx, field);
+    while (RedisModule_DictNextC(iter, &keylen, (void **) &e) != NULL) {
+        RedisModule_ReplyWithString(ctx, e->field);
         if (flag & GIS_WITHVALUE) {
-            addGeomReplyBulkCBuffer(ctx, RedisModule_StringPtrLen(val, NULL));
+            addGeomValueToReply(ctx, e->value, flag & GIS_WITHWKB);
+        }
+    }
+    RedisModule_DictIteratorStop(iter);
+}
+
+/* GIS.SCAN walks the members in the order of their names. The cursor is "0"
+ * or the hex encoding of the last name visited, which stays valid while the
+ * key is modified: the members present for the whole scan are returned
+ * exactly once. */
+#define SCAN_DEFAULT_COUNT 10
+
+static int scanHexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* Visits up to ctx->count members after cursor and replies with the next
+ * cursor and those matching ctx->match. */
+int addGeomHashScanToReply(RedisModuleCtx *ctx, searchContext *sctx, RedisModuleString *cursor) {
+    static const char hex[] = "0123456789abcdef";
+    size_t len;
+    const char *c = RedisModule_StringPtrLen(cursor, &len);
+    char *last = NULL;
+    if (len != 1 || c[0] != '0') {
+        if (len % 2) {
+            RedisModule_ReplyWithError(ctx, "ERR invalid cursor");
+            return REDISMODULE_ERR;
+        }
+        last = RedisModule_Alloc(len / 2 + 1);
+        for (size_t i = 0; i < len / 2; i++) {
+            int hi = scanHexDigit(c[i * 2]), lo = scanHexDigit(c[i * 2 + 1]);
+            if (hi < 0 || lo < 0) {
+                RedisModule_Free(last);
+                RedisModule_ReplyWithError(ctx, "ERR invalid cursor");
+                return REDISMODULE_ERR;
+            }
+            last[i] = (char) (hi << 4 | lo);
         }
-        GisModule_FreeStringSafe(NULL, field);
+    }
+
+    long long count = sctx->count ? sctx->count : SCAN_DEFAULT_COUNT;
+    uint64_t size = RedisModule_DictSize(sctx->s->h);
+    spatialEntry **found = RedisModule_Alloc(((uint64_t) count < size ? (uint64_t) count : size + 1) * sizeof(spatialEntry *));
+    RedisModuleDictIter *iter = last ? RedisModule_DictIteratorStartC(sctx->s->h, ">", last, len / 2) :
+                                       RedisModule_DictIteratorStartC(sctx->s->h, "^", NULL, 0);
+    char *next = NULL;
+    size_t nextlen = 0;
+    long long visited = 0, n = 0;
+    size_t keylen;
+    spatialEntry *e;
+    char *key;
+    while (visited < count && (key = RedisModule_DictNextC(iter, &keylen, (void **) &e)) != NULL) {
+        visited++;
+        if (sctx->allfields || globMatch(&sctx->match, key, (int) keylen)) {
+            found[n++] = e;
+        }
+        if (visited == count) {
+            nextlen = keylen * 2;
+            next = RedisModule_Alloc(nextlen);
+            for (size_t i = 0; i < keylen; i++) {
+                next[i * 2] = hex[(unsigned char) key[i] >> 4];
+                next[i * 2 + 1] = hex[(unsigned char) key[i] & 15];
+            }
+        }
+    }
+    /* no cursor when the last member was just visited */
+    if (next && !RedisModule_DictNextC(iter, &keylen, NULL)) {
+        RedisModule_Free(next);
+        next = NULL;
     }
     RedisModule_DictIteratorStop(iter);
+    if (last) {
+        RedisModule_Free(last);
+    }
+
+    RedisModule_ReplyWithArray(ctx, 2);
+    if (next) {
+        RedisModule_ReplyWithStringBuffer(ctx, next, nextlen);
+        RedisModule_Free(next);
+    } else {
+        RedisModule_ReplyWithStringBuffer(ctx, "0", 1);
+    }
+    RedisModule_ReplyWithArray(ctx, sctx->flag & GIS_WITHVALUE ? n * 2 : n);
+    for (long long i = 0; i < n; i++) {
+        RedisModule_ReplyWithString(ctx, found[i]->field);
+        if (sctx->flag & GIS_WITHVALUE) {
+            addGeomOutputToReply(ctx, found[i], sctx->output, sctx->precision);
+        }
+    }
+    RedisModule_Free(found);
+    return REDISMODULE_OK;
 }
 
 /* Glob-style pattern matching. */
-// Move from redis src/util.c
-static int stringmatchlen(const char *pattern, int patternLen,
-                          const char *string, int stringLen, int nocase)
+// Move from redis src/util.c, including the fix that stops retrying longer
+// matches of a '*' once the rest of the pattern failed on the whole string,
+// which keeps patterns with many '*' from backtracking exponentially.
+static int stringmatchlenImpl(const char *pattern, int patternLen,
+                              const char *string, int stringLen, int nocase, int *skipLongerMatches)
 {
     while(patternLen && stringLen) {
         switch(pattern[0]) {
@@ -280,12 +1322,25 @@ static int stringmatchlen(const char *pattern, int patternLen,
                 if (patternLen == 1)
                     return 1; /* match */
                 while(stringLen) {
-                    if (stringmatchlen(pattern+1, patternLen-1,
-                                       string, stringLen, nocase))
+                    if (stringmatchlenImpl(pattern+1, patternLen-1,
+                                           string, stringLen, nocase, skipLongerMatches))
                         return 1; /* match */
+                    if (*skipLongerMatches)
+                        return 0; /* no match */
                     string++;
                     stringLen--;
                 }
+                /* There was no match for the rest of the pattern starting
+                 * from anywhere in the rest of the string. If there were
+                 * any '*' earlier in the pattern, we can terminate the
+                 * search early without trying to match them to longer
+                 * substrings. This is because a longer match for the
+                 * earlier part of the pattern would require the rest of the
+                 * pattern to match starting later in the string, and we
+                 * have just determined that there is no match for the rest
+                 * of the pattern starting from anywhere in the current
+                 * string. */
+                *skipLongerMatches = 1;
                 return 0; /* no match */
                 break;
             case '?':
@@ -389,49 +1444,121 @@ static int stringmatchlen(const char *pattern, int patternLen,
     return 0;
 }
 
-int searchIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
-    (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
+static int stringmatchlen(const char *pattern, int patternLen,
+                          const char *string, int stringLen, int nocase)
+{
+    int skipLongerMatches = 0;
+    return stringmatchlenImpl(pattern, patternLen, string, stringLen, nocase, &skipLongerMatches);
+}
 
-    searchContext *ctx = userdata;
+/* globCompile looks at a MATCH pattern once per query so that matching a
+ * member does not need to walk the pattern again:
+ *
+ *   GLOB_ALL     only '*', everything matches.
+ *   GLOB_EXACT   no special chars, a plain compare.
+ *   GLOB_STARS   literals separated by '*', the literal prefix and suffix are
+ *                compared in place and the middle literals are searched left
+ *                to right. A pure prefix pattern is a single memcmp.
+ *   GLOB_GENERIC uses '?', '[' or '\', the literal prefix is compared first
+ *                and the rest goes to stringmatchlen. */
+void globCompile(globPattern *g, const char *pattern, int len) {
+    memset(g, 0, sizeof(globPattern));
+    g->pattern = pattern;
+    g->len = len;
 
-    /* if limit reach, just return */
-    if ((ctx->limit != 0) && (ctx->len >= ctx->limit)) {
-        return 1;
+    int stars = 0;
+    g->prefixLen = -1;
+    for (int i = 0; i < len; i++) {
+        char c = pattern[i];
+        if (c == '?' || c == '[' || c == '\\') {
+            g->type = GLOB_GENERIC;
+            if (g->prefixLen == -1) {
+                g->prefixLen = i;
+            }
+            return;
+        }
+        if (c == '*') {
+            if (g->prefixLen == -1) {
+                g->prefixLen = i;
+            }
+            stars++;
+        }
     }
-
-    /* retrieve the field */
-    int nokey = 0;
-    uint64_t nidx = (uint64_t)item;
-    RedisModuleString *sidx = RedisModule_CreateString(NULL, (const char *) &nidx, 8);
-    RedisModuleString *field = RedisModule_DictGet(ctx->s->idxhash, sidx, &nokey);
-    GisModule_FreeStringSafe(NULL, sidx);
-    if (nokey == 1) {
-        return 1;
+    if (stars == 0) {
+        g->type = GLOB_EXACT;
+        g->prefixLen = len;
+        return;
     }
-
-    const char *fieldStr = NULL, *valueStr = NULL;
-    size_t filedLen, valueLen;
-    fieldStr = RedisModule_StringPtrLen(field, &filedLen);
-
-    if (!(ctx->allfields ||
-            stringmatchlen(ctx->pattern, (int) strlen(ctx->pattern), fieldStr, (int) filedLen, 0))) {
-        return 1;
+    if (stars == len) {
+        g->type = GLOB_ALL;
+        return;
+    }
+    g->type = GLOB_STARS;
+    while (pattern[len - g->suffixLen - 1] != '*') {
+        g->suffixLen++;
     }
+}
 
-    // retrieve the geom
-    RedisModuleString *value = RedisModule_DictGet(ctx->s->h, field, &nokey);
-    valueStr = RedisModule_StringPtrLen(value, &valueLen);
-    if (nokey == 1){
-        return 1;
+/* Returns the position of needle in haystack or NULL. */
+static const char *globFind(const char *haystack, int haystackLen, const char *needle, int needleLen) {
+    while (haystackLen >= needleLen) {
+        const char *p = memchr(haystack, needle[0], haystackLen - needleLen + 1);
+        if (!p) {
+            return NULL;
+        }
+        if (!memcmp(p, needle, needleLen)) {
+            return p;
+        }
+        haystackLen -= (int)(p - haystack) + 1;
+        haystack = p + 1;
     }
+    return NULL;
+}
 
-    geom g = (geom)valueStr;
+int globMatch(globPattern *g, const char *str, int len) {
+    switch (g->type) {
+        case GLOB_ALL:
+            return 1;
+        case GLOB_EXACT:
+            return len == g->len && !memcmp(str, g->pattern, len);
+        case GLOB_GENERIC:
+            if (len < g->prefixLen || memcmp(str, g->pattern, g->prefixLen)) {
+                return 0;
+            }
+            return stringmatchlen(g->pattern + g->prefixLen, g->len - g->prefixLen,
+                                  str + g->prefixLen, len - g->prefixLen, 0);
+    }
 
-    int match = matchSearch(g, ctx->m, ctx->targetType, ctx->searchType, ctx->center, ctx->meters);
-    if (!match){
-        return 1;
+    // GLOB_STARS
+    if (len < g->prefixLen + g->suffixLen ||
+        memcmp(str, g->pattern, g->prefixLen) ||
+        memcmp(str + len - g->suffixLen, g->pattern + g->len - g->suffixLen, g->suffixLen)) {
+        return 0;
+    }
+    // the literals between the first and the last '*', leftmost first.
+    const char *p = g->pattern + g->prefixLen;
+    const char *pend = g->pattern + g->len - g->suffixLen;
+    const char *s = str + g->prefixLen;
+    const char *send = str + len - g->suffixLen;
+    while (p < pend) {
+        if (*p == '*') {
+            p++;
+            continue;
+        }
+        const char *lit = p;
+        while (p < pend && *p != '*') {
+            p++;
+        }
+        const char *found = globFind(s, (int)(send - s), lit, (int)(p - lit));
+        if (!found) {
+            return 0;
+        }
+        s = found + (p - lit);
     }
-    // append item
+    return 1;
+}
+
+static int appendResult(searchContext *ctx, spatialEntry *e, double distance) {
     if (ctx->len == ctx->cap) {
         int ncap = ctx->cap;
         if (ncap == 0){
@@ -441,7 +1568,8 @@ int searchIterator(double minX, double minY, double maxX, double maxY, void *ite
         }
         resultItem *nresults = RedisModule_Realloc(ctx->results, ncap*sizeof(resultItem));
         if (!nresults){
-            RedisModule_ReplyWithError(ctx->c, "ERR out of memory");
+            /* the workers have no client, spatialTypeSearch replies */
+            if (ctx->c) RedisModule_ReplyWithError(ctx->c, "ERR out of memory");
             ctx->fail = 1;
             return 0;
         }
@@ -449,13 +1577,366 @@ int searchIterator(double minX, double minY, double maxX, double maxY, void *ite
         ctx->cap = ncap;
     }
 
-    ctx->results[ctx->len].field = field;
-    ctx->results[ctx->len].value = value;
+    ctx->results[ctx->len].field = e->field;
+    ctx->results[ctx->len].value = e->value;
+    ctx->results[ctx->len].entry = e;
+    ctx->results[ctx->len].distance = distance;
     ctx->len++;
+    return 1;
+}
 
+/* With COUNT only the count best results are kept, in a binary heap whose
+ * root is the worst of them: the farthest for ASC, the nearest for DESC.
+ * This keeps the results at O(count) and the selection at O(n log count)
+ * however many members match. */
+static int topKWorse(searchContext *ctx, double a, double b) {
+    return (ctx->flag & GIS_SORT_DESC) ? a < b : a > b;
+}
+
+static int topKResult(searchContext *ctx, spatialEntry *e) {
+    geomCoord c = geomCenter((geom) RedisModule_StringPtrLen(e->value, NULL));
+    double distance = geoutilDistance(c.y, c.x, ctx->center.y, ctx->center.x) / ctx->to_meters;
+
+    int index;
+    if (ctx->len < ctx->count) {
+        if (!appendResult(ctx, e, distance)) {
+            return 0;
+        }
+        index = ctx->len - 1;
+        while (index > 0) {
+            int parent = (index - 1) / 2;
+            if (!topKWorse(ctx, distance, ctx->results[parent].distance)) {
+                break;
+            }
+            ctx->results[index] = ctx->results[parent];
+            index = parent;
+        }
+    } else {
+        if (!topKWorse(ctx, ctx->results[0].distance, distance)) {
+            return 1;
+        }
+        index = 0;
+        for (;;) {
+            int child = index * 2 + 1;
+            if (child >= ctx->len) {
+                break;
+            }
+            if (child + 1 < ctx->len &&
+                topKWorse(ctx, ctx->results[child + 1].distance, ctx->results[child].distance)) {
+                child++;
+            }
+            if (!topKWorse(ctx, ctx->results[child].distance, distance)) {
+                break;
+            }
+            ctx->results[index] = ctx->results[child];
+            index = child;
+        }
+    }
+    ctx->results[index].field = e->field;
+    ctx->results[index].value = e->value;
+    ctx->results[index].entry = e;
+    ctx->results[index].distance = distance;
     return 1;
 }
 
+int searchIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
+
+    searchContext *ctx = userdata;
+
+    /* if limit reach, just return */
+    if ((ctx->limit != 0) && (ctx->matched >= ctx->limit)) {
+        return 1;
+    }
+
+    spatialEntry *e = item;
+    const char *fieldStr = NULL;
+    size_t filedLen;
+    fieldStr = RedisModule_StringPtrLen(e->field, &filedLen);
+
+    if (!(ctx->allfields || globMatch(&ctx->match, fieldStr, (int) filedLen))) {
+        return 1;
+    }
+
+    int match = matchSearch(e, ctx->m, ctx->targetType, ctx->searchType, ctx->center, ctx->meters,
+                            ctx->snapshot ? NULL : ctx->s);
+    if (!match){
+        return 1;
+    }
+    ctx->matched++;
+    if (ctx->output == OUTPUT_COUNT) {
+        return 1;
+    }
+    if (ctx->count != 0) {
+        return topKResult(ctx, e);
+    }
+    if (!appendResult(ctx, e, 0)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/* A search over a large key is split in subtrees, see rtreeSearchSplit,
+ * which the workers search with their own copy of the context. The main
+ * thread waits for them, the key can not change meanwhile, then merges
+ * their results. */
+#define PARALLEL_PARTS_PER_WORKER 8
+
+typedef struct parallelSearch {
+    searchContext *ctxs;    // one per worker.
+    void **parts;
+} parallelSearch;
+
+static void parallelSearchTask(void *arg, int worker, int task) {
+    parallelSearch *p = arg;
+    searchContext *ctx = &p->ctxs[worker];
+    if (!ctx->fail) {
+        rtreeSearchPart(ctx->s->tr, p->parts[task], ctx->bounds.min.x, ctx->bounds.min.y,
+                        ctx->bounds.max.x, ctx->bounds.max.y, searchIterator, ctx);
+    }
+}
+
+/* Searches the members matching ctx, on the workers when there are some
+ * and the key holds at least spatialParallelMinMembers members. LIMIT
+ * stops at the first matches found and always runs on the main thread. */
+void spatialTypeSearch(searchContext *ctx) {
+    spatial *s = ctx->s;
+    int workers = workersCount();
+    if (workers < 2 || ctx->limit != 0 || RedisModule_DictSize(s->h) < (uint64_t) spatialParallelMinMembers) {
+        spatialSearch(s, ctx->bounds.min.x, ctx->bounds.min.y, ctx->bounds.max.x, ctx->bounds.max.y,
+                      searchIterator, ctx);
+        return;
+    }
+
+    spatialTypeFlush(s);
+    void *parts[WORKERS_MAX * PARALLEL_PARTS_PER_WORKER];
+    int count = rtreeSearchSplit(s->tr, ctx->bounds.min.x, ctx->bounds.min.y, ctx->bounds.max.x,
+                                 ctx->bounds.max.y, parts, workers * PARALLEL_PARTS_PER_WORKER);
+    searchContext ctxs[WORKERS_MAX];
+    for (int i = 0; i < workers; i++) {
+        ctxs[i] = *ctx;
+        ctxs[i].c = NULL;
+        ctxs[i].results = NULL;
+        ctxs[i].len = ctxs[i].cap = 0;
+        ctxs[i].matched = 0;
+    }
+    parallelSearch p = {ctxs, parts};
+    spatialPolyMapCacheFrozen++;
+    workersRunTasks(count, parallelSearchTask, &p);
+    spatialPolyMapCacheFrozen--;
+
+    int fail = 0;
+    for (int i = 0; i < workers; i++) {
+        searchContext *w = &ctxs[i];
+        ctx->matched += w->matched;
+        fail |= w->fail;
+        for (int j = 0; j < w->len && !ctx->fail; j++) {
+            if (ctx->count != 0) {
+                topKResult(ctx, w->results[j].entry);
+            } else {
+                appendResult(ctx, w->results[j].entry, w->results[j].distance);
+            }
+        }
+        if (w->results) {
+            RedisModule_Free(w->results);
+        }
+    }
+    if (fail && !ctx->fail) {
+        RedisModule_ReplyWithError(ctx->c, "ERR out of memory");
+        ctx->fail = 1;
+    }
+}
+
+/* Snapshots.
+ *
+ * A snapshot freezes a key for a search run off the main thread, while the
+ * main thread keeps changing the key. Taking one is O(1): the rtree is
+ * shared copy on write, see rtreeSnapshot, and so are the entries. The
+ * generation of the key is bumped and the entries of an older generation
+ * are not changed or freed anymore. A member set or deleted gets a new
+ * entry, or none, and the former one is retired with the current
+ * generation, to be freed once the snapshots taken up to it are gone. No
+ * polymap is cached while a snapshot is live, a search could read an entry
+ * while it gets one. */
+spatialSnapshot *spatialSnapshotNew(spatial *s) {
+    spatialTypeFlush(s);
+    spatialSnapshot *snap = RedisModule_Alloc(sizeof(spatialSnapshot));
+    snap->tr = rtreeSnapshot(s->tr);
+    if (!snap->tr) {
+        RedisModule_Free(snap);
+        return NULL;
+    }
+    if (s->llen == s->lcap) {
+        s->lcap = s->lcap ? s->lcap * 2 : 4;
+        s->live = RedisModule_Realloc(s->live, sizeof(unsigned long long) * s->lcap);
+    }
+    s->gen++;
+    s->shared = s->gen;
+    s->live[s->llen++] = s->gen;
+    __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+    snap->s = s;
+    snap->gen = s->gen;
+    spatialPolyMapCacheFrozen++;
+    return snap;
+}
+
+/* Releases a snapshot, and the entries only it could still read, then its
+ * reference on the key. Must be called on the main thread. */
+void spatialSnapshotFree(spatialSnapshot *snap) {
+    spatial *s = snap->s;
+    rtreeFree(snap->tr);
+    int i = 0;
+    while (s->live[i] != snap->gen) {
+        i++;
+    }
+    memmove(&s->live[i], &s->live[i + 1], (s->llen - i - 1) * sizeof(unsigned long long));
+    s->llen--;
+    spatialPolyMapCacheFrozen--;
+    RedisModule_Free(snap);
+
+    /* an entry retired in a generation is read by the snapshots taken up
+     * to it, and they are retired oldest first. */
+    int n = 0;
+    while (n < s->rlen && (s->llen == 0 || s->retired[n].gen < s->live[0])) {
+        spatialEntryFree(s->retired[n].e);
+        n++;
+    }
+    if (n > 0) {
+        memmove(s->retired, s->retired + n, (s->rlen - n) * sizeof(spatialRetired));
+        s->rlen -= n;
+    }
+    if (s->llen == 0) {
+        s->shared = 0;
+    }
+    spatialFree(s);
+}
+
+/* Searches the members matching ctx in the snapshot, on any thread. ctx
+ * has no client, a failure is only left in ctx->fail. */
+void spatialSnapshotSearch(spatialSnapshot *snap, searchContext *ctx) {
+    ctx->snapshot = 1;
+    rtreeSearch(snap->tr, ctx->bounds.min.x, ctx->bounds.min.y, ctx->bounds.max.x, ctx->bounds.max.y,
+                searchIterator, ctx);
+}
+
+/* nearestDistance is the distance function of the nearest search, it uses
+ * the same metric as the sorted search: the distance in meters between the
+ * center and the center of the geometry. Node rects get a lower bound. */
+double nearestDistance(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    searchContext *ctx = userdata;
+    if (!item) {
+        return geoutilRectDistance(ctx->center.y, ctx->center.x, minY, minX, maxY, maxX);
+    }
+    spatialEntry *e = item;
+    geomCoord c = geomCenter((geom) RedisModule_StringPtrLen(e->value, NULL));
+    return geoutilDistance(c.y, c.x, ctx->center.y, ctx->center.x);
+}
+
+int nearestIterator(double minX, double minY, double maxX, double maxY, void *item, double dist, void *userdata) {
+    (void)(minX);(void)(minY);(void)(maxX);(void)(maxY); // unused vars.
+
+    searchContext *ctx = userdata;
+    if (!ctx->allfields) {
+        size_t fieldLen;
+        const char *fieldStr = RedisModule_StringPtrLen(((spatialEntry *) item)->field, &fieldLen);
+        if (!globMatch(&ctx->match, fieldStr, (int) fieldLen)) {
+            return 1;
+        }
+    }
+    if (!appendResult(ctx, item, dist / ctx->to_meters)) {
+        return 0;
+    }
+    return ctx->len < ctx->count;
+}
+
+/* A paged search visits the members in the Z-order of the centers of their
+ * bounds, quantized to PAGE_BITS bits per axis. The order only depends on
+ * the members, not on the shape of the tree, so the cursor of a page, the
+ * key following its last member, stays valid while the key is modified:
+ * the members left as they are for the whole iteration are returned
+ * exactly once. A member moved or updated between the pages is returned
+ * again if its center crosses the cursor forward, skipped if it crosses
+ * it backward.
+ * The Z-order grows with each coordinate, so the key of the min corner of
+ * a node rect is a lower bound for the members below it, and the pages are
+ * read with the best first traversal of rtreeNearby. */
+#define PAGE_BITS 26
+
+static uint64_t pageQuantize(double v, double min, double max) {
+    double q = (v - min) / (max - min) * (1 << PAGE_BITS);
+    if (!(q > 0)) {
+        return 0;
+    }
+    if (q >= (1 << PAGE_BITS)) {
+        return (1 << PAGE_BITS) - 1;
+    }
+    return (uint64_t) q;
+}
+
+/* spreads the low 32 bits of v to the even bits. */
+static uint64_t pageSpread(uint64_t v) {
+    v &= 0xFFFFFFFFULL;
+    v = (v | (v << 16)) & 0x0000FFFF0000FFFFULL;
+    v = (v | (v << 8)) & 0x00FF00FF00FF00FFULL;
+    v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+    v = (v | (v << 2)) & 0x3333333333333333ULL;
+    v = (v | (v << 1)) & 0x5555555555555555ULL;
+    return v;
+}
+
+/* the key fits the 53 bits of a double mantissa. */
+static double pageKey(double x, double y) {
+    return (double) (pageSpread(pageQuantize(x, -180, 180)) | pageSpread(pageQuantize(y, -90, 90)) << 1);
+}
+
+typedef struct pageContext {
+    searchContext *ctx;
+    long long limit;    // members per page.
+    double cursor;      // the smallest key of the page.
+    double last;        // the key of the last member visited.
+    int more;           // members are left for the next pages.
+} pageContext;
+
+static double pageDistance(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+    pageContext *p = userdata;
+    geomRect *b = &p->ctx->bounds;
+    if (minX > b->max.x || maxX < b->min.x || minY > b->max.y || maxY < b->min.y) {
+        return INFINITY;
+    }
+    if (!item) {
+        return pageKey(maxX, maxY) < p->cursor ? INFINITY : pageKey(minX, minY);
+    }
+    spatialEntry *e = item;
+    double key = pageKey((e->minX + e->maxX) / 2, (e->minY + e->maxY) / 2);
+    return key < p->cursor ? INFINITY : key;
+}
+
+/* the page ends after limit matches, but not inside a run of members
+ * with the same key, which the cursor could not split. */
+static int pageIterator(double minX, double minY, double maxX, double maxY, void *item, double dist, void *userdata) {
+    pageContext *p = userdata;
+    if (p->ctx->matched >= p->limit && dist > p->last) {
+        p->more = 1;
+        return 0;
+    }
+    p->last = dist;
+    return searchIterator(minX, minY, maxX, maxY, item, p->ctx);
+}
+
+/* Searches the page of the members at cursor, 0 for the first page. At
+ * least limit matches are added to ctx unless the search is over. Returns
+ * the cursor of the next page, 0 after the last one, or -1 when running
+ * out of memory. */
+long long spatialTypeSearchPage(searchContext *ctx, long long cursor, long long limit) {
+    pageContext p = {ctx, limit, (double) cursor, 0, 0};
+    spatialTypeFlush(ctx->s);
+    if (rtreeNearby(ctx->s->tr, pageDistance, pageIterator, &p) == -1) {
+        return -1;
+    }
+    return p.more ? (long long) p.last + 1 : 0;
+}
+
 int sortDistanceAsc(const void *a, const void *b) {
     resultItem *da = (resultItem *)a, *db = (resultItem *)b;
     if (da->distance > db->distance) {
@@ -69,10 +69,30 @@
 #define OUTPUT_QUAD     9
 #define OUTPUT_TILE    10
 
+#define GLOB_ALL     0
+#define GLOB_EXACT   1
+#define GLOB_STARS   2
+#define GLOB_GENERIC 3
+
+/* globPattern is a MATCH pattern compiled by globCompile. The pattern is
+ * not copied and must outlive it. */
+typedef struct globPattern {
+    const char *pattern;
+    int len;
+    int type;
+    int prefixLen;  // literal chars before the first special char.
+    int suffixLen;  // literal chars after the last '*', GLOB_STARS only.
+} globPattern;
+
+/* fence is a standing query registered with GIS.FENCE. Every change of a
+ * member is matched against the fences whose bounds it overlaps and the
+ * detected events are published on the fence channel. */
 typedef struct fence {
-    //robj *channel;
+    RedisModuleString *channel; // where the events are published.
+    int detect;                 // FENCE_* events to publish.
     int allfields;
-    char *pattern;
+    char *pattern;              // owned copy of the MATCH pattern.
+    globPattern match;
     int targetType;
     geomCoord center;
     double meters;
@@ -80,33 +100,88 @@ typedef struct fence {
     geom g;
     int sz;
     geomPolyMap *m;
+    geomRect bounds;
+    unsigned long long epoch;   // the last change that visited the fence.
 } fence;
 
-typedef struct spatial {
-    RedisModuleDict *h;        // main hash store that persists to RDB.
-    rtree *tr;      // underlying spatial index.
+/* fenceSet holds the fences registered on an area, see spatialFenceSet. */
+typedef struct fenceSet {
     fence **fences; // the stored fences
     int fcap, flen; // the cap/len for fence array
+    rtree *ftr;     // the fences indexed on their bounds.
+    fence **outside;    // the fences that detect FENCE_OUTSIDE, also in fences.
+    int ocap, olen;     // the cap/len for outside array
+    unsigned long long fepoch; // bumped for every change checked against the fences.
+} fenceSet;
+
+/* spatialEntry is the record owned by a single member. The rtree stores a
+ * pointer to the entry as its item, so a search hit reaches the field and
+ * the value without any extra lookup. The bounds are cached so that removal
+ * does not need to walk the geometry again. */
+typedef struct spatialEntry {
+    RedisModuleString *field;  // the member name.
+    RedisModuleString *value;  // the geometry, stored as wkb.
+    double minX, minY, maxX, maxY; // cached bounds of the geometry.
+    geomPolyMap *m;            // cached polymap of the geometry, may be NULL.
+    void *leaf;                // rtree leaf holding the entry, see rtreeLinkItems.
+    int pending;               // 1 + slot in the write buffer, 0 if the rtree is up to date.
+    unsigned long long gen;    // the generation of the key it was created in, see spatialSnapshot.
+} spatialEntry;
+
+/* spatialRetired is an entry a snapshot may still read, freed once the
+ * snapshots taken up to its generation are gone. */
+typedef struct spatialRetired {
+    spatialEntry *e;
+    unsigned long long gen;
+} spatialRetired;
 
-    // The following fields are for mapping an idx to a key and
-    // vice versa. The rtree expects that each entry has a pointer to
-    // an object in memory. This should be the base address of the
-    // sds key that is stored in the main hash store, that way there is
-    // no extra memory overhead except a pointer. But at the moment I'm
-    // 100% sure how safe it is to expect that a key in the hash will
-    // not change it's base pointer address. So until further testing
-    // around hash key stability we will increment an idx pointer and
-    // map this value to a key, then assign this idx value to each
-    // rtree entry. This allows a reverse lookup to the key. This is a
-    // safe (albeit slower and higher mem usage) way to track entries.
-    char *idx;     // pointer that acts as a private id for entries.
-    RedisModuleDict *keyhash; // stores key -> idx
-    RedisModuleDict *idxhash; // stores idx -> key
+/* spatialPending is a member whose rtree item is out of date, see the write
+ * buffer in spatialTypeSet. */
+typedef struct spatialPending {
+    spatialEntry *e;
+    double minX, minY, maxX, maxY; // the bounds the rtree holds for the entry.
+    int indexed;                   // 0 if the entry is not in the rtree yet.
+} spatialPending;
+
+typedef struct spatial {
+    RedisModuleDict *h;        // main hash store: field -> spatialEntry.
+    rtree *tr;      // underlying spatial index, items are spatialEntry.
+    spatialPending *pending;   // the write buffer, merged into tr when full.
+    int pcap, plen;
+    int pmax;       // size of the write buffer, 0 disables it.
+    unsigned long long gen;     // generation of the entries created now.
+    unsigned long long shared;  // entries of an older generation are read only, 0 if none.
+    spatialRetired *retired;    // entries replaced or deleted while read only, oldest first.
+    int rcap, rlen;
+    unsigned long long *live;   // generations of the live snapshots, oldest first.
+    int lcap, llen;
+    int refs;       // the key and its live snapshots, see spatialFree.
+    size_t used;    // bytes of the members in h, see spatialEntryMemUsage.
 } spatial;
 
+/* spatialSnapshot is a read only view of a key as it was when taken, see
+ * spatialSnapshotNew, which other threads can search while the key keeps
+ * changing. */
+typedef struct spatialSnapshot {
+    spatial *s;
+    rtree *tr;      // rtreeSnapshot of the index.
+    unsigned long long gen;
+} spatialSnapshot;
+
+/* spatialInfo describes a key for GIS.INFO, see spatialTypeInfo. */
+typedef struct spatialInfo {
+    long long members;
+    long long pending;      // members in the write buffer.
+    size_t memory;          // see spatialMemUsage.
+    size_t indexMemory;     // bytes of the rtree.
+    rtreeStats index;
+    long long types[GEOM_GEOMETRYCOLLECTION + 1]; // members per geomType.
+} spatialInfo;
+
 typedef struct resultItem {
     RedisModuleString *field;
     RedisModuleString *value;
+    spatialEntry *entry;
     double distance;
 } resultItem;
 
@@ -118,15 +193,18 @@ typedef struct searchContext {
     int fail;
     int len;
     int cap;
+    long long matched;
     resultItem *results;
     long long cursor;
     char *pattern;
     int allfields;
+    globPattern match;
     int output;
     int precision;
     int nofields;
     int fence;
     int releaseg;
+    int snapshot;   // searching a spatialSnapshot, off the main thread.
 
     // bounds
     geomRect bounds;
@@ -152,16 +230,60 @@ typedef struct ExGisObj {
     spatial *s;
 } ExGisObj;
 
+extern size_t spatialPolyMapCacheLimit;
+extern int spatialRTreeFlags;
+extern int spatialWriteBuffer;
+extern long long spatialParallelMinMembers;
+extern long long spatialSnapshotMinMembers;
+
+#define SPATIAL_WRITE_BUFFER_MAX 4096
+#define SEARCH_PAGE_LIMIT 10    // matches per page of a search with CURSOR and no LIMIT.
+#define SPATIAL_PARALLEL_MIN_MEMBERS 100000
+#define SPATIAL_SNAPSHOT_MIN_MEMBERS 10000
+#define SPATIAL_LOAD_BATCH 4096     // members read before spatialTypeAppendBatch.
+
 spatial *spatialNew();
 void spatialFree(spatial *s);
-int spatialTypeSet(ExGisObj *o, RedisModuleString *field, RedisModuleString *val);
-int spatialTypeDelete(ExGisObj *o, RedisModuleString *field, geomRect *rin, int *isEmpty);
-RedisModuleString *decodeOrReply(RedisModuleCtx *ctx, const char *value);
-void addGeomHashFieldToReply(RedisModuleCtx *ctx, ExGisObj *o, RedisModuleString *field);
+int spatialTypeSet(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString *field, RedisModuleString *val);
+int spatialTypeMSet(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString **fields,
+                    RedisModuleString **vals, int count);
+int spatialTypeAppend(ExGisObj *o, RedisModuleString *field, RedisModuleString *val);
+int spatialTypeAppendBatch(ExGisObj *o, RedisModuleString **fields, RedisModuleString **vals, rtreeItem *items,
+                           const unsigned char *known, int count);
+void spatialTypeBuildIndex(ExGisObj *o);
+void spatialTypeLoadIndex(ExGisObj *o, rtreeItem *items, int count, const int *counts, int leaves);
+int spatialTypeSetIndexFlags(ExGisObj *o, int flags);
+void spatialTypeSetWriteBuffer(ExGisObj *o, int size);
+void spatialTypeFlush(spatial *s);
+int spatialSearch(spatial *s, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata);
+int spatialTypeDelete(RedisModuleCtx *ctx, ExGisObj *o, fenceSet *fs, RedisModuleString *field, int *isEmpty);
+void fenceFree(fence *f);
+fenceSet *spatialFenceSet(RedisModuleCtx *ctx, RedisModuleString *area, int create);
+int spatialFenceAdd(fenceSet *fs, fence *f);
+int spatialFenceRemove(RedisModuleCtx *ctx, RedisModuleString *area, RedisModuleString *channel);
+spatialEntry *spatialTypeGetEntry(spatial *s, RedisModuleString *field);
+void globCompile(globPattern *g, const char *pattern, int len);
+int globMatch(globPattern *g, const char *str, int len);
+RedisModuleString *decodeOrReply(RedisModuleCtx *ctx, const char *value, size_t len);
+void addGeomValueToReply(RedisModuleCtx *ctx, RedisModuleString *value, int wkb);
+void addGeomOutputToReply(RedisModuleCtx *ctx, spatialEntry *e, int output, int precision);
+void addGeomHashFieldToReply(RedisModuleCtx *ctx, ExGisObj *o, RedisModuleString *field, int flag);
 void addGeomHashAllToReply(RedisModuleCtx *ctx, ExGisObj *o, int flag);
+int addGeomHashScanToReply(RedisModuleCtx *ctx, searchContext *sctx, RedisModuleString *cursor);
+void spatialTypeCount(searchContext *ctx, int approx, long long *count, long long *error);
 int searchIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata);
+double nearestDistance(double minX, double minY, double maxX, double maxY, void *item, void *userdata);
+int nearestIterator(double minX, double minY, double maxX, double maxY, void *item, double dist, void *userdata);
+long long spatialTypeSearchPage(searchContext *ctx, long long cursor, long long limit);
+void spatialTypeSearch(searchContext *ctx);
+spatialSnapshot *spatialSnapshotNew(spatial *s);
+void spatialSnapshotFree(spatialSnapshot *snap);
+void spatialSnapshotSearch(spatialSnapshot *snap, searchContext *ctx);
 int sortDistanceAsc(const void *a, const void *b);
 int sortDistanceDesc(const void *a, const void *b);
+size_t spatialPolyMapCacheMemUsage();
+size_t spatialMemUsage(spatial *s);
+void spatialTypeInfo(spatial *s, spatialInfo *info);
 
 #endif // SPATIAL_H
 
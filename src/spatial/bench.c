@@ -0,0 +1,567 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "geom.h"
+#include "rtree.h"
+#include "zmalloc.h"
+
+/* Microbenchmarks for the rtree, the geometry codecs and the polymap
+ * predicates. The shape of each tree, see rtreeGetStats, is printed before
+ * its benchmarks. Every benchmark is run with a growing number of operations
+ * until it takes at least BENCH_MIN_NS, then the time and the number of
+ * allocations made through zmalloc are reported per operation.
+ *
+ * The datasets are generated from a fixed seed so two runs, or two
+ * builds, always work on the same input.
+ *
+ *   make bench
+ *   ./bench -r rtree      # only run the benchmarks matching 'rtree'
+ */
+
+#define BENCH_MIN_NS 200000000LL
+#define BENCH_MAX_N 100000000L
+
+#define RTREE_ITEMS 100000
+#define SEARCH_WINDOWS 4096
+#define CITIES 64
+#define PROBES 4096
+
+/* ========================= Allocation counting ========================= */
+
+static int counting = 0;
+static long long allocs = 0;
+static long long allocBytes = 0;
+
+static void *benchAlloc(size_t size){
+	if (counting){
+		allocs++;
+		allocBytes += size;
+	}
+	return malloc(size);
+}
+
+static void *benchRealloc(void *ptr, size_t size){
+	if (counting){
+		allocs++;
+		allocBytes += size;
+	}
+	return realloc(ptr, size);
+}
+
+static void benchFree(void *ptr){
+	free(ptr);
+}
+
+static void *benchCalloc(size_t nmemb, size_t size){
+	if (counting){
+		allocs++;
+		allocBytes += nmemb*size;
+	}
+	return calloc(nmemb, size);
+}
+
+/* ============================== Timing ================================= */
+
+typedef struct bench {
+	long n;                 // number of operations to run.
+	long long start;        // start of the current timed section.
+	long long elapsed;      // accumulated timed nanoseconds.
+} bench;
+
+static long long nanotime(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+/* benchStopTimer and benchStartTimer exclude setup work, such as building
+ * the tree that a remove benchmark is going to empty, from the results. */
+static void benchStopTimer(bench *b){
+	b->elapsed += nanotime()-b->start;
+	counting = 0;
+}
+
+static void benchStartTimer(bench *b){
+	counting = 1;
+	b->start = nanotime();
+}
+
+typedef void (*benchFunc)(bench *b, void *arg);
+
+static void benchRun(const char *name, benchFunc fn, void *arg){
+	bench b;
+	long n = 1;
+	long long ac = 0, ab = 0;
+	for (;;){
+		b.n = n;
+		b.elapsed = 0;
+		allocs = 0;
+		allocBytes = 0;
+		benchStartTimer(&b);
+		fn(&b, arg);
+		benchStopTimer(&b);
+		ac = allocs;
+		ab = allocBytes;
+		if (b.elapsed >= BENCH_MIN_NS || n >= BENCH_MAX_N){
+			break;
+		}
+		/* Aim a bit past the minimum so the last round is the one that
+		 * counts, like 'go test -bench' does. */
+		long long next = b.elapsed > 0 ? (long long)n*BENCH_MIN_NS/b.elapsed*6/5 : (long long)n*100;
+		if (next > (long long)n*100){
+			next = (long long)n*100;
+		}
+		if (next <= n){
+			next = n+1;
+		}
+		n = next > BENCH_MAX_N ? BENCH_MAX_N : (long)next;
+	}
+	printf("%-40s %10ld %14.1f ns/op %10.2f allocs/op %12.1f B/op\n", name, n,
+		(double)b.elapsed/n, (double)ac/n, (double)ab/n);
+	fflush(stdout);
+}
+
+/* ============================== Datasets =============================== */
+
+static uint64_t seed = 0x9E3779B97F4A7C15ULL;
+
+static void randSeed(uint64_t s){
+	seed = s ? s : 0x9E3779B97F4A7C15ULL;
+}
+
+/* xorshift64*, so the datasets do not depend on the libc rand(). */
+static uint64_t randNext(){
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return seed * 2685821657736338717ULL;
+}
+
+static double randd(){
+	return (randNext() >> 11) * (1.0/9007199254740992.0);
+}
+
+static rtreeItem *uniformPoints(int count){
+	rtreeItem *items = malloc(count*sizeof(rtreeItem));
+	randSeed(1);
+	for (int i=0;i<count;i++){
+		items[i].minX = items[i].maxX = randd()*360.0-180.0;
+		items[i].minY = items[i].maxY = randd()*170.0-85.0;
+		items[i].item = (void*)(long)(i+1);
+	}
+	return items;
+}
+
+/* clusteredPoints spreads the points around a few city centers, which is
+ * what most real datasets look like and is the worst case for the node
+ * splits of a tree tuned on uniform data. */
+static rtreeItem *clusteredPoints(int count){
+	double cx[CITIES], cy[CITIES];
+	rtreeItem *items = malloc(count*sizeof(rtreeItem));
+	randSeed(2);
+	for (int i=0;i<CITIES;i++){
+		cx[i] = randd()*300.0-150.0;
+		cy[i] = randd()*120.0-60.0;
+	}
+	for (int i=0;i<count;i++){
+		int c = (int)(randNext()%CITIES);
+		/* sum of uniforms, roughly normal with a ~0.3 degree spread. */
+		double dx = (randd()+randd()+randd()-1.5)*0.6;
+		double dy = (randd()+randd()+randd()-1.5)*0.6;
+		items[i].minX = items[i].maxX = cx[c]+dx;
+		items[i].minY = items[i].maxY = cy[c]+dy;
+		items[i].item = (void*)(long)(i+1);
+	}
+	return items;
+}
+
+/* zoneWKT returns a star shaped polygon of 'vertices' points around
+ * (0 0) with a radius between 0.5 and 1 degree. */
+static char *zoneWKT(int vertices, uint64_t s){
+	char *wkt = malloc((vertices+1)*64+32);
+	char *p = wkt;
+	randSeed(s);
+	p += sprintf(p, "POLYGON((");
+	double x0 = 0, y0 = 0;
+	for (int i=0;i<vertices;i++){
+		double a = 2*3.14159265358979323846*i/vertices;
+		double r = 0.5+randd()*0.5;
+		double x = cos(a)*r, y = sin(a)*r;
+		if (i == 0){
+			x0 = x;
+			y0 = y;
+		}
+		p += sprintf(p, "%.15g %.15g,", x, y);
+	}
+	sprintf(p, "%.15g %.15g))", x0, y0);
+	return wkt;
+}
+
+static geom decodeOrDie(const char *wkt){
+	geom g;
+	int sz;
+	geomErr err = geomDecode(wkt, strlen(wkt), 0, &g, &sz);
+	if (err != GEOM_ERR_NONE){
+		fprintf(stderr, "bench: %s: %s\n", geomErrText(err), wkt);
+		exit(1);
+	}
+	return g;
+}
+
+/* =============================== rtree ================================= */
+
+typedef struct rtreeArg {
+	rtreeItem *items;
+	int count;
+	int flags;              // flags of the trees, see rtreeNewWithFlags.
+	rtree *tr;              // prebuilt tree for the search benchmarks.
+	double windows[SEARCH_WINDOWS][4];
+} rtreeArg;
+
+static int countIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata){
+	(*(long*)userdata)++;
+	return 1;
+}
+
+static void benchRTreeInsert(bench *b, void *arg){
+	rtreeArg *a = arg;
+	rtree *tr = rtreeNewWithFlags(a->flags);
+	for (long i=0;i<b->n;i++){
+		rtreeItem *it = &a->items[i%a->count];
+		/* keep the tree at the dataset size, otherwise a long run measures
+		 * a much deeper tree than a short one. */
+		if (i && i%a->count == 0){
+			benchStopTimer(b);
+			rtreeFree(tr);
+			tr = rtreeNewWithFlags(a->flags);
+			benchStartTimer(b);
+		}
+		rtreeInsert(tr, it->minX, it->minY, it->maxX, it->maxY, it->item);
+	}
+	benchStopTimer(b);
+	rtreeFree(tr);
+	benchStartTimer(b);
+}
+
+static void benchRTreeSearch(bench *b, void *arg){
+	rtreeArg *a = arg;
+	long found = 0;
+	for (long i=0;i<b->n;i++){
+		double *w = a->windows[i%SEARCH_WINDOWS];
+		rtreeSearch(a->tr, w[0], w[1], w[2], w[3], countIterator, &found);
+	}
+}
+
+static void benchRTreeRemove(bench *b, void *arg){
+	rtreeArg *a = arg;
+	rtree *tr = NULL;
+	for (long i=0;i<b->n;i++){
+		if (i%a->count == 0){
+			benchStopTimer(b);
+			if (tr){
+				rtreeFree(tr);
+			}
+			tr = rtreeNewWithFlags(a->flags);
+			for (int j=0;j<a->count;j++){
+				rtreeItem *it = &a->items[j];
+				rtreeInsert(tr, it->minX, it->minY, it->maxX, it->maxY, it->item);
+			}
+			benchStartTimer(b);
+		}
+		rtreeItem *it = &a->items[i%a->count];
+		rtreeRemove(tr, it->minX, it->minY, it->maxX, it->maxY, it->item);
+	}
+	benchStopTimer(b);
+	rtreeFree(tr);
+	benchStartTimer(b);
+}
+
+/* moving objects: each op removes an item and inserts it back, the churn
+ * the node pool recycles. */
+static void benchRTreeMove(bench *b, void *arg){
+	rtreeArg *a = arg;
+	for (long i=0;i<b->n;i++){
+		rtreeItem *it = &a->items[(i*7919)%a->count];
+		rtreeRemove(a->tr, it->minX, it->minY, it->maxX, it->maxY, it->item);
+		rtreeInsert(a->tr, it->minX, it->minY, it->maxX, it->maxY, it->item);
+	}
+}
+
+typedef struct movingItem {
+	void *leaf;             // see rtreeLinkItems.
+	double x, y;
+} movingItem;
+
+/* the same churn through rtreeUpdate, moves of about 100m that mostly stay
+ * inside their leaf. */
+static void benchRTreeUpdate(bench *b, void *arg){
+	rtreeArg *a = arg;
+	benchStopTimer(b);
+	movingItem *m = malloc(a->count*sizeof(movingItem));
+	rtree *tr = rtreeNewWithFlags(a->flags);
+	rtreeLinkItems(tr, offsetof(movingItem, leaf));
+	for (int i=0;i<a->count;i++){
+		m[i].x = a->items[i].minX;
+		m[i].y = a->items[i].minY;
+		rtreeInsert(tr, m[i].x, m[i].y, m[i].x, m[i].y, &m[i]);
+	}
+	randSeed(4);
+	benchStartTimer(b);
+	for (long i=0;i<b->n;i++){
+		movingItem *it = &m[randNext()%a->count];
+		double x = it->x+(randd()-0.5)*0.002, y = it->y+(randd()-0.5)*0.002;
+		rtreeUpdate(tr, it->x, it->y, it->x, it->y, x, y, x, y, it);
+		it->x = x;
+		it->y = y;
+	}
+	benchStopTimer(b);
+	rtreeFree(tr);
+	free(m);
+	benchStartTimer(b);
+}
+
+static void rtreeArgInit(rtreeArg *a, rtreeItem *items, int count, int flags, double size){
+	a->items = items;
+	a->count = count;
+	a->flags = flags;
+	a->tr = rtreeNewWithFlags(flags);
+	for (int i=0;i<count;i++){
+		rtreeInsert(a->tr, items[i].minX, items[i].minY, items[i].maxX, items[i].maxY, items[i].item);
+	}
+	/* center the windows on items of the dataset so clustered data is
+	 * searched where it is dense. */
+	randSeed(3);
+	for (int i=0;i<SEARCH_WINDOWS;i++){
+		rtreeItem *it = &items[randNext()%count];
+		a->windows[i][0] = it->minX-size/2;
+		a->windows[i][1] = it->minY-size/2;
+		a->windows[i][2] = it->minX+size/2;
+		a->windows[i][3] = it->minY+size/2;
+	}
+}
+
+static void rtreeArgFree(rtreeArg *a){
+	rtreeFree(a->tr);
+}
+
+/* =============================== codecs ================================ */
+
+typedef struct geomArg {
+	char *wkt;
+	geom g;
+	geomPolyMap *m;
+	int vertices;
+} geomArg;
+
+static void benchGeomDecode(bench *b, void *arg){
+	geomArg *a = arg;
+	size_t len = strlen(a->wkt);
+	for (long i=0;i<b->n;i++){
+		geom g;
+		int sz;
+		if (geomDecode(a->wkt, len, 0, &g, &sz) == GEOM_ERR_NONE){
+			geomFree(g);
+		}
+	}
+}
+
+static void benchGeomEncodeWKT(bench *b, void *arg){
+	geomArg *a = arg;
+	for (long i=0;i<b->n;i++){
+		char *wkt = geomEncodeWKT(a->g, 0);
+		geomFreeWKT(wkt);
+	}
+}
+
+static void benchGeomNewPolyMap(bench *b, void *arg){
+	geomArg *a = arg;
+	for (long i=0;i<b->n;i++){
+		geomPolyMap *m = geomNewPolyMap(a->g);
+		geomFreePolyMap(m);
+	}
+}
+
+/* ============================= predicates ============================== */
+
+typedef int (*predicateFunc)(geomPolyMap *m1, geomPolyMap *m2);
+
+typedef struct predicateArg {
+	predicateFunc fn;
+	geomPolyMap **probes;   // PROBES small geometries around the zone.
+	geomPolyMap *zone;
+	int zoneFirst;          // call fn(zone, probe) instead of fn(probe, zone).
+} predicateArg;
+
+static void benchPredicate(bench *b, void *arg){
+	predicateArg *a = arg;
+	long hits = 0;
+	for (long i=0;i<b->n;i++){
+		geomPolyMap *p = a->probes[i%PROBES];
+		hits += a->zoneFirst ? a->fn(a->zone, p) : a->fn(p, a->zone);
+	}
+	if (hits < 0){
+		printf("%ld\n", hits);
+	}
+}
+
+/* probes returns PROBES points, or small squares, scattered over the
+ * bounds of the zones so about half of them fall inside. */
+static geomPolyMap **newProbes(int squares, geom *gs){
+	geomPolyMap **probes = malloc(PROBES*sizeof(geomPolyMap*));
+	char wkt[256];
+	randSeed(squares ? 5 : 4);
+	for (int i=0;i<PROBES;i++){
+		double x = randd()*2.4-1.2, y = randd()*2.4-1.2;
+		if (squares){
+			double d = 0.05;
+			sprintf(wkt, "POLYGON((%.15g %.15g,%.15g %.15g,%.15g %.15g,%.15g %.15g,%.15g %.15g))",
+				x, y, x+d, y, x+d, y+d, x, y+d, x, y);
+		} else {
+			sprintf(wkt, "POINT(%.15g %.15g)", x, y);
+		}
+		gs[i] = decodeOrDie(wkt);
+		probes[i] = geomNewPolyMap(gs[i]);
+	}
+	return probes;
+}
+
+static void freeProbes(geomPolyMap **probes, geom *gs){
+	for (int i=0;i<PROBES;i++){
+		geomFreePolyMap(probes[i]);
+		geomFree(gs[i]);
+	}
+	free(probes);
+}
+
+/* ================================ main ================================= */
+
+static const char *run = "";
+
+static int selected(const char *name){
+	return strlen(run) == 0 || strstr(name, run) != 0;
+}
+
+static void runRTree(const char *dataset, rtreeItem *items, int count, int flags){
+	char name[64];
+	rtreeArg *a = malloc(sizeof(rtreeArg));
+	rtreeArgInit(a, items, count, flags, 1.0);
+	sprintf(name, "rtreeStats/%s", dataset);
+	if (selected(name)){
+		rtreeStats st;
+		rtreeGetStats(a->tr, &st);
+		printf("%-40s height %d, %lld nodes, fill %.3f, overlap %.4f, %.1f MB\n", name,
+			st.height, st.nodes, st.fill, st.overlap, st.memory/1048576.0);
+	}
+	sprintf(name, "rtreeInsert/%s", dataset);
+	if (selected(name)) benchRun(name, benchRTreeInsert, a);
+	sprintf(name, "rtreeSearch/%s", dataset);
+	if (selected(name)) benchRun(name, benchRTreeSearch, a);
+	sprintf(name, "rtreeMove/%s", dataset);
+	if (selected(name)) benchRun(name, benchRTreeMove, a);
+	sprintf(name, "rtreeUpdate/%s", dataset);
+	if (selected(name)) benchRun(name, benchRTreeUpdate, a);
+	sprintf(name, "rtreeRemove/%s", dataset);
+	if (selected(name)) benchRun(name, benchRTreeRemove, a);
+	rtreeArgFree(a);
+	free(a);
+}
+
+static void runGeom(const char *dataset, geomArg *a){
+	char name[64];
+	sprintf(name, "geomDecode/%s", dataset);
+	if (selected(name)) benchRun(name, benchGeomDecode, a);
+	sprintf(name, "geomEncodeWKT/%s", dataset);
+	if (selected(name)) benchRun(name, benchGeomEncodeWKT, a);
+	sprintf(name, "geomNewPolyMap/%s", dataset);
+	if (selected(name)) benchRun(name, benchGeomNewPolyMap, a);
+}
+
+static void runPredicates(const char *dataset, geomArg *zone, geomPolyMap **points, geomPolyMap **squares){
+	struct {
+		const char *name;
+		predicateFunc fn;
+		int zoneFirst;
+	} preds[] = {
+		{ "geomPolyMapIntersects", geomPolyMapIntersects, 0 },
+		{ "geomPolyMapWithin", geomPolyMapWithin, 0 },
+		{ "geomPolyMapContains", geomPolyMapContains, 1 },
+		{ "geomPolyMapExIntersects", geomPolyMapExIntersects, 0 },
+	};
+	char name[96];
+	for (int i=0;i<sizeof(preds)/sizeof(preds[0]);i++){
+		predicateArg a = { preds[i].fn, points, zone->m, preds[i].zoneFirst };
+		sprintf(name, "%s/point/%s", preds[i].name, dataset);
+		if (selected(name)) benchRun(name, benchPredicate, &a);
+		a.probes = squares;
+		sprintf(name, "%s/square/%s", preds[i].name, dataset);
+		if (selected(name)) benchRun(name, benchPredicate, &a);
+	}
+}
+
+int main(int argc, const char **argv){
+	for (int i=1;i<argc;i++){
+		const char *arg = argv[i];
+		if (strcmp(arg, "-r") == 0 || strcmp(arg, "-run") == 0 || strcmp(arg, "--run") == 0){
+			if (i+1==argc){
+				fprintf(stderr, "argument '%s' requires a value\n", arg);
+				exit(-1);
+			}
+			run = argv[++i];
+		} else {
+			fprintf(stderr, "unknown argument '%s'\n", arg);
+			exit(-1);
+		}
+	}
+
+	RedisModule_Alloc = benchAlloc;
+	RedisModule_Realloc = benchRealloc;
+	RedisModule_Free = benchFree;
+	RedisModule_Calloc = benchCalloc;
+
+	rtreeItem *uniform = uniformPoints(RTREE_ITEMS);
+	rtreeItem *clustered = clusteredPoints(RTREE_ITEMS);
+	runRTree("uniform", uniform, RTREE_ITEMS, 0);
+	runRTree("clustered", clustered, RTREE_ITEMS, 0);
+	runRTree("uniform/float", uniform, RTREE_ITEMS, RTREE_FLOAT);
+	runRTree("clustered/float", clustered, RTREE_ITEMS, RTREE_FLOAT);
+	runRTree("uniform/rstar", uniform, RTREE_ITEMS, RTREE_RSTAR);
+	runRTree("clustered/rstar", clustered, RTREE_ITEMS, RTREE_RSTAR);
+	free(uniform);
+	free(clustered);
+
+	geomArg point = { "POINT(-112.2693 33.5123)" };
+	point.g = decodeOrDie(point.wkt);
+	runGeom("point", &point);
+	geomFree(point.g);
+
+	geom pointGeoms[PROBES], squareGeoms[PROBES];
+	geomPolyMap **points = newProbes(0, pointGeoms);
+	geomPolyMap **squares = newProbes(1, squareGeoms);
+
+	int sizes[] = { 10, 100, 1000, 10000 };
+	for (int i=0;i<sizeof(sizes)/sizeof(int);i++){
+		char dataset[32];
+		geomArg zone;
+		zone.vertices = sizes[i];
+		zone.wkt = zoneWKT(sizes[i], 6+i);
+		zone.g = decodeOrDie(zone.wkt);
+		zone.m = geomNewPolyMap(zone.g);
+		sprintf(dataset, "polygon%d", sizes[i]);
+		runGeom(dataset, &zone);
+		runPredicates(dataset, &zone, points, squares);
+		geomFreePolyMap(zone.m);
+		geomFree(zone.g);
+		free(zone.wkt);
+	}
+
+	freeProbes(points, pointGeoms);
+	freeProbes(squares, squareGeoms);
+	return 0;
+}
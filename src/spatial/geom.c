@@ -1229,6 +1229,95 @@ geomRect geomBounds(geom g){
     return levelAny_geomBounds((uint8_t*)g, NULL);
 }
 
+// Deepest nesting of geometry collections accepted in a wkb input, the
+// readers above recurse once per level.
+#define WKB_MAX_DEPTH 64
+
+// wkbLevelSize returns the bytes spanned by a count followed by that many
+// elements of the level below, down to level 1 where they are coords of
+// csz bytes. Returns 0 when it does not fit in the n bytes at p. A count is
+// checked against the bytes left before anything past it is read.
+static size_t wkbLevelSize(const uint8_t *p, size_t n, size_t csz, int level){
+    if (n < 4){
+        return 0;
+    }
+    uint32_t count;
+    memcpy(&count, p, 4);
+    size_t off = 4;
+    if (level == 1){
+        if (count > (n-off)/csz){
+            return 0;
+        }
+        return off+count*csz;
+    }
+    // every element holds at least its own count
+    if (count > (n-off)/4){
+        return 0;
+    }
+    for (uint32_t i=0;i<count;i++){
+        size_t sz = wkbLevelSize(p+off, n-off, csz, level-1);
+        if (!sz){
+            return 0;
+        }
+        off += sz;
+    }
+    return off;
+}
+
+// wkbSize walks the geometry at p the way levelAny_geomBounds reads it and
+// returns the bytes it spans, or 0 when the byte order is not the host's,
+// the type is unknown or a count does not fit in the n bytes at p.
+static size_t wkbSize(const uint8_t *p, size_t n, int depth){
+    if (n < 5 || p[0] != (LITTLE_ENDIAN?1:0) || depth > WKB_MAX_DEPTH){
+        return 0;
+    }
+    ghdr h = readhdr((uint8_t*)p+1);
+    size_t csz = (2+h.z+h.m)*8;
+    size_t off = 5, sz = 0;
+    switch (h.type){
+    default:
+        return 0;
+    case GEOM_POINT:
+        sz = n-off < csz ? 0 : csz;
+        break;
+    case GEOM_MULTIPOINT:
+    case GEOM_LINESTRING:
+        sz = wkbLevelSize(p+off, n-off, csz, 1);
+        break;
+    case GEOM_POLYGON:
+    case GEOM_MULTILINESTRING:
+        sz = wkbLevelSize(p+off, n-off, csz, 2);
+        break;
+    case GEOM_MULTIPOLYGON:
+        sz = wkbLevelSize(p+off, n-off, csz, 3);
+        break;
+    case GEOM_GEOMETRYCOLLECTION:{
+        if (n-off < 4){
+            return 0;
+        }
+        uint32_t count;
+        memcpy(&count, p+off, 4);
+        sz = 4;
+        // every geometry holds at least its header
+        if (count > (n-off-sz)/5){
+            return 0;
+        }
+        for (uint32_t i=0;i<count;i++){
+            size_t gsz = wkbSize(p+off+sz, n-off-sz, depth+1);
+            if (!gsz){
+                return 0;
+            }
+            sz += gsz;
+        }
+        break;
+    }
+    }
+    if (!sz){
+        return 0;
+    }
+    return off+sz;
+}
+
 geomErr geomDecodeWKB(const void *input, size_t length, geom *g, int *size){
     geomErr err;
     char *p = (char*)input;
@@ -1236,9 +1325,12 @@ geomErr geomDecodeWKB(const void *input, size_t length, geom *g, int *size){
         err = GEOM_ERR_INPUT;
         goto err;
     }
-    // TODO: check and translate wkb BE/LE to host and verify that the binary is correct.
-    // Until that happens, crashes could occur when loading data from a incompatible 
-    // byte order CPU, and buffer overflows for invalid inputs.
+    // The wkb is kept as is, in the host byte order, and read without
+    // bounds checks afterwards. It must span exactly length bytes.
+    if (wkbSize((uint8_t*)input, length, 0) != length){
+        err = GEOM_ERR_INPUT;
+        goto err;
+    }
     switch (p[0]){
     default:
         err = GEOM_ERR_INPUT;
@@ -1570,6 +1662,14 @@ int geomCoordWithinRadius(geomCoord c, geomCoord center, double meters){
     return geoutilDistance(c.y, c.x, center.y, center.x) <= meters ? 1 : 0;
 }
 
+static int pointWithin(polyPoint a, geomPolyMap *m);
+
+// geomPolyMapCoordWithin returns 1 if the coordinate is within the geometries of m.
+int geomPolyMapCoordWithin(geomPolyMap *m, geomCoord c){
+    polyPoint a = {c.x, c.y};
+    return pointWithin(a, m);
+}
+
 static int pointContains(polyPoint a, geomPolyMap *m){
     for (int i=0;i<m->polygonCount;i++){
         switch (m->types[i]){
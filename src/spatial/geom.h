@@ -159,12 +159,14 @@ typedef struct geomPolyMap{
 
 void geomFreePolyMap(geomPolyMap *m);
 geomPolyMap *geomNewPolyMap(geom g);
+size_t geomPolyMapMemUsage(geomPolyMap *m);
 
 int geomPolyMapIntersects(geomPolyMap *m1, geomPolyMap *m2);
 int geomPolyMapWithin(geomPolyMap *m1, geomPolyMap *m2);
 
 int geomPolyMapContains(geomPolyMap *m1, geomPolyMap *m2);
 int geomPolyMapExIntersects(geomPolyMap *m1, geomPolyMap *m2);
+int geomPolyMapCoordWithin(geomPolyMap *m, geomCoord c);
 
 #if defined(__cplusplus)
 }
@@ -93,7 +93,7 @@ static geomPolyMap *geomNewPolyMapBase(geom g){
 			goto err;
 		}
 	} else {
-		m->geoms = &g;
+		m->geoms = &m->g;
 		m->geomCount = 1;
 	}
 	m->type = h.type;
@@ -343,3 +343,21 @@ err:
 geomPolyMap *geomNewPolyMap(geom g){
 	return geomNewPolyMapBase(g);
 }
+
+/* geomPolyMapMemUsage returns the number of bytes allocated by the polymap,
+ * not including the geometry it points to. */
+size_t geomPolyMapMemUsage(geomPolyMap *m){
+	if (!m){
+		return 0;
+	}
+	size_t sz = sizeof(geomPolyMap);
+	if (m->collection){
+		sz += m->geomCount*sizeof(geom);
+	}
+	if (m->multipoly){
+		sz += m->polygonCount*(sizeof(polyPolygon)+sizeof(polyMultiPolygon)+sizeof(geomType));
+	} else if (m->types){
+		sz += sizeof(geomType);
+	}
+	return sz;
+}
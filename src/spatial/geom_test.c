@@ -483,19 +483,61 @@ int test_GeomGeometryCollection(){
     return 1;
 }
 
+// testGeomWKBLength checks that the wkb of wkt decodes and that the same
+// bytes cut short or followed by another byte do not.
+static void testGeomWKBLength(char *wkt){
+    geom g = NULL;
+    int sz = 0;
+    geomErr err = geomDecodeWKT(wkt, 0, &g, &sz);
+    assert(err == GEOM_ERR_NONE);
+    assert(geomDecodeWKB(g, sz, NULL, NULL) == GEOM_ERR_NONE);
+    for (int i=1;i<sz;i++){
+        assert(geomDecodeWKB(g, i, NULL, NULL) == GEOM_ERR_INPUT);
+    }
+    uint8_t *longer = zmalloc(sz+1);
+    memcpy(longer, g, sz);
+    longer[sz] = 0;
+    assert(geomDecodeWKB(longer, sz+1, NULL, NULL) == GEOM_ERR_INPUT);
+    zfree(longer);
+    geomFree(g);
+}
+
+int test_GeomWKB(){
+    testGeomWKBLength("POINT(10 11)");
+    testGeomWKBLength("POINT ZM(10 11 12 13)");
+    testGeomWKBLength("LINESTRINGM(10 11 100,12 13 101,14 15 102)");
+    testGeomWKBLength("POLYGON((10 11, 12 13, 14 15),(9 8, 12 13))");
+    testGeomWKBLength("MULTIPOLYGON("
+            "((10 11, 12 13, 14 15),(9 8, 12 13)),"
+            "((9 11, 12 13, 14 15),(9 8, 12 13))"
+        ")");
+    testGeomWKBLength("GEOMETRYCOLLECTION ("
+        "MULTIPOINT(10 11, 12 13, 14 15),"
+        "GEOMETRYCOLLECTION (POINTZ(10 11 12)),"
+        "POLYGON((101 111, 121 131, 141 151),(9 8, 12 13))"
+    ")");
+    // a linestring claiming 0x7fffffff points
+    uint8_t count[] = {1, 2,0,0,0, 0xff,0xff,0xff,0x7f};
+    assert(geomDecodeWKB(count, sizeof(count), NULL, NULL) == GEOM_ERR_INPUT);
+    // a polygon whose ring is past the end
+    uint8_t ring[] = {1, 3,0,0,0, 1,0,0,0, 0xff,0xff,0xff,0xff};
+    assert(geomDecodeWKB(ring, sizeof(ring), NULL, NULL) == GEOM_ERR_INPUT);
+    // an unknown type
+    uint8_t type[] = {1, 9,0,0,0, 0,0,0,0};
+    assert(geomDecodeWKB(type, sizeof(type), NULL, NULL) == GEOM_ERR_INPUT);
+    return 1;
+}
+
 int polyMapBench(char *input, int singleThreaded){
     geom g;
     int sz;
     geomErr err = geomDecode(input, strlen(input), 0, &g, &sz);
     assert(err == GEOM_ERR_NONE);
     int n = 50000;
+    // geomNewPolyMap is single threaded, both benches run the same code.
+    (void)singleThreaded;
     for (int i=0;i<n;i++){
-        geomPolyMap *m = NULL;
-        if (singleThreaded){
-            m = geomNewPolyMapSingleThreaded(g);
-        } else {
-            m = geomNewPolyMap(g);
-        }
+        geomPolyMap *m = geomNewPolyMap(g);
         assert(m);
         geomFreePolyMap(m);
     }
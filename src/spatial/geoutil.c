@@ -90,4 +90,38 @@ geomRect geoutilBoundsFromLatLon(double centerLat, double centerLon, double dist
 	return r;
 }
 
+static double latDistance(double lat, double minLat, double maxLat){
+	if (lat < minLat){
+		return EARTH_RADIUS * RAD(minLat - lat);
+	}
+	if (lat > maxLat){
+		return EARTH_RADIUS * RAD(lat - maxLat);
+	}
+	return 0;
+}
 
+// geoutilRectDistance returns the distance in meters between lat,lon and the
+// closest point of the rect. It is 0 when the point is inside the rect and
+// never more than the distance to any point of the rect.
+double geoutilRectDistance(double lat, double lon, double minLat, double minLon, double maxLat, double maxLon){
+	if (lon >= minLon && lon <= maxLon){
+		return latDistance(lat, minLat, maxLat);
+	}
+	// For a given latitude the distance grows with the longitude difference,
+	// so the closest point lies on the nearest meridian edge.
+	double toMin = fmod(minLon - lon + 720, 360);
+	double toMax = fmod(lon - maxLon + 720, 360);
+	double edgeLon = toMin <= toMax ? minLon : maxLon;
+	double dlon = RAD(toMin <= toMax ? toMin : toMax);
+	if (dlon > PI/2){
+		// far side of the globe, the latitude difference is a safe bound.
+		return latDistance(lat, minLat, maxLat);
+	}
+	double q = RAD(lat);
+	// latitude of the point of the edge meridian closest to lat,lon
+	double footLat = DEG(atan2(tan(q), cos(dlon)));
+	if (footLat >= minLat && footLat <= maxLat){
+		return EARTH_RADIUS * asin(fabs(cos(q) * sin(dlon)));
+	}
+	return geoutilDistance(lat, lon, footLat < minLat ? minLat : maxLat, edgeLon);
+}
@@ -39,6 +39,7 @@ extern "C" {
 double geoutilDistance(double latA, double lonA, double latB, double lonB);
 void geoutilDestinationLatLon(double lat, double lon, double distanceMeters, double bearingDegrees, double *destLat, double *destLon);
 geomRect geoutilBoundsFromLatLon(double centerLat, double centerLon, double distanceMeters);
+double geoutilRectDistance(double lat, double lon, double minLat, double minLon, double maxLat, double maxLon);
 
 #if defined(__cplusplus)
 }
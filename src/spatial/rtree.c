@@ -27,94 +27,557 @@
  * THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* rtree.c is compiled twice: as itself for the double precision tree, which
+ * also provides the public rtree* API, and through rtree32.c with
+ * RTREE_FLOAT_IMPL for the single precision one. The per precision
+ * functions work on the root of the tree and are named rtree64* and
+ * rtree32*, the public functions pick one based on the flags of the tree. */
+
+#ifdef RTREE_FLOAT_IMPL
+#define NUMBER float
+#define NUMBER_IS_FLOAT 1
+#define RTREE_IMPL(name) rtree32##name
+#else
+#define RTREE_IMPL(name) rtree64##name
+#endif
 #define NUM_DIMS 2
 
 #include "zmalloc.h"
 #include "rtree_tmpl.c"
 #include "rtree.h"
 
-typedef struct rtreeIterator {
-	iteratorT *iterator;
-} rtreeIterator;
+#define RTREE_IMPL_DECLARE(prefix) \
+	void prefix##Free(void *pool); \
+	void prefix##Reclaim(void *pool); \
+	int prefix##Remove(void **root, void *pool, double minX, double minY, double maxX, double maxY, void *item, int flags); \
+	int prefix##Count(void *root); \
+	int prefix##Insert(void **root, void *pool, double minX, double minY, double maxX, double maxY, void *item, int flags); \
+	int prefix##Update(void **root, void *pool, double oldMinX, double oldMinY, double oldMaxX, double oldMaxY, \
+		double minX, double minY, double maxX, double maxY, void *item, int flags); \
+	int prefix##Load(void **root, void *pool, rtreeItem *items, int count); \
+	int prefix##LoadLeaves(void **root, void *pool, rtreeItem *items, const int *counts, int leaves); \
+	void prefix##Leaves(void *root, rtreeLeafFunc fn, void *userdata); \
+	int prefix##Search(void *root, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata); \
+	int prefix##Split(void *root, double minX, double minY, double maxX, double maxY, void **parts, int max); \
+	int prefix##Nearby(void *root, rtreeDistFunc dist, rtreeNearbyFunc iterator, void *userdata); \
+	void prefix##Stats(void *root, void *pool, rtreeStats *stats); \
+	void prefix##CountIn(void *root, double minX, double minY, double maxX, double maxY, rtreeClassifyFunc classify, \
+		rtreeSearchFunc match, rtreeEstimateFunc estimate, void *userdata, int approx, long long *count, long long *error);
+
+RTREE_IMPL_DECLARE(rtree64)
+RTREE_IMPL_DECLARE(rtree32)
+
+// Free releases all the nodes of the tree, page by page.
+void RTREE_IMPL(Free)(void *pool){
+	poolRelease(pool);
+}
+
+// Reclaim frees the nodes retired for the snapshots no longer live.
+void RTREE_IMPL(Reclaim)(void *pool){
+	poolReclaim(pool);
+}
+
+/* Remove removes item from rtree */
+int RTREE_IMPL(Remove)(void **root, void *pool, double minX, double minY, double maxX, double maxY, void *item, int flags) {
+	return removeRect(makeRect(minX, minY, maxX, maxY), item, root, flags & RTREE_RSTAR, pool) ? 0 : 1;
+}
+
+// Count return the number of items in rtree.
+int RTREE_IMPL(Count)(void *root) {
+	return nodeTotal(root);
+}
+
+// Insert inserts item into rtree
+int RTREE_IMPL(Insert)(void **root, void *pool, double minX, double minY, double maxX, double maxY, void *item, int flags) {
+	if (!*root) {
+		*root = poolAlloc(pool);
+		if (!*root){
+			return 0;
+		}
+	}
+	insertRect(makeRect(minX, minY, maxX, maxY), item, NULL, root, 0, flags & RTREE_RSTAR, pool);
+	return 1;
+}
+
+// Update moves item from the old rect to the new one, in place when the
+// leaf still covers it.
+int RTREE_IMPL(Update)(void **root, void *pool, double oldMinX, double oldMinY, double oldMaxX, double oldMaxY,
+	double minX, double minY, double maxX, double maxY, void *item, int flags) {
+	rectT rect = makeRect(minX, minY, maxX, maxY);
+	if (*root && updateInPlace(item, rect, root, pool)) {
+		return 1;
+	}
+	RTREE_IMPL(Remove)(root, pool, oldMinX, oldMinY, oldMaxX, oldMaxY, item, flags);
+	return RTREE_IMPL(Insert)(root, pool, minX, minY, maxX, maxY, item, flags);
+}
+
+static int compareItemX(const void *a, const void *b) {
+	const rtreeItem *ia = a, *ib = b;
+	double ca = ia->minX + ia->maxX, cb = ib->minX + ib->maxX;
+	return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+static int compareItemY(const void *a, const void *b) {
+	const rtreeItem *ia = a, *ib = b;
+	double ca = ia->minY + ia->maxY, cb = ib->minY + ib->maxY;
+	return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+static void emitItems(void *chunk, int count, void *userdata) {
+	strLevelT *out = userdata;
+	rtreeItem *items = chunk;
+	nodeT *node = strNewNode(out);
+	for (int i = 0; i < count; i++) {
+		nodeSetRect(node, i, makeRect(items[i].minX, items[i].minY, items[i].maxX, items[i].maxY));
+		node->item[i] = items[i].item;
+	}
+	node->count = count;
+	linkLeaf(out->pool, node);
+	strAddNode(out, node);
+}
+
+// Load packs the items into a new tree with Sort-Tile-Recursive. The root
+// must be empty and the items array is reordered in place.
+int RTREE_IMPL(Load)(void **root, void *pool, rtreeItem *items, int count) {
+	if (count == 0){
+		return 1;
+	}
+	strLevelT out;
+	out.branches = zmalloc(strNodeCount(count) * sizeof(branchT));
+	if (!out.branches){
+		return 0;
+	}
+	out.count = 0;
+	out.level = 0;
+	out.pool = pool;
+	strTile(items, count, sizeof(rtreeItem), compareItemX, compareItemY, emitItems, &out);
+	*root = strBuild(out.branches, out.count, 1, pool);
+	return 1;
+}
+
+// LoadLeaves is Load with the leaves already packed: the first counts[0]
+// items go in the first leaf and so on, only the upper levels are tiled.
+// Returns 0 before touching the pool when a count does not fit a leaf.
+int RTREE_IMPL(LoadLeaves)(void **root, void *pool, rtreeItem *items, const int *counts, int leaves) {
+	if (leaves == 0){
+		return 1;
+	}
+	for (int i = 0; i < leaves; i++){
+		if (counts[i] < 1 || counts[i] > MAX_NODES){
+			return 0;
+		}
+	}
+	strLevelT out;
+	out.branches = zmalloc(leaves * sizeof(branchT));
+	if (!out.branches){
+		return 0;
+	}
+	out.count = 0;
+	out.level = 0;
+	out.pool = pool;
+	for (int i = 0; i < leaves; i++){
+		emitItems(items, counts[i], &out);
+		items += counts[i];
+	}
+	*root = strBuild(out.branches, out.count, 1, pool);
+	return 1;
+}
+
+static void leavesRec(nodeT *node, rtreeLeafFunc fn, void *userdata){
+	if (node->level == 0){
+		fn(node->item, node->count, userdata);
+		return;
+	}
+	for (int i = 0; i < node->count; i++){
+		leavesRec(node->child[i], fn, userdata);
+	}
+}
+
+// Leaves calls fn with the items of every leaf, left to right.
+void RTREE_IMPL(Leaves)(void *root, rtreeLeafFunc fn, void *userdata){
+	leavesRec(root, fn, userdata);
+}
+
+typedef struct iteratorUserData {
+	rtreeSearchFunc iterator;
+	void *userdata;
+} iteratorUserData;
+
+static int iteratorFunc(rectT rect, void *item, void *userdata){
+	iteratorUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->iterator(minX, minY, maxX, maxY, item, ud->userdata);
+}
+
+int RTREE_IMPL(Search)(void *root, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata){
+	if (iterator) {
+		iteratorUserData ud = {iterator, userdata};
+		return search(root, makeRect(minX, minY, maxX, maxY), iteratorFunc, &ud);
+	} else{
+		return search(root, makeRect(minX, minY, maxX, maxY), NULL, NULL);
+	}
+}
+
+int RTREE_IMPL(Split)(void *root, double minX, double minY, double maxX, double maxY, void **parts, int max){
+	return splitSearch(root, makeRect(minX, minY, maxX, maxY), (nodeT **) parts, max);
+}
+
+typedef struct nearbyUserData {
+	rtreeDistFunc dist;
+	rtreeNearbyFunc iterator;
+	void *userdata;
+} nearbyUserData;
+
+static double nearbyDistFunc(rectT rect, void *item, void *userdata){
+	nearbyUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->dist(minX, minY, maxX, maxY, item, ud->userdata);
+}
+
+static int nearbyIteratorFunc(rectT rect, void *item, double dist, void *userdata){
+	nearbyUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->iterator(minX, minY, maxX, maxY, item, dist, ud->userdata);
+}
+
+int RTREE_IMPL(Nearby)(void *root, rtreeDistFunc dist, rtreeNearbyFunc iterator, void *userdata){
+	nearbyUserData ud = {dist, iterator, userdata};
+	return nearby(root, nearbyDistFunc, nearbyIteratorFunc, &ud);
+}
+
+typedef struct countUserData {
+	rtreeClassifyFunc classify;
+	rtreeSearchFunc match;
+	rtreeEstimateFunc estimate;
+	void *userdata;
+} countUserData;
+
+static int countClassifyFunc(rectT rect, void *userdata){
+	countUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->classify(minX, minY, maxX, maxY, ud->userdata);
+}
+
+static int countMatchFunc(rectT rect, void *item, void *userdata){
+	countUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->match(minX, minY, maxX, maxY, item, ud->userdata);
+}
+
+static double countEstimateFunc(rectT rect, void *userdata){
+	countUserData *ud = userdata;
+	double minX, minY, maxX, maxY;
+	getRect(rect, &minX, &minY, &maxX, &maxY);
+	return ud->estimate(minX, minY, maxX, maxY, ud->userdata);
+}
+
+void RTREE_IMPL(CountIn)(void *root, double minX, double minY, double maxX, double maxY, rtreeClassifyFunc classify,
+	rtreeSearchFunc match, rtreeEstimateFunc estimate, void *userdata, int approx, long long *count, long long *error) {
+	countUserData ud = {classify, match, estimate, userdata};
+	countT c;
+	memset(&c, 0, sizeof(countT));
+	c.classify = countClassifyFunc;
+	c.match = countMatchFunc;
+	c.estimate = estimate ? countEstimateFunc : NULL;
+	c.userdata = &ud;
+	c.approx = approx;
+	countRect(root, makeRect(minX, minY, maxX, maxY), &c);
+	long long guess = c.inside + llround(c.guess);
+	*count = guess;
+	*error = guess - c.inside > c.inside + c.boundary - guess ?
+		guess - c.inside : c.inside + c.boundary - guess;
+}
+
+void RTREE_IMPL(Stats)(void *root, void *pool, rtreeStats *stats) {
+	statsT st;
+	memset(&st, 0, sizeof(statsT));
+	statsRec(root, &st);
+	stats->height = ((nodeT *) root)->level + 1;
+	stats->nodes = st.nodes;
+	stats->items = st.items;
+	stats->nodeSize = sizeof(nodeT);
+	stats->memory = ((poolT *) pool)->bytes;
+	stats->fill = (double) st.branches / ((double) st.nodes * MAX_NODES);
+	stats->overlap = st.volume > 0 ? st.overlap / st.volume : 0;
+}
+
+#ifndef RTREE_FLOAT_IMPL
+
+#define RTREE_CALL(tr, name) (((tr)->flags & RTREE_FLOAT) ? rtree32##name : rtree64##name)
 
 rtree *rtreeNew() {
+	return rtreeNewWithFlags(0);
+}
+
+// NewWithFlags returns an empty rtree, RTREE_FLOAT stores the rects as
+// floats rounded outward: half the memory, but the rects given back to the
+// iterators may be slightly larger than the inserted ones. RTREE_RSTAR
+// inserts with the R* policy instead of the quadratic split.
+rtree *rtreeNewWithFlags(int flags) {
 	rtree *tr = zmalloc(sizeof(rtree));
 	if (!tr){
 		return NULL;
 	}
 	memset(tr, 0, sizeof(rtree));
+	tr->flags = flags;
+	/* the pool layout does not depend on the precision. */
+	tr->pool = zmalloc(sizeof(poolT));
+	if (!tr->pool){
+		zfree(tr);
+		return NULL;
+	}
+	memset(tr->pool, 0, sizeof(poolT));
+	((poolT *) tr->pool)->refs = 1;
 	return tr;
 }
 
+int rtreeFlags(rtree *tr) {
+	return tr ? tr->flags : 0;
+}
+
+// SetFlags changes the flags of the tree. The insertion policy applies to
+// the next inserts, the precision can only change while the tree is empty
+// and has no snapshot. Returns 0 when the flags were not changed.
+int rtreeSetFlags(rtree *tr, int flags) {
+	if (!tr || (tr->flags & RTREE_SNAPSHOT) || ((tr->root || ((poolT *) tr->pool)->refs > 1) &&
+		((tr->flags ^ flags) & RTREE_FLOAT))){
+		return 0;
+	}
+	tr->flags = flags;
+	return 1;
+}
+
+// Free releases the tree, or a snapshot. The nodes stay until the tree and
+// all its snapshots are freed.
 void rtreeFree(rtree *tr){
 	if (!tr){
 		return;
 	}
-	if (tr->root){
-		freeNode(tr->root);
+	poolT *pool = tr->pool;
+	if (tr->flags & RTREE_SNAPSHOT) {
+		int index = 0;
+		while (pool->live[index] != tr->gen) {
+			index++;
+		}
+		memmove(&pool->live[index], &pool->live[index+1], (pool->nlive - index - 1) * sizeof(unsigned long long));
+		pool->nlive--;
+		RTREE_CALL(tr, Reclaim)(pool);
+	}
+	if (--pool->refs == 0) {
+		RTREE_CALL(tr, Free)(pool);
+		zfree(pool->live);
+		zfree(pool);
 	}
 	zfree(tr);
 }
 
-/* Remove removes item from rtree */
+// Snapshot returns a read only copy of the tree as it is now, which other
+// threads can search while this one keeps changing the tree. Taking it is
+// O(1): the nodes are shared and the tree copies the ones it changes
+// afterwards, see poolT. The snapshot is released with rtreeFree, by the
+// thread changing the tree, and all the flags of the tree apply to it.
+rtree *rtreeSnapshot(rtree *tr){
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
+		return NULL;
+	}
+	poolT *pool = tr->pool;
+	if (pool->nlive == pool->livecap) {
+		int cap = pool->livecap ? pool->livecap * 2 : 4;
+		unsigned long long *live = zrealloc(pool->live, cap * sizeof(unsigned long long));
+		if (!live){
+			return NULL;
+		}
+		pool->live = live;
+		pool->livecap = cap;
+	}
+	rtree *snap = zmalloc(sizeof(rtree));
+	if (!snap){
+		return NULL;
+	}
+	pool->gen++;
+	pool->shared = pool->gen;
+	pool->live[pool->nlive++] = pool->gen;
+	pool->refs++;
+	snap->root = tr->root;
+	snap->pool = pool;
+	snap->flags = tr->flags | RTREE_SNAPSHOT;
+	snap->gen = pool->gen;
+	return snap;
+}
+
 int rtreeRemove(rtree *tr, double minX, double minY, double maxX, double maxY, void *item) {
-	if (tr && tr->root) {
-		return removeRect(makeRect(minX, minY, maxX, maxY), item, &(tr->root)) ? 0 : 1;
+	if (tr && tr->root && !(tr->flags & RTREE_SNAPSHOT)) {
+		return RTREE_CALL(tr, Remove)(&tr->root, tr->pool, minX, minY, maxX, maxY, item, tr->flags);
 	}
 	return 0;
 }
 
-// Count return the number of items in rtree.
 int rtreeCount(rtree *tr) {
 	if (!tr || !tr->root){
 		return 0;
 	}
-	return countRec(tr->root, 0);
+	return RTREE_CALL(tr, Count)(tr->root);
 }
 
-// Insert inserts item into rtree
 int rtreeInsert(rtree *tr, double minX, double minY, double maxX, double maxY, void *item) {
-	if (!tr){
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
 		return 0;
 	}
-	if (!tr->root) {
-		tr->root = zmalloc(sizeof(nodeT));
-		if (!tr->root){
-			return 0;
-		}
-		memset(tr->root, 0, sizeof(nodeT));
+	return RTREE_CALL(tr, Insert)(&tr->root, tr->pool, minX, minY, maxX, maxY, item, tr->flags);
+}
+
+// Update moves an item already in the tree from the old rect to the new one.
+// With linked items, see rtreeLinkItems, a move that stays inside the leaf
+// of the item is done in place, otherwise it is removed and inserted again.
+int rtreeUpdate(rtree *tr, double oldMinX, double oldMinY, double oldMaxX, double oldMaxY,
+	double minX, double minY, double maxX, double maxY, void *item) {
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
+		return 0;
 	}
-	insertRect(makeRect(minX, minY, maxX, maxY), item, NULL, &(tr->root), 0);
-	return 1;
+	return RTREE_CALL(tr, Update)(&tr->root, tr->pool, oldMinX, oldMinY, oldMaxX, oldMaxY,
+		minX, minY, maxX, maxY, item, tr->flags);
 }
 
-void rtreeRemoveAll(rtree *tr){
-	if (tr && tr->root){
-		freeNode(tr->root);
-		tr->root = NULL;
+// LinkItems makes the tree keep, at offset in every item, a pointer to the
+// leaf holding it. The items must have room for it and the link must be set
+// before the first insert. The pointer is meaningless once the item is
+// removed.
+void rtreeLinkItems(rtree *tr, size_t offset){
+	((poolT *) tr->pool)->link = offset + 1;
+}
+
+// Load replaces the content of the rtree with items, packing the nodes with
+// Sort-Tile-Recursive. The items array is reordered in place.
+int rtreeLoad(rtree *tr, rtreeItem *items, int count) {
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
+		return 0;
+	}
+	rtreeRemoveAll(tr);
+	if (tr->root){
+		return 0;
 	}
+	return RTREE_CALL(tr, Load)(&tr->root, tr->pool, items, count);
 }
 
-typedef struct iteratorUserData {
-	rtreeSearchFunc iterator;
-	void *userdata;
-} iteratorUserData;
+// LoadLeaves replaces the content of the rtree with items packed in the
+// leaves given by counts, as rtreeLeaves reported them. Returns 0 when the
+// leaves do not fit the tree, which is then left empty.
+int rtreeLoadLeaves(rtree *tr, rtreeItem *items, const int *counts, int leaves) {
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
+		return 0;
+	}
+	rtreeRemoveAll(tr);
+	if (tr->root){
+		return 0;
+	}
+	return RTREE_CALL(tr, LoadLeaves)(&tr->root, tr->pool, items, counts, leaves);
+}
 
-static int iteratorFunc(rectT rect, void *item, void *userdata){
-	iteratorUserData *ud = userdata;
-	double minX, minY, maxX, maxY;
-	getRect(rect, &minX, &minY, &maxX, &maxY);
-	return ud->iterator(minX, minY, maxX, maxY, item, ud->userdata);
+// Leaves calls fn with the items of every leaf in tree order, which keeps
+// the items that are close together next to each other.
+void rtreeLeaves(rtree *tr, rtreeLeafFunc fn, void *userdata){
+	if (!tr || !tr->root){
+		return;
+	}
+	RTREE_CALL(tr, Leaves)(tr->root, fn, userdata);
+}
+
+// RemoveAll drops every item. The nodes are released a page at a time
+// rather than walking the tree, or left to the snapshots when there are
+// some and the tree moves to a new pool.
+void rtreeRemoveAll(rtree *tr){
+	if (!tr || (tr->flags & RTREE_SNAPSHOT)){
+		return;
+	}
+	poolT *pool = tr->pool;
+	if (pool->refs > 1) {
+		poolT *fresh = zmalloc(sizeof(poolT));
+		if (!fresh){
+			return;
+		}
+		memset(fresh, 0, sizeof(poolT));
+		fresh->link = pool->link;
+		fresh->refs = 1;
+		pool->refs--;
+		tr->pool = fresh;
+	} else {
+		RTREE_CALL(tr, Free)(pool);
+	}
+	tr->root = NULL;
 }
 
 int rtreeSearch(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata){
 	if (!tr || !tr->root){
 		return 0;
 	}
-	if (iterator) {
-		iteratorUserData ud = {iterator, userdata};
-		return search(tr->root, makeRect(minX, minY, maxX, maxY), iteratorFunc, &ud);
-	} else{
-		return search(tr->root, makeRect(minX, minY, maxX, maxY), NULL, NULL);
+	return RTREE_CALL(tr, Search)(tr->root, minX, minY, maxX, maxY, iterator, userdata);
+}
+
+// SearchSplit divides a search into at most max parts, subtrees that are
+// searched on their own with rtreeSearchPart, e.g. on different threads.
+// Together the parts hold every item of the search once. Returns their
+// number. The parts are only valid until the tree is modified.
+int rtreeSearchSplit(rtree *tr, double minX, double minY, double maxX, double maxY, void **parts, int max){
+	if (!tr || !tr->root){
+		return 0;
 	}
+	return RTREE_CALL(tr, Split)(tr->root, minX, minY, maxX, maxY, parts, max);
 }
+
+int rtreeSearchPart(rtree *tr, void *part, double minX, double minY, double maxX, double maxY,
+	rtreeSearchFunc iterator, void *userdata){
+	if (!tr || !part){
+		return 0;
+	}
+	return RTREE_CALL(tr, Search)(part, minX, minY, maxX, maxY, iterator, userdata);
+}
+
+// Nearby visits the items in the order of increasing distance until the
+// iterator returns 0. The dist function is called with a NULL item for the
+// rect of a node and must return a lower bound of the distance of the items
+// below it.
+int rtreeNearby(rtree *tr, rtreeDistFunc dist, rtreeNearbyFunc iterator, void *userdata){
+	if (!tr || !tr->root){
+		return 0;
+	}
+	return RTREE_CALL(tr, Nearby)(tr->root, dist, iterator, userdata);
+}
+
+// CountIn counts the items inside a query, see rtreeClassifyFunc. match
+// decides for the items of the boundary nodes. With approx the leaves are
+// not visited, a boundary node counts for the fraction of its rect given by
+// estimate, or else by the part of it inside the query rect, and error
+// bounds the distance of count to the exact count.
+void rtreeCountIn(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeClassifyFunc classify,
+	rtreeSearchFunc match, rtreeEstimateFunc estimate, void *userdata, int approx, long long *count, long long *error){
+	*count = *error = 0;
+	if (!tr || !tr->root){
+		return;
+	}
+	RTREE_CALL(tr, CountIn)(tr->root, minX, minY, maxX, maxY, classify, match, estimate, userdata, approx, count, error);
+}
+
+// Stats describes the shape of the tree, see rtreeStats.
+void rtreeGetStats(rtree *tr, rtreeStats *stats){
+	memset(stats, 0, sizeof(rtreeStats));
+	if (!tr || !tr->root){
+		return;
+	}
+	RTREE_CALL(tr, Stats)(tr->root, tr->pool, stats);
+}
+
+// MemUsage returns the bytes held by the tree without walking it, the
+// pages of the pool included. A snapshot shares them with its tree.
+size_t rtreeMemUsage(rtree *tr){
+	if (!tr){
+		return 0;
+	}
+	return sizeof(rtree) + sizeof(poolT) + ((poolT *) tr->pool)->bytes;
+}
+
+#endif /* RTREE_FLOAT_IMPL */
@@ -36,18 +36,69 @@ extern "C" {
 
 #include "geom.h"
 
+#define RTREE_FLOAT (1<<0)  // store the rects as floats rounded outward.
+#define RTREE_RSTAR (1<<1)  // insert with the R* policy.
+#define RTREE_SNAPSHOT (1<<2)   // a read only snapshot, see rtreeSnapshot.
+
 typedef struct rtree {
     void *root;
+    void *pool;     // the pages the nodes are allocated from.
+    int flags;
+    unsigned long long gen; // the generation of a snapshot.
 } rtree;
 
+typedef struct rtreeItem {
+    double minX, minY, maxX, maxY;
+    void *item;
+} rtreeItem;
+
 rtree *rtreeNew();
+rtree *rtreeNewWithFlags(int flags);
+int rtreeFlags(rtree *tr);
+int rtreeSetFlags(rtree *tr, int flags);
 void rtreeFree(rtree *tr);
+rtree *rtreeSnapshot(rtree *tr);
 int rtreeRemove(rtree *tr, double minX, double minY, double maxX, double maxY, void *item);
 void rtreeRemoveAll(rtree *tr);
 int rtreeCount(rtree *tr);
 int rtreeInsert(rtree *tr, double minX, double minY, double maxX, double maxY, void *item);
+int rtreeLoad(rtree *tr, rtreeItem *items, int count);
+int rtreeLoadLeaves(rtree *tr, rtreeItem *items, const int *counts, int leaves);
+typedef void(*rtreeLeafFunc)(void **items, int count, void *userdata);
+void rtreeLeaves(rtree *tr, rtreeLeafFunc fn, void *userdata);
+int rtreeUpdate(rtree *tr, double oldMinX, double oldMinY, double oldMaxX, double oldMaxY,
+                double minX, double minY, double maxX, double maxY, void *item);
+void rtreeLinkItems(rtree *tr, size_t offset);
 typedef int(*rtreeSearchFunc)(double minX, double minY, double maxX, double maxY, void *item, void *userdata);
 int rtreeSearch(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeSearchFunc iterator, void *userdata);
+int rtreeSearchSplit(rtree *tr, double minX, double minY, double maxX, double maxY, void **parts, int max);
+int rtreeSearchPart(rtree *tr, void *part, double minX, double minY, double maxX, double maxY,
+                    rtreeSearchFunc iterator, void *userdata);
+typedef double(*rtreeDistFunc)(double minX, double minY, double maxX, double maxY, void *item, void *userdata);
+typedef int(*rtreeNearbyFunc)(double minX, double minY, double maxX, double maxY, void *item, double dist, void *userdata);
+int rtreeNearby(rtree *tr, rtreeDistFunc dist, rtreeNearbyFunc iterator, void *userdata);
+
+#define RTREE_OUTSIDE 0     // no item under the rect is in the query.
+#define RTREE_INSIDE  1     // all the items under the rect are in the query.
+#define RTREE_PARTIAL 2     // the items under the rect must be checked.
+typedef int(*rtreeClassifyFunc)(double minX, double minY, double maxX, double maxY, void *userdata);
+typedef double(*rtreeEstimateFunc)(double minX, double minY, double maxX, double maxY, void *userdata);
+void rtreeCountIn(rtree *tr, double minX, double minY, double maxX, double maxY, rtreeClassifyFunc classify,
+                  rtreeSearchFunc match, rtreeEstimateFunc estimate, void *userdata, int approx,
+                  long long *count, long long *error);
+
+typedef struct rtreeStats {
+    int height;         // number of levels, 0 when empty.
+    long long nodes;
+    long long items;
+    size_t nodeSize;    // bytes per node.
+    size_t memory;      // bytes of the pages holding the nodes.
+    double fill;        // average fraction of the branches in use.
+    double overlap;     // area shared by sibling nodes over their total area.
+} rtreeStats;
+
+void rtreeGetStats(rtree *tr, rtreeStats *stats);
+size_t rtreeMemUsage(rtree *tr);
 
 #if defined(__cplusplus)
 }
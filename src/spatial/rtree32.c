@@ -0,0 +1,4 @@
+/* The single precision instantiation of the rtree, see rtree.c. */
+
+#define RTREE_FLOAT_IMPL
+#include "rtree.c"
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <assert.h>
 #include <time.h>
+#include <stddef.h>
 
 #include "test.h"
 #include "rtree.h"
@@ -94,4 +95,138 @@ int test_RTreeRemove(){
 
 	rtreeFree(tr);
 	return 1;
-}
\ No newline at end of file
+}
+#define SNAP_ITEMS 2000
+
+typedef struct snapItem {
+	int id;
+	void *leaf;     // see rtreeLinkItems.
+} snapItem;
+
+typedef struct snapSeen {
+	int *count;
+	int items;
+	int moved;      // items not at the rect they were added with.
+} snapSeen;
+
+static void snapRect(int id, double *minX, double *minY) {
+	*minX = (id % 50) * 2;
+	*minY = (id / 50) * 2;
+}
+
+static int snapIterator(double minX, double minY, double maxX, double maxY, void *item, void *userdata) {
+	snapSeen *seen = userdata;
+	int id = ((snapItem *) item)->id;
+	double x, y;
+	snapRect(id, &x, &y);
+	seen->count[id]++;
+	seen->items++;
+	if (minX != x || minY != y || maxX != x + 1 || maxY != y + 1) {
+		seen->moved++;
+	}
+	return 1;
+}
+
+// checks that tr holds exactly the items [first, last), at the rects they
+// were added with.
+static void snapCheck(rtree *tr, int first, int last) {
+	int count[SNAP_ITEMS*2] = {0};
+	snapSeen seen = { count, 0, 0 };
+	rtreeSearch(tr, -1000, -1000, 1000, 1000, snapIterator, &seen);
+	assert(seen.items == last - first);
+	assert(seen.moved == 0);
+	for (int i = 0; i < SNAP_ITEMS*2; i++) {
+		assert(count[i] == (i >= first && i < last));
+	}
+}
+
+static size_t snapMemory(rtree *tr, long long *nodes) {
+	rtreeStats stats;
+	rtreeGetStats(tr, &stats);
+	*nodes = stats.nodes;
+	return stats.memory;
+}
+
+int test_RTreeSnapshot(){
+	static snapItem items[SNAP_ITEMS*2];
+	double x, y;
+	rtree *tr = rtreeNew();
+	assert(tr);
+	rtreeLinkItems(tr, offsetof(snapItem, leaf));
+	for (int i = 0; i < SNAP_ITEMS*2; i++) {
+		items[i].id = i;
+	}
+	for (int i = 0; i < SNAP_ITEMS; i++) {
+		snapRect(i, &x, &y);
+		assert(rtreeInsert(tr, x, y, x+1, y+1, &items[i]));
+	}
+	long long nodes;
+	size_t before = snapMemory(tr, &nodes);
+
+	rtree *snap = rtreeSnapshot(tr);
+	assert(snap);
+	assert(!rtreeInsert(snap, 0, 0, 1, 1, &items[SNAP_ITEMS]));
+	assert(!rtreeRemove(snap, 0, 0, 1, 1, &items[0]));
+
+	// inserts, removes, and updates in place and across the tree.
+	for (int i = SNAP_ITEMS; i < SNAP_ITEMS + SNAP_ITEMS/4; i++) {
+		assert(rtreeInsert(tr, 200, 200, 201, 201, &items[i]));
+	}
+	snapCheck(snap, 0, SNAP_ITEMS);
+	for (int i = 0; i < SNAP_ITEMS; i += 4) {
+		snapRect(i, &x, &y);
+		assert(rtreeRemove(tr, x, y, x+1, y+1, &items[i]));
+	}
+	snapCheck(snap, 0, SNAP_ITEMS);
+	for (int i = 1; i < SNAP_ITEMS; i += 4) {
+		snapRect(i, &x, &y);
+		assert(rtreeUpdate(tr, x, y, x+1, y+1, x+0.25, y+0.25, x+0.75, y+0.75, &items[i]));
+		snapRect(i+1, &x, &y);
+		assert(rtreeUpdate(tr, x, y, x+1, y+1, -x-1, -y-1, -x, -y, &items[i+1]));
+	}
+	snapCheck(snap, 0, SNAP_ITEMS);
+	assert(rtreeCount(tr) == SNAP_ITEMS);
+
+	// the snapshot keeps the nodes the tree replaced, until it is freed.
+	size_t retained = snapMemory(tr, &nodes);
+	assert(retained > before);
+	rtreeFree(snap);
+
+	// the retired nodes are free again: the tree grows into them without
+	// a new page. The pages hold at least memory/(node+header) nodes.
+	rtreeStats stats;
+	rtreeGetStats(tr, &stats);
+	long long capacity = retained / (stats.nodeSize + 16);
+	assert(capacity - nodes > 64);
+	for (int i = 0; nodes + 2 < capacity; i++) {
+		assert(rtreeInsert(tr, 300 + i % 50, 300 + i / 50, 301 + i % 50, 301 + i / 50, &items[i % SNAP_ITEMS]));
+		assert(snapMemory(tr, &nodes) == retained);
+	}
+	rtreeRemoveAll(tr);
+	assert(rtreeCount(tr) == 0);
+
+	// RemoveAll and Load move the tree to a new pool, the snapshot keeps
+	// the old one.
+	for (int i = 0; i < SNAP_ITEMS; i++) {
+		snapRect(i, &x, &y);
+		assert(rtreeInsert(tr, x, y, x+1, y+1, &items[i]));
+	}
+	snap = rtreeSnapshot(tr);
+	assert(snap);
+	rtreeRemoveAll(tr);
+	assert(rtreeCount(tr) == 0);
+	snapCheck(snap, 0, SNAP_ITEMS);
+	static rtreeItem load[SNAP_ITEMS];
+	for (int i = 0; i < SNAP_ITEMS; i++) {
+		snapRect(SNAP_ITEMS + i, &x, &y);
+		load[i] = (rtreeItem) { x, y, x+1, y+1, &items[SNAP_ITEMS + i] };
+	}
+	assert(rtreeLoad(tr, load, SNAP_ITEMS));
+	snapCheck(snap, 0, SNAP_ITEMS);
+	snapCheck(tr, SNAP_ITEMS, SNAP_ITEMS*2);
+	rtreeFree(snap);
+	snapCheck(tr, SNAP_ITEMS, SNAP_ITEMS*2);
+
+	rtreeFree(tr);
+	return 1;
+}
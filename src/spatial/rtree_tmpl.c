@@ -43,6 +43,7 @@
 /* Template options */
 #ifndef NUMBER
 #   define NUMBER double
+#   define NUMBER_IS_DOUBLE 1
 #endif
 #ifndef NUM_DIMS
 #   define NUM_DIMS 2
@@ -53,6 +54,12 @@
 #ifndef MAX_NODES
 #   define MAX_NODES 16
 #endif
+#ifndef NUMBER_IS_DOUBLE
+#   define NUMBER_IS_DOUBLE 0
+#endif
+#ifndef NUMBER_IS_FLOAT
+#   define NUMBER_IS_FLOAT 0
+#endif
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -60,7 +67,14 @@
 #include <string.h>
 #include "zmalloc.h"
 
+#if defined(__AVX__)
+#   include <immintrin.h>
+#elif defined(__SSE2__)
+#   include <emmintrin.h>
+#endif
+
 #define MIN_NODES (MAX_NODES/2)
+#define MAX_LEVELS 32   // deeper than any tree, a level fans out at least MIN_NODES.
 
 #if NUM_DIMS == 2
 #   define UNIT_SPHERE_VOLUME 3.141593
@@ -75,7 +89,7 @@
 typedef struct branchT branchT;
 typedef struct nodeT nodeT;
 typedef struct rectT rectT;
-typedef struct listNodeT listNodeT;
+typedef struct poolT poolT;
 typedef struct partitionVarsT partitionVarsT;
 typedef struct stackT stackT;
 typedef struct iteratorT iteratorT;
@@ -91,15 +105,51 @@ struct branchT {
     nodeT *child;
 };
 
+/* The branches of a node are stored as a structure of arrays: the bounds of
+ * each dimension are contiguous so that the overlap test of search() can
+ * check a whole node with a few vector compares instead of striding
+ * through the branch records. branchT is only used to move a branch
+ * around, see nodeBranch() and nodeSetBranch(). */
 struct nodeT {
     int     count;
     int     level;
-    branchT branch[MAX_NODES];
+    nodeT   *parent;    // NULL for the root.
+    unsigned long long gen; // see the copy on write in poolT.
+    NUMBER  min[NUM_DIMS][MAX_NODES];
+    NUMBER  max[NUM_DIMS][MAX_NODES];
+    void    *item[MAX_NODES];
+    nodeT   *child[MAX_NODES];
+    int     total[MAX_NODES];   // items below each child, unused in the leaves.
 };
 
-struct listNodeT {
-    listNodeT *next;
-    nodeT     *node;
+/* The nodes of a tree are carved out of pages owned by its pool. A page
+ * holds twice the nodes of the previous one, up to POOL_PAGE_NODES, so
+ * that a small tree stays small. Freed nodes are kept on a free list
+ * linked through their first word and handed out again before touching a
+ * new page, and the whole tree is released by freeing the pages.
+ *
+ * The pool is shared by the tree and its snapshots, see rtreeSnapshot.
+ * Taking one bumps the generation of the pool and every node of an older
+ * generation becomes read only: before changing such a node the tree
+ * copies it, and the path above it, see nodeOwnPath. The nodes replaced
+ * are retired with the generation of the pool and freed once every live
+ * snapshot is younger, see poolReclaim. */
+struct poolT {
+    void      *pages;       // linked through their first word.
+    nodeT     *free;
+    char      *next;        // next unused slot of the last page.
+    char      *end;
+    int       pageNodes;    // slots of the last page.
+    long long nodes;        // nodes handed out and not freed.
+    size_t    bytes;        // bytes of all the pages.
+    size_t    link;         // 1 + offset of the leaf pointer in the items, 0 if unused.
+    int       refs;         // the tree, until it is freed, and its snapshots.
+    unsigned long long gen;     // generation of the nodes allocated now.
+    unsigned long long shared;  // nodes of an older generation are read only, 0 if none.
+    nodeT     *retired;     // oldest first, linked through their parent.
+    nodeT     *retiredTail;
+    unsigned long long *live;   // generations of the live snapshots, oldest first.
+    int       nlive, livecap;
 };
 
 struct partitionVarsT {
@@ -116,36 +166,58 @@ struct partitionVarsT {
     NUMBER  coverSplitArea;
 };
 
-static int addBranch(branchT *branch, nodeT *node, nodeT **newNode);
+static int addBranch(branchT *branch, nodeT *node, nodeT **newNode, poolT *pool);
 static int pickBranch(rectT rect, nodeT *node);
 
+/* numberDown and numberUp convert a double coordinate to NUMBER rounding
+ * toward -inf and +inf. With a float NUMBER a rect made from doubles then
+ * always covers the original one, so the tree stays a conservative filter
+ * and the exact test done by the caller on the candidates decides. */
+static inline NUMBER numberDown(double v) {
+#if NUMBER_IS_FLOAT
+    float f = (float) v;
+    return (double) f > v ? nextafterf(f, -INFINITY) : f;
+#else
+    return v;
+#endif
+}
+
+static inline NUMBER numberUp(double v) {
+#if NUMBER_IS_FLOAT
+    float f = (float) v;
+    return (double) f < v ? nextafterf(f, INFINITY) : f;
+#else
+    return v;
+#endif
+}
+
 #if NUM_DIMS == 2
-static inline rectT makeRect(NUMBER minX, NUMBER minY, NUMBER maxX, NUMBER maxY) {
+static inline rectT makeRect(double minX, double minY, double maxX, double maxY) {
     rectT rect;
-    rect.min[0] = minX;
-    rect.min[1] = minY;
-    rect.max[0] = maxX;
-    rect.max[1] = maxY;
+    rect.min[0] = numberDown(minX);
+    rect.min[1] = numberDown(minY);
+    rect.max[0] = numberUp(maxX);
+    rect.max[1] = numberUp(maxY);
     return rect;
 }
-static inline void getRect(rectT rect, NUMBER *minX, NUMBER *minY, NUMBER *maxX, NUMBER *maxY) {
+static inline void getRect(rectT rect, double *minX, double *minY, double *maxX, double *maxY) {
     *minX = rect.min[0];
     *minY = rect.min[1];
     *maxX = rect.max[0];
     *maxY = rect.max[1];
 }
 #elif NUM_DIMS == 3
-static inline rectT makeRect(NUMBER minX, NUMBER minY, NUMBER minZ, NUMBER maxX, NUMBER maxY, NUMBER maxZ) {
+static inline rectT makeRect(double minX, double minY, double minZ, double maxX, double maxY, double maxZ) {
     rectT rect;
-    rect.min[0] = minX;
-    rect.min[1] = minY;
-    rect.min[2] = minZ;
-    rect.max[0] = maxX;
-    rect.max[1] = maxY;
-    rect.max[2] = maxZ;
+    rect.min[0] = numberDown(minX);
+    rect.min[1] = numberDown(minY);
+    rect.min[2] = numberDown(minZ);
+    rect.max[0] = numberUp(maxX);
+    rect.max[1] = numberUp(maxY);
+    rect.max[2] = numberUp(maxZ);
     return rect;
 }
-static inline void getRect(rectT rect, NUMBER *minX, NUMBER *minY, NUMBER *minZ, NUMBER *maxX, NUMBER *maxY, NUMBER *maxZ) {
+static inline void getRect(rectT rect, double *minX, double *minY, double *minZ, double *maxX, double *maxY, double *maxZ) {
     *minX = rect.min[0];
     *minY = rect.min[1];
     *minZ = rect.min[2];
@@ -154,19 +226,19 @@ static inline void getRect(rectT rect, NUMBER *minX, NUMBER *minY, NUMBER *minZ,
     *maxZ = rect.max[2];
 }
 #elif NUM_DIMS == 4
-static inline rectT makeRect(NUMBER minX, NUMBER minY, NUMBER minZ, NUMBER minM, NUMBER maxX, NUMBER maxY, NUMBER maxZ, NUMBER maxM) {
+static inline rectT makeRect(double minX, double minY, double minZ, double minM, double maxX, double maxY, double maxZ, double maxM) {
     rectT rect;
-    rect.min[0] = minX;
-    rect.min[1] = minY;
-    rect.min[2] = minZ;
-    rect.min[3] = minM;
-    rect.max[0] = maxX;
-    rect.max[1] = maxY;
-    rect.max[2] = maxZ;
-    rect.max[3] = maxM;
+    rect.min[0] = numberDown(minX);
+    rect.min[1] = numberDown(minY);
+    rect.min[2] = numberDown(minZ);
+    rect.min[3] = numberDown(minM);
+    rect.max[0] = numberUp(maxX);
+    rect.max[1] = numberUp(maxY);
+    rect.max[2] = numberUp(maxZ);
+    rect.max[3] = numberUp(maxM);
     return rect;
 }
-static inline void getRect(rectT rect, NUMBER *minX, NUMBER *minY, NUMBER *minZ, NUMBER *minM, NUMBER *maxX, NUMBER *maxY, NUMBER *maxZ, NUMBER *maxM) {
+static inline void getRect(rectT rect, double *minX, double *minY, double *minZ, double *minM, double *maxX, double *maxY, double *maxZ, double *maxM) {
     *minX = rect.min[0];
     *minY = rect.min[1];
     *minZ = rect.min[2];
@@ -178,6 +250,52 @@ static inline void getRect(rectT rect, NUMBER *minX, NUMBER *minY, NUMBER *minZ,
 }
 #endif
 
+static inline rectT nodeRect(const nodeT *node, int index) {
+    rectT rect;
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        rect.min[dim] = node->min[dim][index];
+        rect.max[dim] = node->max[dim][index];
+    }
+    return rect;
+}
+
+static inline void nodeSetRect(nodeT *node, int index, rectT rect) {
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        node->min[dim][index] = rect.min[dim];
+        node->max[dim][index] = rect.max[dim];
+    }
+}
+
+static inline branchT nodeBranch(const nodeT *node, int index) {
+    branchT branch;
+    branch.rect = nodeRect(node, index);
+    branch.item = node->item[index];
+    branch.child = node->child[index];
+    return branch;
+}
+
+/* the number of items below node. */
+static inline int nodeTotal(const nodeT *node) {
+    if (node->level == 0) {
+        return node->count;
+    }
+    int total = 0;
+    for (int index = 0; index < node->count; index++) {
+        total += node->total[index];
+    }
+    return total;
+}
+
+static inline void nodeSetBranch(nodeT *node, int index, const branchT *branch) {
+    nodeSetRect(node, index, branch->rect);
+    node->item[index] = branch->item;
+    node->child[index] = branch->child;
+    if (branch->child) {
+        branch->child->parent = node;
+        node->total[index] = nodeTotal(branch->child);
+    }
+}
+
 static inline NUMBER min(NUMBER a, NUMBER b) {
     if (a < b) {
         return a;
@@ -202,18 +320,307 @@ static inline int overlap(rectT rectA, rectT rectB) {
     return 1;
 }
 
-/* push node to listNode for further reinsert */
-static void reinsert(nodeT *node, listNodeT **listNode) {
-    listNodeT *nlistNode = zmalloc(sizeof(listNodeT));
-    memset(nlistNode, 0, sizeof(listNodeT));
-    nlistNode->node = node;
-    nlistNode->next = *listNode;
-    *listNode = nlistNode;
+/* overlapMask returns a bit mask of the branches of node overlapping rect,
+ * bit i being set for branch i. The compares are written as !(a > b) so
+ * that they agree with overlap() on NaN. */
+#if NUMBER_IS_DOUBLE && defined(__AVX__) && MAX_NODES % 4 == 0
+static inline unsigned overlapMask(const nodeT *node, rectT rect) {
+    unsigned mask = 0;
+    for (int index = 0; index < node->count; index += 4) {
+        __m256d hit = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+        for (int dim = 0; dim < NUM_DIMS; dim++) {
+            __m256d nmin = _mm256_loadu_pd(&node->min[dim][index]);
+            __m256d nmax = _mm256_loadu_pd(&node->max[dim][index]);
+            hit = _mm256_and_pd(hit, _mm256_cmp_pd(nmin, _mm256_set1_pd(rect.max[dim]), _CMP_NGT_UQ));
+            hit = _mm256_and_pd(hit, _mm256_cmp_pd(nmax, _mm256_set1_pd(rect.min[dim]), _CMP_NLT_UQ));
+        }
+        mask |= (unsigned) _mm256_movemask_pd(hit) << index;
+    }
+    return mask & ((1u << node->count) - 1);
+}
+#elif NUMBER_IS_DOUBLE && defined(__SSE2__) && MAX_NODES % 2 == 0
+static inline unsigned overlapMask(const nodeT *node, rectT rect) {
+    unsigned mask = 0;
+    for (int index = 0; index < node->count; index += 2) {
+        __m128d hit = _mm_castsi128_pd(_mm_set1_epi32(-1));
+        for (int dim = 0; dim < NUM_DIMS; dim++) {
+            __m128d nmin = _mm_loadu_pd(&node->min[dim][index]);
+            __m128d nmax = _mm_loadu_pd(&node->max[dim][index]);
+            hit = _mm_and_pd(hit, _mm_cmpngt_pd(nmin, _mm_set1_pd(rect.max[dim])));
+            hit = _mm_and_pd(hit, _mm_cmpnlt_pd(nmax, _mm_set1_pd(rect.min[dim])));
+        }
+        mask |= (unsigned) _mm_movemask_pd(hit) << index;
+    }
+    return mask & ((1u << node->count) - 1);
+}
+#elif NUMBER_IS_FLOAT && defined(__AVX__) && MAX_NODES % 8 == 0
+static inline unsigned overlapMask(const nodeT *node, rectT rect) {
+    unsigned mask = 0;
+    for (int index = 0; index < node->count; index += 8) {
+        __m256 hit = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int dim = 0; dim < NUM_DIMS; dim++) {
+            __m256 nmin = _mm256_loadu_ps(&node->min[dim][index]);
+            __m256 nmax = _mm256_loadu_ps(&node->max[dim][index]);
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(nmin, _mm256_set1_ps(rect.max[dim]), _CMP_NGT_UQ));
+            hit = _mm256_and_ps(hit, _mm256_cmp_ps(nmax, _mm256_set1_ps(rect.min[dim]), _CMP_NLT_UQ));
+        }
+        mask |= (unsigned) _mm256_movemask_ps(hit) << index;
+    }
+    return mask & ((1u << node->count) - 1);
+}
+#elif NUMBER_IS_FLOAT && defined(__SSE2__) && MAX_NODES % 4 == 0
+static inline unsigned overlapMask(const nodeT *node, rectT rect) {
+    unsigned mask = 0;
+    for (int index = 0; index < node->count; index += 4) {
+        __m128 hit = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int dim = 0; dim < NUM_DIMS; dim++) {
+            __m128 nmin = _mm_loadu_ps(&node->min[dim][index]);
+            __m128 nmax = _mm_loadu_ps(&node->max[dim][index]);
+            hit = _mm_and_ps(hit, _mm_cmpngt_ps(nmin, _mm_set1_ps(rect.max[dim])));
+            hit = _mm_and_ps(hit, _mm_cmpnlt_ps(nmax, _mm_set1_ps(rect.min[dim])));
+        }
+        mask |= (unsigned) _mm_movemask_ps(hit) << index;
+    }
+    return mask & ((1u << node->count) - 1);
+}
+#else
+static inline unsigned overlapMask(const nodeT *node, rectT rect) {
+    unsigned mask = 0;
+    for (int index = 0; index < node->count; index++) {
+        int hit = 1;
+        for (int dim = 0; dim < NUM_DIMS; dim++) {
+            hit &= !(node->min[dim][index] > rect.max[dim]);
+            hit &= !(rect.min[dim] > node->max[dim][index]);
+        }
+        mask |= (unsigned) hit << index;
+    }
+    return mask;
+}
+#endif
+
+/* index of the lowest set bit of a non zero mask. */
+static inline int maskNext(unsigned mask) {
+#if defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    int index = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+static inline int maskCount(unsigned mask) {
+#if defined(__GNUC__)
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (; mask; mask &= mask - 1) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+/* prefetchNode asks for the lines of a node read by overlapMask() so that
+ * they load while the siblings are being visited. */
+static inline void prefetchNode(const nodeT *node) {
+#if defined(__GNUC__)
+    __builtin_prefetch(node);
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        __builtin_prefetch(&node->min[dim][0]);
+        __builtin_prefetch(&node->max[dim][0]);
+    }
+#else
+    (void) node;
+#endif
+}
+
+#define POOL_PAGE_NODES 64
+#define POOL_PAGE_HEADER 16     // the page link, padded to keep the nodes aligned.
+
+static nodeT *poolAlloc(poolT *pool) {
+    nodeT *node = pool->free;
+    if (node) {
+        pool->free = node->child[0];
+    } else {
+        if (pool->next == pool->end) {
+            int slots = pool->pageNodes == 0 ? 1 : pool->pageNodes * 2;
+            if (slots > POOL_PAGE_NODES) {
+                slots = POOL_PAGE_NODES;
+            }
+            size_t bytes = POOL_PAGE_HEADER + slots * sizeof(nodeT);
+            char *page = zmalloc(bytes);
+            if (!page) {
+                return NULL;
+            }
+            *(void **) page = pool->pages;
+            pool->pages = page;
+            pool->next = page + POOL_PAGE_HEADER;
+            pool->end = pool->next + slots * sizeof(nodeT);
+            pool->pageNodes = slots;
+            pool->bytes += bytes;
+        }
+        node = (nodeT *) pool->next;
+        pool->next += sizeof(nodeT);
+    }
+    memset(node, 0, sizeof(nodeT));
+    node->gen = pool->gen;
+    pool->nodes++;
+    return node;
+}
+
+static void poolFree(poolT *pool, nodeT *node) {
+    node->child[0] = pool->free;
+    pool->free = node;
+    pool->nodes--;
+}
+
+/* releases every node of the pool at once. */
+static void poolRelease(poolT *pool) {
+    void *page = pool->pages;
+    while (page) {
+        void *next = *(void **) page;
+        zfree(page);
+        page = next;
+    }
+    pool->pages = NULL;
+    pool->free = NULL;
+    pool->next = pool->end = NULL;
+    pool->pageNodes = 0;
+    pool->nodes = 0;
+    pool->bytes = 0;
+    pool->retired = pool->retiredTail = NULL;
 }
 
+/* frees the retired nodes no live snapshot can reach anymore: a node
+ * retired in a generation is only read by the snapshots taken up to it. */
+static void poolReclaim(poolT *pool) {
+    while (pool->retired && (pool->nlive == 0 || pool->retired->gen < pool->live[0])) {
+        nodeT *node = pool->retired;
+        pool->retired = node->parent;
+        poolFree(pool, node);
+    }
+    if (!pool->retired) {
+        pool->retiredTail = NULL;
+    }
+    if (pool->nlive == 0) {
+        pool->shared = 0;
+    }
+}
+
+/* When the pool has a link offset, every item keeps a pointer to the leaf
+ * holding it so that updateInPlace() finds it without a descent. Items
+ * only change leaf when they are added to one, so the links are set by
+ * addBranch() and by the splits, which may leave any item in either half. */
+static inline void linkItem(poolT *pool, void *item, nodeT *leaf) {
+    if (pool && pool->link) {
+        *(nodeT **) ((char *) item + pool->link - 1) = leaf;
+    }
+}
+
+static void linkLeaf(poolT *pool, nodeT *leaf) {
+    if (pool && pool->link && leaf->level == 0) {
+        for (int index = 0; index < leaf->count; index++) {
+            linkItem(pool, leaf->item[index], leaf);
+        }
+    }
+}
+
+static inline int nodeShared(poolT *pool, nodeT *node) {
+    return node->gen < pool->shared;
+}
+
+static void poolRetire(poolT *pool, nodeT *node) {
+    node->gen = pool->gen;
+    node->parent = NULL;
+    if (pool->retiredTail) {
+        pool->retiredTail->parent = node;
+    } else {
+        pool->retired = node;
+    }
+    pool->retiredTail = node;
+}
+
+/* replaces a read only node with a copy of the current generation. The
+ * snapshots never follow the parents, so the children are moved to the
+ * copy in place. The caller puts the copy in the place of the node. */
+static nodeT *nodeCopy(poolT *pool, nodeT *node) {
+    nodeT *copy = poolAlloc(pool);
+    memcpy(copy, node, sizeof(nodeT));
+    copy->gen = pool->gen;
+    if (copy->level > 0) {
+        for (int index = 0; index < copy->count; index++) {
+            copy->child[index]->parent = copy;
+        }
+    } else {
+        linkLeaf(pool, copy);
+    }
+    poolRetire(pool, node);
+    return copy;
+}
+
+static nodeT *nodeOwnRoot(poolT *pool, nodeT **root) {
+    if (*root && nodeShared(pool, *root)) {
+        *root = nodeCopy(pool, *root);
+        (*root)->parent = NULL;
+    }
+    return *root;
+}
+
+/* returns the child at index of a node the tree owns, copied first if it
+ * is read only. Used on the way down of the insertions. */
+static nodeT *nodeOwnChild(poolT *pool, nodeT *node, int index) {
+    nodeT *child = node->child[index];
+    if (nodeShared(pool, child)) {
+        child = nodeCopy(pool, child);
+        node->child[index] = child;
+        child->parent = node;
+    }
+    return child;
+}
+
+/* makes the path from the root to node writable and returns the node, or
+ * its copy. The parents of a node of the current generation are of the
+ * current generation too, so the copies stop at the first one. */
+static nodeT *nodeOwnPath(poolT *pool, nodeT **root, nodeT *node) {
+    nodeT *path[MAX_LEVELS];
+    int count = 0;
+    for (nodeT *n = node; n && nodeShared(pool, n); n = n->parent) {
+        path[count++] = n;
+    }
+    if (count == 0) {
+        return node;
+    }
+    nodeT *parent = path[count-1]->parent;
+    if (!parent) {
+        parent = nodeOwnRoot(pool, root);
+        count--;
+    }
+    while (count > 0) {
+        nodeT *n = path[--count];
+        int index = 0;
+        while (parent->child[index] != n) {
+            index++;
+        }
+        parent = nodeOwnChild(pool, parent, index);
+    }
+    return parent;
+}
+
+/* the nodes left underfull by a removal, at most one per level, waiting
+ * for their branches to be inserted again. */
+typedef struct reinsertT {
+    nodeT *nodes[MAX_LEVELS];
+    int   count;
+} reinsertT;
+
 /* move the last of branch here, and decrease the count of node */
 static void disconnectBranch(nodeT *node, int index) {
-    node->branch[index] = node->branch[node->count-1];
+    branchT last = nodeBranch(node, node->count-1);
+    nodeSetBranch(node, index, &last);
     node->count--;
 }
 
@@ -234,10 +641,10 @@ static rectT nodeCover(nodeT *node) {
     memset(&rect, 0, sizeof(rectT));
     for (int index = 0; index < node->count; index++) {
         if (firstTime) {
-            rect = node->branch[index].rect;
+            rect = nodeRect(node, index);
             firstTime = 0;
         } else {
-            rect = combineRect(rect, node->branch[index].rect);
+            rect = combineRect(rect, nodeRect(node, index));
         }
     }
     return rect;
@@ -279,7 +686,7 @@ static NUMBER calcRectVolume(rectT rect) {
 
 static void getBranches(nodeT *node, branchT *branch, partitionVarsT *parVars) {
     for (int index = 0; index < MAX_NODES; index++) {
-        parVars->branchBuf[index] = node->branch[index];
+        parVars->branchBuf[index] = nodeBranch(node, index);
     }
     parVars->branchBuf[MAX_NODES] = *branch;
     parVars->branchCount = MAX_NODES + 1;
@@ -398,14 +805,14 @@ static void choosePartition(partitionVarsT *parVars, int minFill) {
 static void loadNodes(nodeT *nodeA, nodeT *nodeB, partitionVarsT *parVars) {
     for (int index = 0; index < parVars->total; index++) {
         if (parVars->partition[index] == 0) {
-            addBranch(&parVars->branchBuf[index], nodeA, NULL);
+            addBranch(&parVars->branchBuf[index], nodeA, NULL, NULL);
         } else if (parVars->partition[index] == 1) {
-            addBranch(&parVars->branchBuf[index], nodeB, NULL);
+            addBranch(&parVars->branchBuf[index], nodeB, NULL, NULL);
         }
     }
 }
 
-static void splitNode(nodeT *node, branchT *branch, nodeT **newNode) {
+static void splitNode(nodeT *node, branchT *branch, nodeT **newNode, poolT *pool) {
     partitionVarsT localVars;
     memset(&localVars, 0, sizeof(partitionVarsT));
     partitionVarsT *parVars = &localVars;
@@ -413,36 +820,28 @@ static void splitNode(nodeT *node, branchT *branch, nodeT **newNode) {
     level = node->level;
     getBranches(node, branch, parVars);
     choosePartition(parVars, MIN_NODES);
-    *newNode = zmalloc(sizeof(nodeT));
-    memset(*newNode, 0, sizeof(nodeT));
+    *newNode = poolAlloc(pool);
     node->level = level;
     (*newNode)->level = node->level;
     loadNodes(node, *newNode, parVars);
+    linkLeaf(pool, node);
+    linkLeaf(pool, *newNode);
 }
 
-static int addBranch(branchT *branch, nodeT *node, nodeT **newNode) {
+static int addBranch(branchT *branch, nodeT *node, nodeT **newNode, poolT *pool) {
     if (node->count < MAX_NODES) {
-        node->branch[node->count] = *branch;
+        nodeSetBranch(node, node->count, branch);
         node->count++;
+        if (node->level == 0) {
+            linkItem(pool, branch->item, node);
+        }
         return 0;
     }
-    splitNode(node, branch, newNode);
+    splitNode(node, branch, newNode, pool);
     return 1;
 }
 
-static void freeNode(nodeT *node){
-    if (!node) {
-        return;
-    }
-    for (int i=0;i<node->count;i++) {
-        if (node->branch[i].child) {
-            freeNode(node->branch[i].child);
-        }
-    }
-    zfree(node);
-}
-
-static int insertRectRec(rectT rect, void *item, nodeT *child, nodeT *node, nodeT **newNode, int level) {
+static int insertRectRec(rectT rect, void *item, nodeT *child, nodeT *node, nodeT **newNode, int level, poolT *pool) {
     int index = 0;
     branchT branch;
     memset(&branch, 0, sizeof(branchT));
@@ -452,40 +851,321 @@ static int insertRectRec(rectT rect, void *item, nodeT *child, nodeT *node, node
     }
     if (node->level > level) {
         index = pickBranch(rect, node);
-        if (!insertRectRec(rect, item, child, node->branch[index].child, &otherNode, level)) {
-            node->branch[index].rect = combineRect(rect, node->branch[index].rect);
+        if (!insertRectRec(rect, item, child, nodeOwnChild(pool, node, index), &otherNode, level, pool)) {
+            nodeSetRect(node, index, combineRect(rect, nodeRect(node, index)));
+            node->total[index] = nodeTotal(node->child[index]);
             return 0;
         }
-        node->branch[index].rect = nodeCover(node->branch[index].child);
+        nodeSetRect(node, index, nodeCover(node->child[index]));
+        node->total[index] = nodeTotal(node->child[index]);
         branch.child = otherNode;
         branch.rect = nodeCover(otherNode);
-        return addBranch(&branch, node, newNode);
+        return addBranch(&branch, node, newNode, pool);
     } else if (node->level == level) {
         branch.rect = rect;
         branch.item = item;
         branch.child = child;
-        return addBranch(&branch, node, newNode);
+        return addBranch(&branch, node, newNode, pool);
     }
     return 0;
 }
 
-static int insertRect(rectT rect, void *item, nodeT *child, void **vroot, int level) {
-    nodeT **root = (nodeT **) vroot;
+/* the root was split in two, put both halves under a new root. */
+static void growRoot(nodeT **root, nodeT *newNode, poolT *pool) {
     nodeT *newRoot = NULL;
-    nodeT *newNode = NULL;
     branchT branch;
     memset(&branch, 0, sizeof(branchT));
-    if (insertRectRec(rect, item, child, *root, &newNode, level)) {
-        newRoot = zmalloc(sizeof(nodeT));
-        memset(newRoot, 0, sizeof(nodeT));
-        newRoot->level = (*root)->level + 1;
-        branch.rect = nodeCover(*root);
-        branch.child = *root;
-        addBranch(&branch, newRoot, NULL);
-        branch.rect = nodeCover(newNode);
-        branch.child = newNode;
-        addBranch(&branch, newRoot, NULL);
-        *root = newRoot;
+    newRoot = poolAlloc(pool);
+    newRoot->level = (*root)->level + 1;
+    branch.rect = nodeCover(*root);
+    branch.child = *root;
+    addBranch(&branch, newRoot, NULL, NULL);
+    branch.rect = nodeCover(newNode);
+    branch.child = newNode;
+    addBranch(&branch, newRoot, NULL, NULL);
+    *root = newRoot;
+}
+
+/* R*-tree insertion.
+ *
+ * Beckmann, Kriegel, Schneider and Seeger. The R*-tree: An Efficient and
+ * Robust Access Method for Points and Rectangles, Proc. ACM SIGMOD 1990.
+ *
+ * Compared to the quadratic split above, the subtree is chosen by the least
+ * overlap enlargement right above the target level, the split axis is the
+ * one with the smallest sum of margins and the split index the one with
+ * the least overlap between the two groups. The first time a level
+ * overflows during an insertion, RSTAR_REINSERT of its branches farthest
+ * from its center are taken out and inserted again instead of splitting,
+ * which lets the tree reorganize as it grows. */
+
+#define RSTAR_MIN_FILL   (MAX_NODES*2/5)
+#define RSTAR_REINSERT   (MAX_NODES*3/10)
+
+typedef struct rstarStateT {
+    poolT    *pool;
+    unsigned overflowed;    // levels that already did a forced reinsert.
+    int      count;         // branches waiting to be reinserted.
+    branchT  pending[RSTAR_REINSERT*MAX_LEVELS];
+    int      level[RSTAR_REINSERT*MAX_LEVELS];
+} rstarStateT;
+
+static NUMBER rectMargin(rectT rect) {
+    NUMBER margin = 0;
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        margin += rect.max[dim] - rect.min[dim];
+    }
+    return margin;
+}
+
+static NUMBER overlapVolume(rectT rectA, rectT rectB) {
+    NUMBER volume = 1;
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        NUMBER lo = max(rectA.min[dim], rectB.min[dim]);
+        NUMBER hi = min(rectA.max[dim], rectB.max[dim]);
+        if (hi <= lo) {
+            return 0;
+        }
+        volume *= hi - lo;
+    }
+    return volume;
+}
+
+static int rstarPickBranch(rectT rect, nodeT *node, int level) {
+    int best = 0;
+    NUMBER bestOverlap = 0, bestIncr = 0, bestArea = 0;
+    for (int index = 0; index < node->count; index++) {
+        rectT curRect = nodeRect(node, index);
+        rectT bigRect = combineRect(rect, curRect);
+        NUMBER area = rectVolume(curRect);
+        NUMBER increase = rectVolume(bigRect) - area;
+        NUMBER overlapIncr = 0;
+        /* the overlap is only worth its cost right above the target
+         * level, higher up the area enlargement is used alone. */
+        if (node->level == level + 1) {
+            for (int other = 0; other < node->count; other++) {
+                if (other != index) {
+                    rectT otherRect = nodeRect(node, other);
+                    overlapIncr += overlapVolume(bigRect, otherRect) - overlapVolume(curRect, otherRect);
+                }
+            }
+        }
+        if (index == 0 || overlapIncr < bestOverlap ||
+            (overlapIncr == bestOverlap && (increase < bestIncr ||
+             (increase == bestIncr && area < bestArea)))) {
+            best = index;
+            bestOverlap = overlapIncr;
+            bestIncr = increase;
+            bestArea = area;
+        }
+    }
+    return best;
+}
+
+/* fills the covers of the first k branches and of the last total-k. */
+static void rstarCovers(branchT *buf, int total, rectT *head, rectT *tail) {
+    head[0] = buf[0].rect;
+    for (int index = 1; index < total; index++) {
+        head[index] = combineRect(head[index-1], buf[index].rect);
+    }
+    tail[total-1] = buf[total-1].rect;
+    for (int index = total-2; index >= 0; index--) {
+        tail[index] = combineRect(tail[index+1], buf[index].rect);
+    }
+}
+
+static inline NUMBER rstarSortKey(const branchT *branch, int axis, int byMax) {
+    return byMax ? branch->rect.max[axis] : branch->rect.min[axis];
+}
+
+/* sorts the branches by their min, or max, on axis. An insertion sort as
+ * there are only MAX_NODES+1 of them. */
+static void rstarSort(branchT *buf, int total, int axis, int byMax) {
+    for (int index = 1; index < total; index++) {
+        branchT tmp = buf[index];
+        NUMBER key = rstarSortKey(&tmp, axis, byMax);
+        int pos = index;
+        while (pos > 0 && rstarSortKey(&buf[pos-1], axis, byMax) > key) {
+            buf[pos] = buf[pos-1];
+            pos--;
+        }
+        buf[pos] = tmp;
+    }
+}
+
+static void rstarSplitNode(nodeT *node, branchT *branch, nodeT **newNode, poolT *pool) {
+    branchT buf[MAX_NODES+1];
+    rectT head[MAX_NODES+1], tail[MAX_NODES+1];
+    int total = MAX_NODES+1;
+    for (int index = 0; index < MAX_NODES; index++) {
+        buf[index] = nodeBranch(node, index);
+    }
+    buf[MAX_NODES] = *branch;
+
+    /* the axis with the least margin over all the distributions. */
+    int bestAxis = 0;
+    NUMBER bestMargin = 0;
+    for (int axis = 0; axis < NUM_DIMS; axis++) {
+        NUMBER margin = 0;
+        for (int byMax = 0; byMax < 2; byMax++) {
+            rstarSort(buf, total, axis, byMax);
+            rstarCovers(buf, total, head, tail);
+            for (int k = RSTAR_MIN_FILL; k <= total-RSTAR_MIN_FILL; k++) {
+                margin += rectMargin(head[k-1]) + rectMargin(tail[k]);
+            }
+        }
+        if (axis == 0 || margin < bestMargin) {
+            bestAxis = axis;
+            bestMargin = margin;
+        }
+    }
+
+    /* along it, the distribution with the least overlap, then area. */
+    int bestByMax = 0, bestK = RSTAR_MIN_FILL;
+    NUMBER bestOverlap = 0, bestArea = 0;
+    for (int byMax = 0; byMax < 2; byMax++) {
+        rstarSort(buf, total, bestAxis, byMax);
+        rstarCovers(buf, total, head, tail);
+        for (int k = RSTAR_MIN_FILL; k <= total-RSTAR_MIN_FILL; k++) {
+            NUMBER overlapArea = overlapVolume(head[k-1], tail[k]);
+            NUMBER area = rectVolume(head[k-1]) + rectVolume(tail[k]);
+            if ((byMax == 0 && k == RSTAR_MIN_FILL) || overlapArea < bestOverlap ||
+                (overlapArea == bestOverlap && area < bestArea)) {
+                bestByMax = byMax;
+                bestK = k;
+                bestOverlap = overlapArea;
+                bestArea = area;
+            }
+        }
+    }
+    rstarSort(buf, total, bestAxis, bestByMax);
+
+    *newNode = poolAlloc(pool);
+    (*newNode)->level = node->level;
+    node->count = 0;
+    for (int index = 0; index < total; index++) {
+        addBranch(&buf[index], index < bestK ? node : *newNode, NULL, NULL);
+    }
+    linkLeaf(pool, node);
+    linkLeaf(pool, *newNode);
+}
+
+static NUMBER rstarCenterDist(rectT rect, rectT cover) {
+    NUMBER dist = 0;
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        NUMBER d = (rect.min[dim] + rect.max[dim]) - (cover.min[dim] + cover.max[dim]);
+        dist += d * d;
+    }
+    return dist;
+}
+
+/* takes the RSTAR_REINSERT branches farthest from the center of the node
+ * out and queues them, closest first, for rstarInsert() to insert again. */
+static void rstarForceReinsert(nodeT *node, branchT *branch, rstarStateT *st) {
+    branchT buf[MAX_NODES+1];
+    NUMBER dist[MAX_NODES+1];
+    int total = MAX_NODES+1;
+    for (int index = 0; index < MAX_NODES; index++) {
+        buf[index] = nodeBranch(node, index);
+    }
+    buf[MAX_NODES] = *branch;
+    rectT cover = buf[0].rect;
+    for (int index = 1; index < total; index++) {
+        cover = combineRect(cover, buf[index].rect);
+    }
+    for (int index = 0; index < total; index++) {
+        dist[index] = rstarCenterDist(buf[index].rect, cover);
+    }
+    /* selection sort of the farthest first, total is small. */
+    for (int index = 0; index < RSTAR_REINSERT; index++) {
+        int far = index;
+        for (int other = index + 1; other < total; other++) {
+            if (dist[other] > dist[far]) {
+                far = other;
+            }
+        }
+        branchT tb = buf[index]; buf[index] = buf[far]; buf[far] = tb;
+        NUMBER td = dist[index]; dist[index] = dist[far]; dist[far] = td;
+    }
+    for (int index = 0; index < RSTAR_REINSERT; index++) {
+        st->pending[st->count] = buf[index];
+        st->level[st->count] = node->level;
+        st->count++;
+    }
+    node->count = 0;
+    for (int index = RSTAR_REINSERT; index < total; index++) {
+        addBranch(&buf[index], node, NULL, NULL);
+    }
+    linkLeaf(st->pool, node);
+}
+
+static int rstarAddBranch(branchT *branch, nodeT *node, nodeT **newNode, int isRoot, rstarStateT *st) {
+    if (node->count < MAX_NODES) {
+        return addBranch(branch, node, newNode, st->pool);
+    }
+    if (!isRoot && node->level < MAX_LEVELS && !(st->overflowed & (1u << node->level))) {
+        st->overflowed |= 1u << node->level;
+        rstarForceReinsert(node, branch, st);
+        return 0;
+    }
+    rstarSplitNode(node, branch, newNode, st->pool);
+    return 1;
+}
+
+static int rstarInsertRec(branchT *branch, nodeT *node, nodeT **newNode, int level, int isRoot, rstarStateT *st) {
+    if (node->level > level) {
+        nodeT *otherNode = NULL;
+        int index = rstarPickBranch(branch->rect, node, level);
+        int split = rstarInsertRec(branch, nodeOwnChild(st->pool, node, index), &otherNode, level, 0, st);
+        /* a forced reinsert below may have shrunk the child. */
+        nodeSetRect(node, index, nodeCover(node->child[index]));
+        node->total[index] = nodeTotal(node->child[index]);
+        if (!split) {
+            return 0;
+        }
+        branchT other;
+        memset(&other, 0, sizeof(branchT));
+        other.rect = nodeCover(otherNode);
+        other.child = otherNode;
+        return rstarAddBranch(&other, node, newNode, isRoot, st);
+    }
+    return rstarAddBranch(branch, node, newNode, isRoot, st);
+}
+
+static void rstarInsert(rectT rect, void *item, nodeT *child, nodeT **root, int level, poolT *pool) {
+    rstarStateT st;
+    st.pool = pool;
+    st.overflowed = 0;
+    st.count = 0;
+    branchT branch;
+    memset(&branch, 0, sizeof(branchT));
+    branch.rect = rect;
+    branch.item = item;
+    branch.child = child;
+    for (;;) {
+        nodeT *newNode = NULL;
+        if (rstarInsertRec(&branch, *root, &newNode, level, 1, &st)) {
+            growRoot(root, newNode, pool);
+        }
+        if (st.count == 0) {
+            break;
+        }
+        st.count--;
+        branch = st.pending[st.count];
+        level = st.level[st.count];
+    }
+}
+
+static int insertRect(rectT rect, void *item, nodeT *child, void **vroot, int level, int rstar, poolT *pool) {
+    nodeT **root = (nodeT **) vroot;
+    nodeT *newNode = NULL;
+    nodeOwnRoot(pool, root);
+    if (rstar) {
+        rstarInsert(rect, item, child, root, level, pool);
+        return 0;
+    }
+    if (insertRectRec(rect, item, child, *root, &newNode, level, pool)) {
+        growRoot(root, newNode, pool);
         return 1;
     }
     return 0;
@@ -501,7 +1181,7 @@ static int pickBranch(rectT rect, nodeT *node) {
     rectT tempRect;
     memset(&tempRect, 0, sizeof(rectT));
     for (int index = 0; index < node->count; index++) {
-        rectT curRect = node->branch[index].rect;
+        rectT curRect = nodeRect(node, index);
         area = calcRectVolume(curRect);
         tempRect = combineRect(rect, curRect);
         increase = calcRectVolume(tempRect) - area;
@@ -519,38 +1199,113 @@ static int pickBranch(rectT rect, nodeT *node) {
     return best;
 }
 
-static int countRec(nodeT *node, int counter) {
-    if (node->level > 0) {
-        for (int index = 0; index < node->count; index++) {
-            counter = countRec(node->branch[index].child, counter);
+/* Counting with the subtree totals: the children whose rect lies inside the
+ * query count as their total without being visited, only the ones on the
+ * boundary of the query are refined. The approximate count stops above the
+ * leaves and estimates a boundary child by the fraction of its rect inside
+ * the query rect, the error is then bounded by the items of the boundary
+ * children. */
+
+/* the classes of a node rect, the same as RTREE_OUTSIDE... in rtree.h. */
+#define COUNT_OUTSIDE 0
+#define COUNT_INSIDE  1
+#define COUNT_PARTIAL 2
+
+typedef struct countT {
+    int       (*classify)(rectT rect, void *userdata);          // a node rect against the query.
+    int       (*match)(rectT rect, void *item, void *userdata); // an item against the query.
+    double    (*estimate)(rectT rect, void *userdata);          // fraction of a node rect in the query, may be NULL.
+    void      *userdata;
+    int       approx;
+    long long inside;      // items counted exactly.
+    long long boundary;    // items of the estimated children.
+    double    guess;       // estimated items inside among them.
+} countT;
+
+static double countFraction(rectT rect, rectT query) {
+    double fraction = 1;
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        double len = (double) rect.max[dim] - rect.min[dim];
+        if (len > 0) {
+            double lo = max(rect.min[dim], query.min[dim]), hi = min(rect.max[dim], query.max[dim]);
+            fraction *= hi > lo ? (hi - lo) / len : 0;
         }
-    } else {
-        counter += node->count;
     }
-    return counter;
+    return fraction;
 }
 
-static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNode) {
+static void countRect(nodeT *node, rectT rect, countT *c) {
+    for (unsigned mask = overlapMask(node, rect); mask; mask &= mask - 1) {
+        int index = maskNext(mask);
+        rectT r = nodeRect(node, index);
+        if (node->level == 0) {
+            if (c->match(r, node->item[index], c->userdata)) {
+                c->inside++;
+            }
+            continue;
+        }
+        int class = c->classify(r, c->userdata);
+        if (class == COUNT_INSIDE) {
+            c->inside += node->total[index];
+        } else if (class == COUNT_PARTIAL) {
+            if (c->approx && node->level == 1) {
+                c->boundary += node->total[index];
+                double fraction = c->estimate ? c->estimate(r, c->userdata) : countFraction(r, rect);
+                c->guess += node->total[index] * fraction;
+            } else {
+                countRect(node->child[index], rect, c);
+            }
+        }
+    }
+}
+
+typedef struct statsT {
+    int       height;
+    long long nodes;
+    long long branches;
+    long long items;
+    double    overlap;     // pairwise overlap of the rects of sibling nodes.
+    double    volume;      // volume of the rects of the nodes below the root.
+} statsT;
+
+static void statsRec(nodeT *node, statsT *stats) {
+    stats->nodes++;
+    stats->branches += node->count;
+    if (node->level == 0) {
+        stats->items += node->count;
+        return;
+    }
+    for (int index = 0; index < node->count; index++) {
+        rectT rect = nodeRect(node, index);
+        stats->volume += rectVolume(rect);
+        for (int other = index + 1; other < node->count; other++) {
+            stats->overlap += overlapVolume(rect, nodeRect(node, other));
+        }
+        statsRec(node->child[index], stats);
+    }
+}
+
+static int removeRectRec(rectT rect, void *item, nodeT *node, reinsertT *underfull) {
     if (node == NULL) {
         return 1;
     }
     if (node->level > 0) {
-        for (int index = 0; index < node->count; index++) {
-            if (overlap(rect, node->branch[index].rect)) {
-                if (!removeRectRec(rect, item, node->branch[index].child, listNode)) {
-                    if (node->branch[index].child->count >= MIN_NODES) {
-                        node->branch[index].rect = nodeCover(node->branch[index].child);
-                    } else {
-                        reinsert(node->branch[index].child, listNode);
-                        disconnectBranch(node, index);
-                    }
-                    return 0;
+        for (unsigned mask = overlapMask(node, rect); mask; mask &= mask - 1) {
+            int index = maskNext(mask);
+            if (!removeRectRec(rect, item, node->child[index], underfull)) {
+                if (node->child[index]->count >= MIN_NODES) {
+                    nodeSetRect(node, index, nodeCover(node->child[index]));
+                    node->total[index] = nodeTotal(node->child[index]);
+                } else {
+                    underfull->nodes[underfull->count++] = node->child[index];
+                    disconnectBranch(node, index);
                 }
+                return 0;
             }
         }
     } else {
         for (int index = 0; index < node->count; index++) {
-            if (node->branch[index].item == item) {
+            if (node->item[index] == item) {
                 disconnectBranch(node, index);
                 return 0;
             }
@@ -559,60 +1314,451 @@ static int removeRectRec(rectT rect, void *item, nodeT *node, listNodeT **listNo
     return 1;
 }
 
+/* returns the leaf holding item, without changing anything. */
+static nodeT *findLeaf(rectT rect, void *item, nodeT *node) {
+    if (node->level > 0) {
+        for (unsigned mask = overlapMask(node, rect); mask; mask &= mask - 1) {
+            nodeT *leaf = findLeaf(rect, item, node->child[maskNext(mask)]);
+            if (leaf) {
+                return leaf;
+            }
+        }
+        return NULL;
+    }
+    for (int index = 0; index < node->count; index++) {
+        if (node->item[index] == item) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
 /* rectangle remove is resource cost operation
  * try to skip this operation as we can
  * return 0 if actually deleted, otherwise return 1 */
-static int removeRect(rectT rect, void *item, void **vroot) {
+static int removeRect(rectT rect, void *item, void **vroot, int rstar, poolT *pool) {
     nodeT **root = (nodeT **) vroot;
     nodeT *tempNode = NULL;
-    listNodeT *reinsertList = NULL;
-    if (!removeRectRec(rect, item, *root, &reinsertList)) {
-        while (reinsertList != NULL) {
-            tempNode = reinsertList->node;
+    reinsertT underfull;
+    underfull.count = 0;
+    if (pool->shared) {
+        /* removeRectRec changes the nodes on the way back up, the path
+         * has to be owned before. */
+        nodeT *leaf = findLeaf(rect, item, *root);
+        if (!leaf) {
+            return 1;
+        }
+        nodeOwnPath(pool, root, leaf);
+    }
+    if (!removeRectRec(rect, item, *root, &underfull)) {
+        /* the highest level first, as they were queued bottom up. */
+        while (underfull.count > 0) {
+            tempNode = underfull.nodes[--underfull.count];
             for (int index = 0; index < tempNode->count; index++) {
-                insertRect(tempNode->branch[index].rect,
-                    tempNode->branch[index].item,
-                    tempNode->branch[index].child,
+                insertRect(nodeRect(tempNode, index),
+                    tempNode->item[index],
+                    tempNode->child[index],
                     vroot,
-                    tempNode->level);
+                    tempNode->level,
+                    rstar,
+                    pool);
             }
-            listNodeT *prev = reinsertList;
-            reinsertList = reinsertList->next;
-            if (prev->node) zfree(prev->node);
-            zfree(prev);
+            poolFree(pool, tempNode);
         }
         if ((*root)->count == 1 && (*root)->level > 0) {
-            tempNode = (*root)->branch[0].child;
-            *root = tempNode;
+            tempNode = *root;
+            *root = tempNode->child[0];
+            (*root)->parent = NULL;
+            poolFree(pool, tempNode);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+static inline int rectContains(rectT outer, rectT inner) {
+    for (int dim = 0; dim < NUM_DIMS; dim++) {
+        if (inner.min[dim] < outer.min[dim] || inner.max[dim] > outer.max[dim]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Bottom-up update of a linked item, see linkItem().
+ *
+ * Lee, Hsu, Jensen, Cui and Teo. Supporting Frequent Updates in R-Trees: A
+ * Bottom-Up Approach, VLDB 2003.
+ *
+ * The leaf is reached through the link of the item and its rect replaced
+ * when the new one still fits the rect the parent has for the leaf, which
+ * is what most small moves do. The covers above stay valid, only looser.
+ * Returns 0 when the item has to be removed and inserted again. */
+static int updateInPlace(void *item, rectT rect, void **vroot, poolT *pool) {
+    if (!pool->link) {
+        return 0;
+    }
+    nodeT *leaf = *(nodeT **) ((char *) item + pool->link - 1);
+    if (!leaf) {
+        return 0;
+    }
+    int slot = -1;
+    for (int index = 0; index < leaf->count; index++) {
+        if (leaf->item[index] == item) {
+            slot = index;
+            break;
         }
+    }
+    if (slot < 0) {
         return 0;
     }
+    nodeT *parent = leaf->parent;
+    if (parent) {
+        int index = 0;
+        while (index < parent->count && parent->child[index] != leaf) {
+            index++;
+        }
+        if (index == parent->count || !rectContains(nodeRect(parent, index), rect)) {
+            return 0;
+        }
+    }
+    leaf = nodeOwnPath(pool, (nodeT **) vroot, leaf);
+    nodeSetRect(leaf, slot, rect);
     return 1;
 }
 
 static int search(nodeT *node, rectT rect, int(*iterator)(rectT rect, void *item, void *userdata), void *userdata){
     int counter = 0;
     if (node) {
+        unsigned mask = overlapMask(node, rect);
         if (node->level > 0) {
-            for (int index = 0; index < node->count; index++) {
-                if (overlap(rect, node->branch[index].rect)) {
-                    counter += search(node->branch[index].child, rect, iterator, userdata);
-                }
+            for (unsigned m = mask; m; m &= m - 1) {
+                prefetchNode(node->child[maskNext(m)]);
+            }
+            for (; mask; mask &= mask - 1) {
+                counter += search(node->child[maskNext(mask)], rect, iterator, userdata);
             }
+        } else if (!iterator) {
+            counter = maskCount(mask);
         } else {
-            for (int index = 0; index < node->count; index++) {
-                if (overlap(rect, node->branch[index].rect)) {
-                    if (iterator){
-                        if (!iterator(node->branch[index].rect, node->branch[index].item, userdata)){
-                            return counter;
-                        }
-                    }
-                    counter++;
+            for (; mask; mask &= mask - 1) {
+                int index = maskNext(mask);
+                if (!iterator(nodeRect(node, index), node->item[index], userdata)){
+                    return counter;
                 }
+                counter++;
             }
         }
     }
     return counter;
 }
 
+/* splitSearch fills parts with the subtrees holding the items of rect, taken
+ * from the deepest level where they are at most max, so that they can be
+ * searched apart. Returns their number, 0 when no item can match. */
+static int splitSearch(nodeT *root, rectT rect, nodeT **parts, int max) {
+    if (!root || max < 1) {
+        return 0;
+    }
+    nodeT **next = zmalloc(max * sizeof(nodeT *));
+    int count = 1;
+    parts[0] = root;
+    while (next && count > 0 && parts[0]->level > 0) {
+        int n = 0;
+        for (int i = 0; i < count; i++) {
+            n += maskCount(overlapMask(parts[i], rect));
+        }
+        if (n > max) {
+            break;
+        }
+        n = 0;
+        for (int i = 0; i < count; i++) {
+            for (unsigned mask = overlapMask(parts[i], rect); mask; mask &= mask - 1) {
+                next[n++] = parts[i]->child[maskNext(mask)];
+            }
+        }
+        memcpy(parts, next, n * sizeof(nodeT *));
+        count = n;
+    }
+    zfree(next);
+    return count;
+}
+
+
+
+/* Sort-Tile-Recursive packing.
+ *
+ * Leutenegger, Lopez and Edgington. STR: A Simple and Efficient Algorithm
+ * for R-Tree Packing, Proc. 13th ICDE, 1997.
+ *
+ * The entries of one level are sorted by the x of their centers and cut into
+ * vertical slices of S*MAX_NODES entries, where S is the square root of the
+ * number of nodes needed. Each slice is then sorted by y and cut into nodes
+ * of MAX_NODES entries. The last two nodes of a slice are balanced so that
+ * no node ends up with less than MIN_NODES entries, and a short last slice
+ * is merged into the previous one. strTile works on any element type so it
+ * can be used for both the items and the branches of the upper levels. */
+
+typedef void (*strEmitFunc)(void *chunk, int count, void *userdata);
+
+static void strTile(void *base, int count, size_t size,
+                    int(*cmpX)(const void *a, const void *b),
+                    int(*cmpY)(const void *a, const void *b),
+                    strEmitFunc emit, void *userdata) {
+    int nodes = (count + MAX_NODES - 1) / MAX_NODES;
+    int slices = (int) ceil(sqrt((double) nodes));
+    int sliceCap = slices * MAX_NODES;
+    qsort(base, count, size, cmpX);
+    for (int start = 0; start < count;) {
+        int sliceLen = count - start;
+        if (sliceLen > sliceCap && sliceLen - sliceCap >= MIN_NODES) {
+            sliceLen = sliceCap;
+        }
+        char *slice = (char *) base + (size_t) start * size;
+        qsort(slice, sliceLen, size, cmpY);
+        for (int index = 0; index < sliceLen;) {
+            int remain = sliceLen - index;
+            int n = MAX_NODES;
+            if (remain <= MAX_NODES) {
+                n = remain;
+            } else if (remain < MAX_NODES + MIN_NODES) {
+                n = remain / 2;
+            }
+            emit(slice + (size_t) index * size, n, userdata);
+            index += n;
+        }
+        start += sliceLen;
+    }
+}
+
+static int strCompareBranchX(const void *a, const void *b) {
+    const rectT *ra = &((const branchT *) a)->rect, *rb = &((const branchT *) b)->rect;
+    NUMBER ca = ra->min[0] + ra->max[0], cb = rb->min[0] + rb->max[0];
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+static int strCompareBranchY(const void *a, const void *b) {
+    const rectT *ra = &((const branchT *) a)->rect, *rb = &((const branchT *) b)->rect;
+    NUMBER ca = ra->min[1] + ra->max[1], cb = rb->min[1] + rb->max[1];
+    return ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+typedef struct strLevelT {
+    branchT *branches; // branches pointing to the packed nodes.
+    int count;
+    int level;         // level of the packed nodes.
+    poolT *pool;
+} strLevelT;
 
+static nodeT *strNewNode(strLevelT *out) {
+    nodeT *node = poolAlloc(out->pool);
+    node->level = out->level;
+    return node;
+}
+
+static void strAddNode(strLevelT *out, nodeT *node) {
+    branchT *branch = &out->branches[out->count++];
+    memset(branch, 0, sizeof(branchT));
+    branch->rect = nodeCover(node);
+    branch->child = node;
+}
+
+static void strEmitBranches(void *chunk, int count, void *userdata) {
+    strLevelT *out = userdata;
+    nodeT *node = strNewNode(out);
+    for (int index = 0; index < count; index++) {
+        nodeSetBranch(node, index, (branchT *) chunk + index);
+    }
+    node->count = count;
+    strAddNode(out, node);
+}
+
+/* the number of nodes strTile emits for count entries. */
+static int strNodeCount(int count) {
+    return count / MIN_NODES + 1;
+}
+
+/* builds the upper levels over the branches of level-1 nodes and returns
+ * the root. The branches array is consumed. */
+static nodeT *strBuild(branchT *branches, int count, int level, poolT *pool) {
+    while (count > MAX_NODES) {
+        strLevelT out;
+        out.branches = zmalloc(strNodeCount(count) * sizeof(branchT));
+        out.count = 0;
+        out.level = level;
+        out.pool = pool;
+        strTile(branches, count, sizeof(branchT), strCompareBranchX, strCompareBranchY,
+                strEmitBranches, &out);
+        zfree(branches);
+        branches = out.branches;
+        count = out.count;
+        level++;
+    }
+    nodeT *root = NULL;
+    if (count == 1 && branches[0].child) {
+        root = branches[0].child;
+    } else {
+        strLevelT out;
+        out.branches = NULL;
+        out.level = level;
+        out.pool = pool;
+        root = strNewNode(&out);
+        for (int index = 0; index < count; index++) {
+            nodeSetBranch(root, index, &branches[index]);
+        }
+        root->count = count;
+    }
+    zfree(branches);
+    return root;
+}
+
+/* Best-first nearest neighbor traversal.
+ *
+ * Hjaltason and Samet. Distance Browsing in Spatial Databases, ACM TODS 24(2),
+ * 1999.
+ *
+ * Nodes and items are kept in a min-heap ordered by distance. The distance
+ * of a node rect must be a lower bound of the distance of anything below
+ * it. Items are first queued with the distance of their rect and queued
+ * again with their exact distance once they reach the top, so the iterator
+ * sees the items in increasing order of exact distance and the traversal
+ * only expands the nodes needed for the items actually consumed. */
+
+typedef struct nearbyElemT {
+    double dist;
+    nodeT  *node;
+    void   *item;
+    rectT  rect;
+    int    exact;
+} nearbyElemT;
+
+/* the heap starts in a buffer on the stack of nearby(), which is enough
+ * for the usual small k without allocating. */
+#define NEARBY_LOCAL_ELEMS 128
+
+typedef struct nearbyHeapT {
+    nearbyElemT *elems;
+    int count;
+    int cap;
+    nearbyElemT local[NEARBY_LOCAL_ELEMS];
+} nearbyHeapT;
+
+static int nearbyPush(nearbyHeapT *heap, nearbyElemT elem) {
+    if (heap->count == heap->cap) {
+        int ncap = heap->cap * 2;
+        nearbyElemT *nelems;
+        if (heap->elems == heap->local) {
+            nelems = zmalloc(ncap * sizeof(nearbyElemT));
+            if (nelems) {
+                memcpy(nelems, heap->local, heap->count * sizeof(nearbyElemT));
+            }
+        } else {
+            nelems = zrealloc(heap->elems, ncap * sizeof(nearbyElemT));
+        }
+        if (!nelems) {
+            return 0;
+        }
+        heap->elems = nelems;
+        heap->cap = ncap;
+    }
+    int index = heap->count++;
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (heap->elems[parent].dist < elem.dist ||
+            (heap->elems[parent].dist == elem.dist && heap->elems[parent].exact >= elem.exact)) {
+            break;
+        }
+        heap->elems[index] = heap->elems[parent];
+        index = parent;
+    }
+    heap->elems[index] = elem;
+    return 1;
+}
+
+static nearbyElemT nearbyPop(nearbyHeapT *heap) {
+    nearbyElemT top = heap->elems[0];
+    nearbyElemT last = heap->elems[--heap->count];
+    int index = 0;
+    for (;;) {
+        int child = index * 2 + 1;
+        if (child >= heap->count) {
+            break;
+        }
+        if (child + 1 < heap->count && (heap->elems[child + 1].dist < heap->elems[child].dist ||
+            (heap->elems[child + 1].dist == heap->elems[child].dist && heap->elems[child + 1].exact > heap->elems[child].exact))) {
+            child++;
+        }
+        if (last.dist < heap->elems[child].dist ||
+            (last.dist == heap->elems[child].dist && last.exact >= heap->elems[child].exact)) {
+            break;
+        }
+        heap->elems[index] = heap->elems[child];
+        index = child;
+    }
+    heap->elems[index] = last;
+    return top;
+}
+
+/* dist is called with a NULL item for node rects, nodes and items at an
+ * infinite distance are dropped. Returns the number of items passed to the
+ * iterator, or -1 when running out of memory. */
+static int nearby(nodeT *root,
+                  double(*dist)(rectT rect, void *item, void *userdata),
+                  int(*iterator)(rectT rect, void *item, double dist, void *userdata),
+                  void *userdata) {
+    int counter = 0;
+    nearbyHeapT heap;
+    heap.elems = heap.local;
+    heap.count = 0;
+    heap.cap = NEARBY_LOCAL_ELEMS;
+    nearbyElemT elem;
+    memset(&elem, 0, sizeof(nearbyElemT));
+    elem.node = root;
+    if (!root || !nearbyPush(&heap, elem)) {
+        return root ? -1 : 0;
+    }
+    while (heap.count > 0) {
+        elem = nearbyPop(&heap);
+        if (elem.node) {
+            nodeT *node = elem.node;
+            for (int index = 0; index < node->count; index++) {
+                nearbyElemT child;
+                memset(&child, 0, sizeof(nearbyElemT));
+                child.rect = nodeRect(node, index);
+                child.dist = dist(child.rect, NULL, userdata);
+                if (isinf(child.dist)) {
+                    continue;
+                }
+                if (node->level > 0) {
+                    child.node = node->child[index];
+                } else {
+                    child.item = node->item[index];
+                }
+                if (!nearbyPush(&heap, child)) {
+                    counter = -1;
+                    goto done;
+                }
+            }
+        } else if (!elem.exact) {
+            elem.dist = dist(elem.rect, elem.item, userdata);
+            elem.exact = 1;
+            if (isinf(elem.dist)) {
+                continue;
+            }
+            if (!nearbyPush(&heap, elem)) {
+                counter = -1;
+                goto done;
+            }
+        } else {
+            counter++;
+            if (!iterator(elem.rect, elem.item, elem.dist, userdata)) {
+                break;
+            }
+        }
+    }
+done:
+    if (heap.elems != heap.local) {
+        zfree(heap.elems);
+    }
+    return counter;
+}
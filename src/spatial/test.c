@@ -33,6 +33,7 @@
 #include <string.h>
 #include <time.h>
 #include "test.h"
+#include "zmalloc.h"
 
 int test_Geom();
 int test_GeomZ();
@@ -44,11 +45,13 @@ int test_GeomMultiLineString();
 int test_GeomPolygon();
 int test_GeomMultiPolygon();
 int test_GeomGeometryCollection();
+int test_GeomWKB();
 int test_GeomIterator();
 int test_GeomPolyMap();
 int test_RTreeInsert();
 int test_RTreeSearch();
 int test_RTreeRemove();
+int test_RTreeSnapshot();
 int test_GeoUtilDistance();
 int test_GeoUtilDestination();
 int test_PolyRayInside();
@@ -90,12 +93,14 @@ test tests[] = {
 	{ "geomPolygon", test_GeomPolygon },
 	{ "geomMultiPolygon", test_GeomMultiPolygon },
 	{ "geomGeometryCollection", test_GeomGeometryCollection },
+	{ "geomWKB", test_GeomWKB },
 	{ "geomIterator", test_GeomIterator },
 	{ "geomPolyMap", test_GeomPolyMap },
 	
 	{ "rtreeInsert", test_RTreeInsert },
 	{ "rtreeSearch", test_RTreeSearch },
 	{ "rtreeRemove", test_RTreeRemove },
+	{ "rtreeSnapshot", test_RTreeSnapshot },
 
 	{ "geoutilDistance", test_GeoUtilDistance },
 	{ "geoutilDestination", test_GeoUtilDestination },
@@ -163,6 +168,12 @@ int main(int argc, const char **argv) {
 	signal(SIGINT, sig_handler);
 	signal(SIGABRT, sig_handler);
 
+	// zmalloc goes through the module allocator, which is libc here.
+	RedisModule_Alloc = malloc;
+	RedisModule_Realloc = realloc;
+	RedisModule_Free = free;
+	RedisModule_Calloc = calloc;
+
 	const char *run = getenv("RUNTEST");
 	if (run == NULL){
 		run = "";
@@ -17,16 +17,77 @@
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 
+#define REDISMODULE_EXPERIMENTAL_API    // the blocked clients of the snapshot searches.
 #include "redismodule.h"
 #include "spatial/rtree.h"
 #include "spatial/geom.h"
 #include "spatial.h"
 #include "util.h"
 #include "tairgis.h"
+#include "workers.h"
 
-#define EXGIS_ENC_VER 0
+#define EXGIS_ENC_VER 1
 static RedisModuleType *ExGisType;
+static int searchThreads = 0;
+static int snapshotSearchThreads = 0;
+
+/* OUTPUT COUNT|FIELD|WKT|WKB|JSON|POINT|BOUNDS|HASH precision|QUAD level|TILE level
+ * *i points at OUTPUT and is moved to its last argument. */
+static int parseOutputOrReply(RedisModuleCtx *redisCtx, RedisModuleString **argv, int argc, int *i,
+                              searchContext *ctx) {
+    static const struct {
+        const char *name;
+        int output;
+        int maxPrecision;
+    } outputs[] = {
+        {"COUNT", OUTPUT_COUNT, 0},
+        {"FIELD", OUTPUT_FIELD, 0},
+        {"WKT", OUTPUT_WKT, 0},
+        {"WKB", OUTPUT_WKB, 0},
+        {"JSON", OUTPUT_JSON, 0},
+        {"POINT", OUTPUT_POINT, 0},
+        {"BOUNDS", OUTPUT_BOUNDS, 0},
+        {"HASH", OUTPUT_HASH, 12},
+        {"QUAD", OUTPUT_QUAD, 23},
+        {"TILE", OUTPUT_TILE, 23},
+    };
+
+    if (*i == argc - 1) {
+        RedisModule_ReplyWithError(redisCtx, "ERR output need type");
+        return REDISMODULE_ERR;
+    }
+    const char *name = RedisModule_StringPtrLen(argv[*i + 1], NULL);
+    for (size_t j = 0; j < sizeof(outputs) / sizeof(outputs[0]); j++) {
+        if (strcasecmp(name, outputs[j].name)) {
+            continue;
+        }
+        *i += 1;
+        if (outputs[j].maxPrecision) {
+            long long precision;
+            if (*i == argc - 1 || RedisModule_StringToLongLong(argv[*i + 1], &precision) != REDISMODULE_OK ||
+                precision < 1 || precision > outputs[j].maxPrecision) {
+                char err[64];
+                snprintf(err, sizeof(err), "ERR output %s need precision between 1 and %d",
+                         outputs[j].name, outputs[j].maxPrecision);
+                RedisModule_ReplyWithError(redisCtx, err);
+                return REDISMODULE_ERR;
+            }
+            ctx->precision = (int) precision;
+            *i += 1;
+        }
+        ctx->output = outputs[j].output;
+        if (ctx->output == OUTPUT_COUNT || ctx->output == OUTPUT_FIELD) {
+            ctx->flag &= ~GIS_WITHVALUE;
+        } else {
+            ctx->flag |= GIS_WITHVALUE;
+        }
+        return REDISMODULE_OK;
+    }
+    RedisModule_ReplyWithError(redisCtx, "ERR unknown output type");
+    return REDISMODULE_ERR;
+}
 
 int parseGisFlags(RedisModuleCtx *redisCtx, int start, RedisModuleString **argv, int argc, searchContext *ctx,
                   int *externflag) {
@@ -87,17 +148,14 @@ int parseGisFlags(RedisModuleCtx *redisCtx, int start, RedisModuleString **argv,
                 goto fail;
             }
 
-            int nokey = 0;
-            size_t memberLen = 0;
-            RedisModuleString *member = NULL;
             const char *memberStr = NULL;
 
-            member = RedisModule_DictGet(ctx->s->h, argv[i + 1], &nokey);
-            if (nokey == 1 || !member) {
+            spatialEntry *member = spatialTypeGetEntry(ctx->s, argv[i + 1]);
+            if (!member) {
                 RedisModule_ReplyWithError(redisCtx, "ERR member not found");
                 goto fail;
             }
-            memberStr = RedisModule_StringPtrLen(member, &memberLen);
+            memberStr = RedisModule_StringPtrLen(member->value, NULL);
             if (!geomIsSimplePoint((geom) memberStr)) {
                 RedisModule_ReplyWithError(redisCtx, "ERR member must be point");
                 goto fail;
@@ -125,6 +183,12 @@ int parseGisFlags(RedisModuleCtx *redisCtx, int start, RedisModuleString **argv,
         } else if (!strcasecmp(field, "WITHDIST")) {
             if (ctx) ctx->flag |= GIS_WITHDIST;
             if (externflag) *externflag |= GIS_WITHDIST;
+        } else if (!strcasecmp(field, "WITHWKB")) {
+            if (ctx) {
+                ctx->flag |= GIS_WITHVALUE;
+                ctx->output = OUTPUT_WKB;
+            }
+            if (externflag) *externflag |= GIS_WITHVALUE | GIS_WITHWKB;
         } else if (!strcasecmp(field, "WITHOUTVALUE")) {
             if (ctx) ctx->flag &= ~GIS_WITHVALUE;
             if (externflag) *externflag &= ~GIS_WITHVALUE;
@@ -161,6 +225,40 @@ int parseGisFlags(RedisModuleCtx *redisCtx, int start, RedisModuleString **argv,
                 goto fail;
             }
             i += 1;
+        } else if (!strcasecmp(field, "CURSOR")) {
+            if (i == argc - 1) {
+                RedisModule_ReplyWithError(redisCtx, "ERR cursor need number");
+                goto fail;
+            }
+            if (!ctx) {
+                RedisModule_ReplyWithError(redisCtx, "ERR cursor is not supported");
+                goto fail;
+            }
+            if (RedisModule_StringToLongLong(argv[i + 1], &ctx->cursor) != REDISMODULE_OK || ctx->cursor < 0) {
+                RedisModule_ReplyWithError(redisCtx, "ERR invalid cursor");
+                goto fail;
+            }
+            i += 1;
+        } else if (!strcasecmp(field, "MATCH")) {
+            if (i == argc - 1) {
+                RedisModule_ReplyWithError(redisCtx, "ERR match need pattern");
+                goto fail;
+            }
+            if (ctx) {
+                size_t len;
+                ctx->pattern = (char *) RedisModule_StringPtrLen(argv[i + 1], &len);
+                globCompile(&ctx->match, ctx->pattern, (int) len);
+                ctx->allfields = ctx->match.type == GLOB_ALL;
+            }
+            i += 1;
+        } else if (!strcasecmp(field, "OUTPUT")) {
+            if (!ctx) {
+                RedisModule_ReplyWithError(redisCtx, "ERR output is not supported");
+                goto fail;
+            }
+            if (parseOutputOrReply(redisCtx, argv, argc, &i, ctx) != REDISMODULE_OK) {
+                goto fail;
+            }
         } else if (!strcasecmp(field, "ASC")) {
             if (ctx && !(ctx->flag & GIS_SORT_DESC)) ctx->flag |= GIS_SORT_ASC;
             if (externflag && !(*externflag & GIS_SORT_DESC)) ctx->flag |= GIS_SORT_ASC;
@@ -200,6 +298,20 @@ void releaseExGisTypeObject(ExGisObj *o) {
 
 /* ========================== Command  func =============================*/
 
+/* Replicates the members set by a write as GIS.MADD key field wkb ..., so
+ * that the replicas and the AOF take the decoded WKB instead of parsing
+ * the text again. args holds count field and value pairs, the values are
+ * freed. */
+static void replicateWKB(RedisModuleCtx *ctx, RedisModuleString *key, RedisModuleString **args, int count) {
+    if (count == 0) {
+        return;
+    }
+    RedisModule_Replicate(ctx, "GIS.MADD", "sv", key, args, (size_t) count * 2);
+    for (int i = 0; i < count; i++) {
+        GisModule_FreeStringSafe(NULL, args[i * 2 + 1]);
+    }
+}
+
 int ExGisAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     if ((argc % 2) == 1 || argc < 4) {
         RedisModule_WrongArity(ctx);
@@ -223,16 +335,87 @@ int ExGisAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
         ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
     }
 
+    fenceSet *fs = spatialFenceSet(ctx, argv[1], 0);
+    RedisModuleString **args = RedisModule_Alloc(sizeof(RedisModuleString *) * (argc - 2));
+    int count = 0, ret = REDISMODULE_OK;
     for (i = 2; i < argc; i += 2) {
         RedisModuleString *value;
-        if ((value = decodeOrReply(ctx, RedisModule_StringPtrLen(argv[i + 1], NULL))) == NULL) return REDISMODULE_ERR;
-        created += spatialTypeSet(ex_gis_obj, argv[i], value);
-        GisModule_FreeStringSafe(NULL, value);
+        size_t len;
+        const char *str = RedisModule_StringPtrLen(argv[i + 1], &len);
+        if ((value = decodeOrReply(ctx, str, len)) == NULL) {
+            ret = REDISMODULE_ERR;
+            break;
+        }
+        created += spatialTypeSet(ctx, ex_gis_obj, fs, argv[i], value);
+        args[count * 2] = argv[i];
+        args[count * 2 + 1] = value;
+        count++;
+    }
+
+    if (ret == REDISMODULE_OK) {
+        RedisModule_ReplyWithLongLong(ctx, created);
+    }
+    if (RedisModule_DictSize(ex_gis_obj->s->h) == 0) {
+        /* the first value of a new area was invalid */
+        RedisModule_DeleteKey(key);
+    }
+    /* the members set before an invalid one stay set */
+    replicateWKB(ctx, argv[1], args, count);
+    RedisModule_Free(args);
+    return ret;
+}
+
+int ExGisMAdd_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if ((argc % 2) == 1 || argc < 4) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    int i, type, count = (argc - 2) / 2;
+    ExGisObj *ex_gis_obj = NULL;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY != type && RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
     }
 
+    /* decode every value first, nothing is written if any of them is invalid */
+    RedisModuleString **fields = RedisModule_Alloc(sizeof(RedisModuleString *) * count);
+    RedisModuleString **values = RedisModule_Alloc(sizeof(RedisModuleString *) * count);
+    for (i = 0; i < count; i++) {
+        fields[i] = argv[2 + i * 2];
+        size_t len;
+        const char *str = RedisModule_StringPtrLen(argv[3 + i * 2], &len);
+        if ((values[i] = decodeOrReply(ctx, str, len)) == NULL) {
+            while (i--) GisModule_FreeStringSafe(NULL, values[i]);
+            RedisModule_Free(fields);
+            RedisModule_Free(values);
+            return REDISMODULE_ERR;
+        }
+    }
+
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        ex_gis_obj = createExGisTypeObject();
+        RedisModule_ModuleTypeSetValue(key, ExGisType, ex_gis_obj);
+    } else {
+        ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
+    }
+
+    int created = spatialTypeMSet(ctx, ex_gis_obj, spatialFenceSet(ctx, argv[1], 0), fields, values, count);
     RedisModule_ReplyWithLongLong(ctx, created);
 
-    RedisModule_ReplicateVerbatim(ctx);
+    RedisModuleString **args = RedisModule_Alloc(sizeof(RedisModuleString *) * count * 2);
+    for (i = 0; i < count; i++) {
+        args[i * 2] = fields[i];
+        args[i * 2 + 1] = values[i];
+    }
+    replicateWKB(ctx, argv[1], args, count);
+    RedisModule_Free(args);
+    RedisModule_Free(fields);
+    RedisModule_Free(values);
     return REDISMODULE_OK;
 }
 
@@ -259,7 +442,12 @@ int ExGisGet_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
         ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
     }
 
-    addGeomHashFieldToReply(ctx, ex_gis_obj, argv[2]);
+    int flag = GIS_WITHVALUE;
+    if (parseGisFlags(ctx, 3, argv, argc, NULL, &flag) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    addGeomHashFieldToReply(ctx, ex_gis_obj, argv[2], flag);
 
     return REDISMODULE_OK;
 }
@@ -271,12 +459,8 @@ int ExGisDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
     }
     RedisModule_AutoMemory(ctx);
 
-    int type = 0, nokey = 0, sz = 0, isEmpty = 0;
-    RedisModuleString *vstr = NULL;
-    const char *cstr = NULL;
-    size_t len = 0;
+    int type = 0, isEmpty = 0;
     ExGisObj *ex_gis_obj = NULL;
-    geom g = NULL;
 
     RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
     type = RedisModule_KeyType(key);
@@ -291,40 +475,163 @@ int ExGisDel_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int arg
         ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
     }
 
-    vstr = RedisModule_DictGet(ex_gis_obj->s->h, argv[2], &nokey);
-    cstr = RedisModule_StringPtrLen(vstr, &len);
-    if (nokey == 1 || !vstr) {
-        goto null;
-    }
-
-    geomErr err = geomDecode(cstr, len, 0, &g, &sz);
-    if (err != GEOM_ERR_NONE) {
-        RedisModule_ReplyWithError(ctx, "ERR invalid geometry");
-        goto error;
-    }
-
-    geomRect bounds = geomBounds(g);
-    int succ = spatialTypeDelete(ex_gis_obj, argv[2], &bounds, &isEmpty);
-    if (!succ) {
-        RedisModule_ReplyWithError(ctx, "ERR delete geo fail!");
-        goto error;
+    if (!spatialTypeDelete(ctx, ex_gis_obj, spatialFenceSet(ctx, argv[1], 0), argv[2], &isEmpty)) {
+        RedisModule_ReplyWithNull(ctx);
+        return REDISMODULE_OK;
     }
     if (isEmpty) {
         RedisModule_DeleteKey(key);
     }
 
-    geomFree(g);
     RedisModule_ReplicateVerbatim(ctx);
     RedisModule_ReplyWithSimpleString(ctx, "OK");
     return REDISMODULE_OK;
+}
 
-null:
-    RedisModule_ReplyWithNull(ctx);
+static void addSearchResultsToReply(RedisModuleCtx *redisCtx, searchContext *ctx, int returned_items) {
+    long option_length = 1;
+
+    if (ctx->flag & GIS_WITHVALUE) {
+        option_length++;
+    }
+
+    if (ctx->flag & GIS_WITHDIST) {
+        option_length++;
+    }
+
+    RedisModule_ReplyWithArray(redisCtx, 2);
+    RedisModule_ReplyWithLongLong(redisCtx, returned_items);
+    RedisModule_ReplyWithArray(redisCtx, returned_items * option_length);
+    for (int i = 0; i < returned_items; i++) {
+        RedisModule_ReplyWithString(redisCtx, ctx->results[i].field);
+
+        if (ctx->flag & GIS_WITHVALUE) {
+            addGeomOutputToReply(redisCtx, ctx->results[i].entry, ctx->output, ctx->precision);
+        }
+
+        if (ctx->flag & GIS_WITHDIST) {
+            GisModule_AddReplyDistance(redisCtx, ctx->results[i].distance);
+        }
+    }
+}
+
+/* computes the distances of the results when they are needed and sorts
+ * them. With COUNT the distances are computed while searching. */
+static void sortSearchResults(searchContext *ctx) {
+    if ((ctx->flag & GIS_SORT_ASC) || (ctx->flag & GIS_SORT_DESC) || (ctx->flag & GIS_WITHDIST)) {
+        if (ctx->count == 0) {
+            for (int i = 0; i < ctx->len; i++) {
+                geomCoord c = geomCenter((geom) RedisModule_StringPtrLen(ctx->results[i].value, NULL));
+                double distance = geoutilDistance(c.y, c.x, ctx->center.y, ctx->center.x);
+                ctx->results[i].distance = distance / ctx->to_meters;
+            }
+        }
+
+        if (ctx->flag & GIS_SORT_ASC) {
+            qsort(ctx->results, ctx->len, sizeof(resultItem), sortDistanceAsc);
+        } else if (ctx->flag & GIS_SORT_DESC) {
+            qsort(ctx->results, ctx->len, sizeof(resultItem), sortDistanceDesc);
+        }
+    }
+}
+
+/* next is the cursor of the next page, -1 without CURSOR. */
+static void addSearchToReply(RedisModuleCtx *redisCtx, searchContext *ctx, long long next) {
+    if (ctx->output == OUTPUT_COUNT) {
+        RedisModule_ReplyWithLongLong(redisCtx, (ctx->count == 0 || ctx->matched < ctx->count) ?
+                                                ctx->matched : ctx->count);
+        return;
+    }
+    if (next >= 0) {
+        RedisModule_ReplyWithArray(redisCtx, 2);
+        RedisModule_ReplyWithString(redisCtx, RedisModule_CreateStringFromLongLong(redisCtx, next));
+    }
+    addSearchResultsToReply(redisCtx, ctx, ctx->len);
+}
+
+/* A search of a large key can run on a snapshot of it, see
+ * spatialSnapshotNew, on the snapshot threads while the client is blocked
+ * and the main thread goes on with the other commands, writes to the key
+ * included. The results are sorted on the thread too, only the reply is
+ * built on the main thread, from the entries the snapshot keeps. */
+typedef struct snapshotSearch {
+    RedisModuleBlockedClient *bc;
+    spatialSnapshot *snap;
+    searchContext ctx;
+    char *pattern;  // owned copy of the MATCH pattern.
+    workersJob job;
+} snapshotSearch;
+
+static void snapshotSearchRun(void *arg) {
+    snapshotSearch *ss = arg;
+    spatialSnapshotSearch(ss->snap, &ss->ctx);
+    if (!ss->ctx.fail && ss->ctx.output != OUTPUT_COUNT) {
+        sortSearchResults(&ss->ctx);
+    }
+    RedisModule_UnblockClient(ss->bc, ss);
+}
+
+static int snapshotSearchReply(RedisModuleCtx *redisCtx, RedisModuleString **argv, int argc) {
+    REDISMODULE_NOT_USED(argv);
+    REDISMODULE_NOT_USED(argc);
+    snapshotSearch *ss = RedisModule_GetBlockedClientPrivateData(redisCtx);
+    if (ss->ctx.fail) {
+        return RedisModule_ReplyWithError(redisCtx, "ERR out of memory");
+    }
+    addSearchToReply(redisCtx, &ss->ctx, -1);
     return REDISMODULE_OK;
+}
 
-error:
-    geomFree(g);
-    return REDISMODULE_ERR;
+/* called on the main thread once the search is done, replied or not. */
+static void snapshotSearchFree(RedisModuleCtx *redisCtx, void *privdata) {
+    REDISMODULE_NOT_USED(redisCtx);
+    snapshotSearch *ss = privdata;
+    spatialSnapshotFree(ss->snap);
+    if (ss->ctx.g) {
+        geomFree(ss->ctx.g);
+    }
+    if (ss->ctx.m) {
+        geomFreePolyMap(ss->ctx.m);
+    }
+    if (ss->ctx.results) {
+        RedisModule_Free(ss->ctx.results);
+    }
+    if (ss->pattern) {
+        RedisModule_Free(ss->pattern);
+    }
+    RedisModule_Free(ss);
+}
+
+/* a client in a transaction or a script can not be blocked. */
+static int searchCanBlock(RedisModuleCtx *redisCtx) {
+    return !(RedisModule_GetContextFlags(redisCtx) &
+             (REDISMODULE_CTX_FLAGS_MULTI | REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_DENY_BLOCKING));
+}
+
+/* Starts the search of ctx on a snapshot, which takes the target of ctx.
+ * Returns 0 when it could not be started and ctx is left as it was. */
+static int searchOnSnapshot(RedisModuleCtx *redisCtx, searchContext *ctx) {
+    snapshotSearch *ss = RedisModule_Calloc(1, sizeof(snapshotSearch));
+    ss->snap = spatialSnapshotNew(ctx->s);
+    if (!ss->snap) {
+        RedisModule_Free(ss);
+        return 0;
+    }
+    ss->ctx = *ctx;
+    ss->ctx.c = NULL;
+    if (ctx->pattern) {
+        ss->pattern = RedisModule_Alloc(ctx->match.len + 1);
+        memcpy(ss->pattern, ctx->pattern, ctx->match.len + 1);
+        ss->ctx.pattern = ss->pattern;
+        globCompile(&ss->ctx.match, ss->pattern, ctx->match.len);
+    }
+    ctx->g = NULL;
+    ctx->m = NULL;
+    ss->bc = RedisModule_BlockClient(redisCtx, snapshotSearchReply, NULL, snapshotSearchFree, 0);
+    ss->job.fn = snapshotSearchRun;
+    ss->job.arg = ss;
+    workersQueueJob(&ss->job);
+    return 1;
 }
 
 static int exgsearchInner(RedisModuleCtx *redisCtx, RedisModuleString **argv, int argc, int searchtype){
@@ -393,75 +700,548 @@ static int exgsearchInner(RedisModuleCtx *redisCtx, RedisModuleString **argv, in
         }
     }
 
-    rtreeSearch(ctx.s->tr, ctx.bounds.min.x, ctx.bounds.min.y, ctx.bounds.max.x, ctx.bounds.max.y, searchIterator,
-                &ctx);
-
-    if (!ctx.fail) {
-        long option_length = 1;
+    /* COUNT without ordering does not make much sense, force ASC
+     * ordering if COUNT was specified but no sorting was requested. */
+    if (ctx.count != 0 && !(ctx.flag & GIS_SORT_ASC) && !(ctx.flag & GIS_SORT_DESC)) {
+        ctx.flag |= GIS_SORT_ASC;
+    }
 
-        if (ctx.flag & GIS_WITHVALUE) {
-            option_length++;
+    /* with CURSOR only a page of LIMIT matches is returned, see
+     * spatialTypeSearchPage */
+    long long next = -1;
+    if (ctx.cursor >= 0) {
+        if (ctx.count != 0 || (ctx.flag & GIS_SORT_ASC) || (ctx.flag & GIS_SORT_DESC) || ctx.output == OUTPUT_COUNT) {
+            RedisModule_ReplyWithError(redisCtx, "ERR cursor can not be used with count, asc, desc or output count");
+            goto done;
         }
-
-        if (ctx.flag & GIS_WITHDIST) {
-            option_length++;
+        long long limit = ctx.limit ? ctx.limit : SEARCH_PAGE_LIMIT;
+        ctx.limit = 0;
+        next = spatialTypeSearchPage(&ctx, ctx.cursor, limit);
+        if (next == -1 && !ctx.fail) {
+            RedisModule_ReplyWithError(redisCtx, "ERR out of memory");
+            ctx.fail = 1;
         }
+    } else if (snapshotSearchThreads && searchCanBlock(redisCtx) &&
+               RedisModule_DictSize(ctx.s->h) >= (uint64_t) spatialSnapshotMinMembers &&
+               searchOnSnapshot(redisCtx, &ctx)) {
+        goto done;
+    } else {
+        spatialTypeSearch(&ctx);
+    }
 
-        // SORT or COUNT
-        /* COUNT without ordering does not make much sense, force ASC
-         * ordering if COUNT was specified but no sorting was requested. */
-        if (ctx.count != 0 && !(ctx.flag & GIS_SORT_ASC) && !(ctx.flag & GIS_SORT_DESC)) {
-            ctx.flag |= GIS_SORT_ASC;
+    if (!ctx.fail) {
+        if (ctx.output != OUTPUT_COUNT) {
+            sortSearchResults(&ctx);
         }
-        if ((ctx.flag & GIS_SORT_ASC) || (ctx.flag & GIS_SORT_DESC) || (ctx.flag & GIS_WITHDIST)) {
-            for (int i = 0; i < ctx.len; i++) {
-                geomCoord c = geomCenter((geom) RedisModule_StringPtrLen(ctx.results[i].value, NULL));
-                double distance = geoutilDistance(c.y, c.x, ctx.center.y, ctx.center.x);
-                ctx.results[i].distance = distance / ctx.to_meters;
-            }
+        addSearchToReply(redisCtx, &ctx, next);
+    }
+
+done:
+    if (ctx.g && ctx.releaseg) {
+        geomFree(ctx.g);
+    }
+    if (ctx.m) {
+        geomFreePolyMap(ctx.m);
+    }
+    if (ctx.results) {
+        RedisModule_Free(ctx.results);
+    }
+    return REDISMODULE_OK;
+}
+
+
+int ExGisNearest_RedisCommand(RedisModuleCtx *redisCtx, RedisModuleString **argv, int argc) {
+    if (argc < 5) {
+        RedisModule_WrongArity(redisCtx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(redisCtx);
+
+    searchContext ctx;
+    memset(&ctx, 0, sizeof(searchContext));
+    ctx.c = redisCtx;
+    ctx.allfields = 1;
+    ctx.output = OUTPUT_WKT;
+    ctx.flag |= GIS_WITHVALUE;
+    ctx.to_meters = 1;
+
+    if (GisModule_GetDoubleFromObjectOrReply(redisCtx, argv[2], &ctx.center.x,
+                                               "ERR need numeric longitude") != REDISMODULE_OK)
+        return REDISMODULE_ERR;
+    if (GisModule_GetDoubleFromObjectOrReply(redisCtx, argv[3], &ctx.center.y,
+                                               "ERR need numeric latitude") != REDISMODULE_OK)
+        return REDISMODULE_ERR;
+    if (ctx.center.x < -180 || ctx.center.x > 180 || ctx.center.y < -90 || ctx.center.y > 90) {
+        RedisModule_ReplyWithError(redisCtx, "ERR invalid longitude/latitude pair");
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_StringToLongLong(argv[4], &ctx.count) != REDISMODULE_OK) {
+        RedisModule_ReplyWithError(redisCtx, "ERR count must be number");
+        return REDISMODULE_ERR;
+    }
+    if (ctx.count <= 0) {
+        RedisModule_ReplyWithError(redisCtx, "ERR count must be > 0");
+        return REDISMODULE_ERR;
+    }
 
-            if (ctx.flag & GIS_SORT_ASC) {
-                qsort(ctx.results, ctx.len, sizeof(resultItem), sortDistanceAsc);
-            } else if (ctx.flag & GIS_SORT_DESC) {
-                qsort(ctx.results, ctx.len, sizeof(resultItem), sortDistanceDesc);
+    for (int i = 5; i < argc; ++i) {
+        const char *field = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(field, "UNIT")) {
+            if (i == argc - 1) {
+                RedisModule_ReplyWithError(redisCtx, "ERR need unit");
+                return REDISMODULE_ERR;
+            }
+            if (GisModule_ExtractUnitOrReply(redisCtx, argv[i + 1], &ctx.to_meters) != REDISMODULE_OK) {
+                return REDISMODULE_ERR;
+            }
+            i += 1;
+        } else if (!strcasecmp(field, "MATCH")) {
+            if (i == argc - 1) {
+                RedisModule_ReplyWithError(redisCtx, "ERR match need pattern");
+                return REDISMODULE_ERR;
+            }
+            size_t len;
+            ctx.pattern = (char *) RedisModule_StringPtrLen(argv[i + 1], &len);
+            globCompile(&ctx.match, ctx.pattern, (int) len);
+            ctx.allfields = ctx.match.type == GLOB_ALL;
+            i += 1;
+        } else if (!strcasecmp(field, "WITHVALUE")) {
+            ctx.flag |= GIS_WITHVALUE;
+        } else if (!strcasecmp(field, "WITHDIST")) {
+            ctx.flag |= GIS_WITHDIST;
+        } else if (!strcasecmp(field, "OUTPUT")) {
+            if (parseOutputOrReply(redisCtx, argv, argc, &i, &ctx) != REDISMODULE_OK) {
+                return REDISMODULE_ERR;
             }
+        } else if (!strcasecmp(field, "WITHWKB")) {
+            ctx.flag |= GIS_WITHVALUE;
+            ctx.output = OUTPUT_WKB;
+        } else if (!strcasecmp(field, "WITHOUTVALUE") || !strcasecmp(field, "WITHOUTWKT")) {
+            ctx.flag &= ~GIS_WITHVALUE;
+        } else {
+            RedisModule_ReplyWithError(redisCtx, "ERR syntax error");
+            return REDISMODULE_ERR;
         }
+    }
+
+    RedisModuleKey *key = RedisModule_OpenKey(redisCtx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        // EMPTYMULTIBULK
+        RedisModule_ReplyWithArray(redisCtx, 0);
+        return REDISMODULE_OK;
+    }
+    if (RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(redisCtx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    ExGisObj *ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
+    ctx.s = ex_gis_obj->s;
 
-        int returned_items = (ctx.count == 0 || ctx.len < ctx.count) ?
-                              ctx.len : ctx.count;
+    /* the traversal needs every member at its place in the rtree */
+    spatialTypeFlush(ctx.s);
+    if (rtreeNearby(ctx.s->tr, nearestDistance, nearestIterator, &ctx) == -1 && !ctx.fail) {
+        RedisModule_ReplyWithError(redisCtx, "ERR out of memory");
+        ctx.fail = 1;
+    }
+    if (!ctx.fail && ctx.output == OUTPUT_COUNT) {
+        RedisModule_ReplyWithLongLong(redisCtx, ctx.len);
+    } else if (!ctx.fail) {
+        addSearchResultsToReply(redisCtx, &ctx, ctx.len);
+    }
 
-        RedisModule_ReplyWithArray(redisCtx, 2);
-        RedisModule_ReplyWithLongLong(redisCtx, returned_items);
-        RedisModule_ReplyWithArray(redisCtx, returned_items * option_length);
-        for (int i = 0; i < returned_items; i++) {
-            RedisModule_ReplyWithString(redisCtx, ctx.results[i].field);
+    if (ctx.results) {
+        RedisModule_Free(ctx.results);
+    }
+    return REDISMODULE_OK;
+}
 
-            if (ctx.flag & GIS_WITHVALUE) {
-                char *wkt = geomEncodeWKT((geom) RedisModule_StringPtrLen(ctx.results[i].value, NULL), 0);
-                assert(wkt);
-                RedisModule_ReplyWithStringBuffer(redisCtx, wkt, strlen(wkt));
-                geomFreeWKT(wkt);
+static int parseFenceDetectOrReply(RedisModuleCtx *ctx, RedisModuleString *arg, int *detect) {
+    static const struct {
+        const char *name;
+        int flag;
+    } events[] = {
+        {"enter", FENCE_ENTER},
+        {"exit", FENCE_EXIT},
+        {"cross", FENCE_CROSS},
+        {"inside", FENCE_INSIDE},
+        {"outside", FENCE_OUTSIDE},
+        {"del", FENCE_FIELDDEL},
+    };
+
+    size_t len;
+    const char *p = RedisModule_StringPtrLen(arg, &len);
+    const char *end = p + len;
+    *detect = 0;
+    while (p < end) {
+        const char *comma = memchr(p, ',', end - p);
+        size_t n = comma ? (size_t)(comma - p) : (size_t)(end - p);
+        size_t j;
+        for (j = 0; j < sizeof(events) / sizeof(events[0]); j++) {
+            if (strlen(events[j].name) == n && !strncasecmp(p, events[j].name, n)) {
+                *detect |= events[j].flag;
+                break;
             }
+        }
+        if (j == sizeof(events) / sizeof(events[0])) {
+            RedisModule_ReplyWithError(ctx, "ERR invalid detect event");
+            return REDISMODULE_ERR;
+        }
+        p += n + 1;
+    }
+    if (*detect == 0) {
+        RedisModule_ReplyWithError(ctx, "ERR invalid detect event");
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
 
-            if (ctx.flag & GIS_WITHDIST) {
-                GisModule_AddReplyDistance(redisCtx, ctx.results[i].distance);
+int ExGisFence_RedisCommand(RedisModuleCtx *redisCtx, RedisModuleString **argv, int argc) {
+    if (argc < 5) {
+        RedisModule_WrongArity(redisCtx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(redisCtx);
+
+    /* only the options of a fence are taken, parseGisFlags would accept
+     * the options of a search and ignore them. The arguments of an option
+     * missing at the end are reported by parseGisFlags. */
+    int detect = FENCE_ENTER | FENCE_EXIT | FENCE_CROSS | FENCE_FIELDDEL;
+    int member = 0;
+    for (int i = 3; i < argc; i++) {
+        const char *opt = RedisModule_StringPtrLen(argv[i], NULL);
+        int args;
+        if (!strcasecmp(opt, "RADIUS")) {
+            args = 4;
+        } else if (!strcasecmp(opt, "MEMBER")) {
+            args = 3;
+            member = 1;
+        } else if (!strcasecmp(opt, "GEOM") || !strcasecmp(opt, "MATCH") || !strcasecmp(opt, "DETECT")) {
+            args = 1;
+        } else {
+            RedisModule_ReplyWithError(redisCtx, "ERR syntax error");
+            return REDISMODULE_ERR;
+        }
+        if (i + args >= argc) {
+            if (!strcasecmp(opt, "DETECT")) {
+                RedisModule_ReplyWithError(redisCtx, "ERR syntax error");
+                return REDISMODULE_ERR;
             }
+            break;
         }
+        if (!strcasecmp(opt, "DETECT") &&
+            parseFenceDetectOrReply(redisCtx, argv[i + 1], &detect) != REDISMODULE_OK) {
+            return REDISMODULE_ERR;
+        }
+        i += args;
     }
 
-done:
-    if (ctx.g && ctx.releaseg) {
+    /* the fences are kept out of the key, see spatialFenceSet, the area
+     * does not need to exist */
+    RedisModuleKey *key = RedisModule_OpenKey(redisCtx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY != type && RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(redisCtx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    ExGisObj *ex_gis_obj = REDISMODULE_KEYTYPE_EMPTY == type ? NULL : RedisModule_ModuleTypeGetValue(key);
+    if (member && !ex_gis_obj) {
+        RedisModule_ReplyWithError(redisCtx, "ERR member not found");
+        return REDISMODULE_ERR;
+    }
+
+    searchContext ctx;
+    memset(&ctx, 0, sizeof(searchContext));
+    ctx.c = redisCtx;
+    ctx.releaseg = 1;
+    ctx.allfields = 1;
+    ctx.s = ex_gis_obj ? ex_gis_obj->s : NULL;
+    ctx.to_meters = 1;
+
+    if (parseGisFlags(redisCtx, 3, argv, argc, &ctx, NULL) != REDISMODULE_OK) {
+        goto fail;
+    }
+    if (!ctx.g) {
+        RedisModule_ReplyWithError(redisCtx, "ERR need RADIUS, MEMBER or GEOM");
+        goto fail;
+    }
+    ctx.m = geomNewPolyMap(ctx.g);
+    if (!ctx.m) {
         geomFree(ctx.g);
+        RedisModule_ReplyWithError(redisCtx, "ERR poly map failure");
+        goto fail;
     }
-    if (ctx.m) {
-        geomFreePolyMap(ctx.m);
+
+    fence *f = RedisModule_Calloc(1, sizeof(fence));
+    f->channel = RedisModule_CreateStringFromString(NULL, argv[2]);
+    f->detect = detect;
+    f->allfields = ctx.allfields;
+    if (!ctx.allfields) {
+        f->pattern = RedisModule_Alloc(ctx.match.len + 1);
+        memcpy(f->pattern, ctx.pattern, ctx.match.len + 1);
+        globCompile(&f->match, f->pattern, ctx.match.len);
     }
-    if (ctx.results) {
-        RedisModule_Free(ctx.results);
+    f->targetType = ctx.targetType;
+    f->center = ctx.center;
+    f->meters = ctx.meters;
+    f->searchType = INTERSECTS;
+    f->g = ctx.g;
+    f->sz = ctx.sz;
+    f->m = ctx.m;
+    f->bounds = ctx.bounds;
+
+    RedisModule_ReplyWithLongLong(redisCtx, spatialFenceAdd(spatialFenceSet(redisCtx, argv[1], 1), f));
+    return REDISMODULE_OK;
+
+fail:
+    return REDISMODULE_ERR;
+}
+
+int ExGisUnfence_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc != 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY != type && RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
     }
+
+    RedisModule_ReplyWithLongLong(ctx, spatialFenceRemove(ctx, argv[1], argv[2]));
     return REDISMODULE_OK;
 }
 
+int ExGisCount_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY != type && RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    ExGisObj *ex_gis_obj = REDISMODULE_KEYTYPE_EMPTY == type ? NULL : RedisModule_ModuleTypeGetValue(key);
+
+    searchContext sctx;
+    memset(&sctx, 0, sizeof(searchContext));
+    sctx.c = ctx;
+    sctx.releaseg = 1;
+    sctx.searchType = INTERSECTS;
+    sctx.allfields = 1;
+    sctx.to_meters = 1;
+    sctx.s = ex_gis_obj ? ex_gis_obj->s : NULL;
+
+    int approx = 0;
+    for (int i = 2; i < argc; i++) {
+        const char *option = RedisModule_StringPtrLen(argv[i], NULL);
+        if (!strcasecmp(option, "APPROX")) {
+            approx = 1;
+        } else if (!strcasecmp(option, "MEMBER") && !ex_gis_obj) {
+            RedisModule_ReplyWithError(ctx, "ERR member not found");
+            return REDISMODULE_ERR;
+        }
+    }
+    if (parseGisFlags(ctx, 2, argv, argc, &sctx, NULL) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+
+    long long count = 0, error = 0;
+    if (sctx.pattern) {
+        RedisModule_ReplyWithError(ctx, "ERR match is not supported");
+        goto done;
+    }
+    if (!ex_gis_obj) {
+        /* nothing to count */
+    } else if (!sctx.g) {
+        count = (long long) RedisModule_DictSize(sctx.s->h);
+    } else {
+        sctx.m = geomNewPolyMap(sctx.g);
+        if (!sctx.m) {
+            RedisModule_ReplyWithError(ctx, "ERR poly map failure");
+            goto done;
+        }
+        spatialTypeCount(&sctx, approx, &count, &error);
+    }
+    if (approx) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithLongLong(ctx, count);
+        RedisModule_ReplyWithLongLong(ctx, error);
+    } else {
+        RedisModule_ReplyWithLongLong(ctx, count);
+    }
+
+done:
+    if (sctx.g && sctx.releaseg) {
+        geomFree(sctx.g);
+    }
+    if (sctx.m) {
+        geomFreePolyMap(sctx.m);
+    }
+    return REDISMODULE_OK;
+}
+
+/* parses 'double' or 'float' into the RTREE_FLOAT flag. */
+static int parsePrecision(const char *s, int *flags) {
+    if (!strcasecmp(s, "double")) {
+        *flags &= ~RTREE_FLOAT;
+    } else if (!strcasecmp(s, "float")) {
+        *flags |= RTREE_FLOAT;
+    } else {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+/* parses 'quadratic' or 'rstar' into the RTREE_RSTAR flag. */
+static int parseSplit(const char *s, int *flags) {
+    if (!strcasecmp(s, "quadratic")) {
+        *flags &= ~RTREE_RSTAR;
+    } else if (!strcasecmp(s, "rstar")) {
+        *flags |= RTREE_RSTAR;
+    } else {
+        return REDISMODULE_ERR;
+    }
+    return REDISMODULE_OK;
+}
+
+int ExGisIndex_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 4 || argc % 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ | REDISMODULE_WRITE);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        RedisModule_ReplyWithError(ctx, "ERR no such key");
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    ExGisObj *ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
+
+    int flags = rtreeFlags(ex_gis_obj->s->tr);
+    long long buffer = -1;
+    for (int i = 2; i < argc; i += 2) {
+        const char *name = RedisModule_StringPtrLen(argv[i], NULL);
+        const char *value = RedisModule_StringPtrLen(argv[i + 1], NULL);
+        if (!strcasecmp(name, "precision")) {
+            if (parsePrecision(value, &flags) != REDISMODULE_OK) {
+                RedisModule_ReplyWithError(ctx, "ERR precision must be double or float");
+                return REDISMODULE_ERR;
+            }
+        } else if (!strcasecmp(name, "split")) {
+            if (parseSplit(value, &flags) != REDISMODULE_OK) {
+                RedisModule_ReplyWithError(ctx, "ERR split must be quadratic or rstar");
+                return REDISMODULE_ERR;
+            }
+        } else if (!strcasecmp(name, "buffer")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &buffer) != REDISMODULE_OK || buffer < 0 ||
+                buffer > SPATIAL_WRITE_BUFFER_MAX) {
+                RedisModule_ReplyWithError(ctx, "ERR buffer must be between 0 and 4096");
+                return REDISMODULE_ERR;
+            }
+        } else {
+            RedisModule_ReplyWithError(ctx, "ERR unknown index option");
+            return REDISMODULE_ERR;
+        }
+    }
+
+    if (!spatialTypeSetIndexFlags(ex_gis_obj, flags)) {
+        RedisModule_ReplyWithError(ctx, "ERR out of memory");
+        return REDISMODULE_ERR;
+    }
+    if (buffer >= 0) {
+        spatialTypeSetWriteBuffer(ex_gis_obj, (int) buffer);
+    }
+    RedisModule_ReplyWithSimpleString(ctx, "OK");
+    RedisModule_ReplicateVerbatim(ctx);
+    return REDISMODULE_OK;
+}
+
+static void addReplyRatio(RedisModuleCtx *ctx, double d) {
+    char dbuf[32];
+    int dlen = snprintf(dbuf, sizeof(dbuf), "%.4f", d);
+    RedisModule_ReplyWithStringBuffer(ctx, dbuf, dlen);
+}
+
+/* GIS.INFO area
+ *
+ * Describes an area as name value pairs: its memory, the shape of its index
+ * and how many members of each geometry type it holds. A fill far below 1
+ * or a high overlap tells that the index should be rebuilt, see GIS.INDEX. */
+int ExGisInfo_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    static const char *typeNames[] = {"UNKNOWN", "POINT", "LINESTRING", "POLYGON", "MULTIPOINT",
+                                      "MULTILINESTRING", "MULTIPOLYGON", "GEOMETRYCOLLECTION"};
+    if (argc != 2) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    int type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        RedisModule_ReplyWithError(ctx, "ERR no such key");
+        return REDISMODULE_ERR;
+    }
+    if (RedisModule_ModuleTypeGetType(key) != ExGisType) {
+        RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+        return REDISMODULE_ERR;
+    }
+    ExGisObj *ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
+
+    spatialInfo info;
+    spatialTypeInfo(ex_gis_obj->s, &info);
+    int flags = rtreeFlags(ex_gis_obj->s->tr);
+
+    RedisModule_ReplyWithArray(ctx, 24);
+    RedisModule_ReplyWithSimpleString(ctx, "members");
+    RedisModule_ReplyWithLongLong(ctx, info.members);
+    RedisModule_ReplyWithSimpleString(ctx, "memory");
+    RedisModule_ReplyWithLongLong(ctx, (long long) info.memory);
+    RedisModule_ReplyWithSimpleString(ctx, "bytes-per-member");
+    RedisModule_ReplyWithLongLong(ctx, info.members ? (long long) (info.memory / info.members) : 0);
+    RedisModule_ReplyWithSimpleString(ctx, "index-memory");
+    RedisModule_ReplyWithLongLong(ctx, (long long) info.indexMemory);
+    RedisModule_ReplyWithSimpleString(ctx, "precision");
+    RedisModule_ReplyWithSimpleString(ctx, (flags & RTREE_FLOAT) ? "float" : "double");
+    RedisModule_ReplyWithSimpleString(ctx, "split");
+    RedisModule_ReplyWithSimpleString(ctx, (flags & RTREE_RSTAR) ? "rstar" : "quadratic");
+    RedisModule_ReplyWithSimpleString(ctx, "height");
+    RedisModule_ReplyWithLongLong(ctx, info.index.height);
+    RedisModule_ReplyWithSimpleString(ctx, "nodes");
+    RedisModule_ReplyWithLongLong(ctx, info.index.nodes);
+    RedisModule_ReplyWithSimpleString(ctx, "fill");
+    addReplyRatio(ctx, info.index.fill);
+    RedisModule_ReplyWithSimpleString(ctx, "overlap");
+    addReplyRatio(ctx, info.index.overlap);
+    RedisModule_ReplyWithSimpleString(ctx, "write-buffer");
+    RedisModule_ReplyWithLongLong(ctx, info.pending);
+    RedisModule_ReplyWithSimpleString(ctx, "types");
+    RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+    long len = 0;
+    for (int i = 0; i <= GEOM_GEOMETRYCOLLECTION; i++) {
+        if (info.types[i]) {
+            RedisModule_ReplyWithSimpleString(ctx, typeNames[i]);
+            RedisModule_ReplyWithLongLong(ctx, info.types[i]);
+            len += 2;
+        }
+    }
+    RedisModule_ReplySetArrayLength(ctx, len);
+    return REDISMODULE_OK;
+}
 
 int ExGisSearch_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
     return exgsearchInner(ctx, argv, argc, INTERSECTS);
@@ -511,68 +1291,280 @@ int ExGisGetAll_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int
     return REDISMODULE_OK;
 }
 
+int ExGisScan_RedisCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    if (argc < 3) {
+        RedisModule_WrongArity(ctx);
+        return REDISMODULE_ERR;
+    }
+    RedisModule_AutoMemory(ctx);
+
+    int type = 0;
+    ExGisObj *ex_gis_obj = NULL;
+
+    RedisModuleKey *key = RedisModule_OpenKey(ctx, argv[1], REDISMODULE_READ);
+    type = RedisModule_KeyType(key);
+    if (REDISMODULE_KEYTYPE_EMPTY == type) {
+        RedisModule_ReplyWithArray(ctx, 2);
+        RedisModule_ReplyWithStringBuffer(ctx, "0", 1);
+        RedisModule_ReplyWithArray(ctx, 0);
+        return REDISMODULE_OK;
+    } else {
+        if (RedisModule_ModuleTypeGetType(key) != ExGisType) {
+            RedisModule_ReplyWithError(ctx, REDISMODULE_ERRORMSG_WRONGTYPE);
+            return REDISMODULE_ERR;
+        }
+        ex_gis_obj = RedisModule_ModuleTypeGetValue(key);
+    }
+
+    searchContext sctx;
+    memset(&sctx, 0, sizeof(searchContext));
+    sctx.c = ctx;
+    sctx.releaseg = 1;
+    sctx.allfields = 1;
+    sctx.output = OUTPUT_WKT;
+    sctx.s = ex_gis_obj->s;
+    sctx.flag |= GIS_WITHVALUE;
+    sctx.to_meters = 1;
+
+    if (parseGisFlags(ctx, 3, argv, argc, &sctx, NULL) != REDISMODULE_OK) {
+        return REDISMODULE_ERR;
+    }
+    if (sctx.g) {
+        geomFree(sctx.g);
+        RedisModule_ReplyWithError(ctx, "ERR scan does not take a target, use gis.search with cursor");
+        return REDISMODULE_ERR;
+    }
+    if (sctx.output == OUTPUT_COUNT) {
+        RedisModule_ReplyWithError(ctx, "ERR output count is not supported");
+        return REDISMODULE_ERR;
+    }
+
+    return addGeomHashScanToReply(ctx, &sctx, argv[2]);
+}
+
 /* ========================== "exgistype" type methods ======================= */
 
+/* Since encoding version 1 a key is saved as:
+ *
+ *   <flags> <buffer> <members> <loose> [<n> <member> * n] ... <member> * loose
+ *
+ * where <flags> and <buffer> are the options of GIS.INDEX, the precision
+ * and split of the rtree and the size of the write buffer, and <member> is
+ * the field, the WKB value and, unless the value is a point whose bounds
+ * are cheap to read back, its bounds as minX minY maxX maxY. The members
+ * come leaf by leaf in the order of the index, a leaf of n members at a
+ * time, and the loose ones, those in the write buffer, last. Loading
+ * takes the bounds as they are and packs the same leaves, so only the
+ * upper levels of the index are built again, see spatialTypeLoadIndex.
+ * Version 0 only has <members> [<field> <value>] *
+ * members in dict order. */
+
+/* The members read and not added yet, see spatialTypeAppendBatch. */
+typedef struct rdbBatch {
+    ExGisObj *o;
+    RedisModuleString *fields[SPATIAL_LOAD_BATCH];
+    RedisModuleString *vals[SPATIAL_LOAD_BATCH];
+    unsigned char known[SPATIAL_LOAD_BATCH];
+    rtreeItem *items;   // where the bounds of the batch go.
+    int len;
+    int advance;        // move items past each batch added.
+    int dropped;
+} rdbBatch;
+
+static void rdbBatchFlush(rdbBatch *b) {
+    b->dropped += spatialTypeAppendBatch(b->o, b->fields, b->vals, b->items, b->known, b->len);
+    if (b->advance) {
+        b->items += b->len;
+    }
+    b->len = 0;
+}
+
+/* reads a member, with its bounds unless bounds is 0 or the value is a
+ * point. */
+static void rdbLoadMember(RedisModuleIO *rdb, rdbBatch *b, int bounds) {
+    int i = b->len++;
+    b->fields[i] = RedisModule_LoadString(rdb);
+    b->vals[i] = RedisModule_LoadString(rdb);
+    b->known[i] = bounds && !geomIsSimplePoint((geom) RedisModule_StringPtrLen(b->vals[i], NULL));
+    if (b->known[i]) {
+        rtreeItem *it = &b->items[i];
+        it->minX = RedisModule_LoadDouble(rdb);
+        it->minY = RedisModule_LoadDouble(rdb);
+        it->maxX = RedisModule_LoadDouble(rdb);
+        it->maxY = RedisModule_LoadDouble(rdb);
+    }
+    if (b->len == SPATIAL_LOAD_BATCH) {
+        rdbBatchFlush(b);
+    }
+}
+
+static void *rdbLoadV0(RedisModuleIO *rdb) {
+    ExGisObj *ex_gis_obj = createExGisTypeObject();
+    uint64_t size = RedisModule_LoadUnsigned(rdb);
+
+    rdbBatch *b = RedisModule_Calloc(1, sizeof(rdbBatch));
+    b->o = ex_gis_obj;
+    b->items = RedisModule_Alloc(sizeof(rtreeItem) * SPATIAL_LOAD_BATCH);
+    while (size--) {
+        rdbLoadMember(rdb, b, 0);
+    }
+    rdbBatchFlush(b);
+    RedisModule_Free(b->items);
+    RedisModule_Free(b);
+    spatialTypeBuildIndex(ex_gis_obj);
+
+    return ex_gis_obj;
+}
+
 void *ExGisTypeRdbLoad(RedisModuleIO *rdb, int encver) {
+    if (encver == 0) {
+        return rdbLoadV0(rdb);
+    }
     if (encver != EXGIS_ENC_VER) {
         return NULL;
     }
 
     ExGisObj *ex_gis_obj = createExGisTypeObject();
+    uint64_t flags = RedisModule_LoadUnsigned(rdb);
+    uint64_t buffer = RedisModule_LoadUnsigned(rdb);
     uint64_t size = RedisModule_LoadUnsigned(rdb);
+    uint64_t loose = RedisModule_LoadUnsigned(rdb);
+    if ((flags & ~(uint64_t) (RTREE_FLOAT | RTREE_RSTAR)) || buffer > SPATIAL_WRITE_BUFFER_MAX ||
+        loose > size || size > INT_MAX || !spatialTypeSetIndexFlags(ex_gis_obj, (int) flags)) {
+        releaseExGisTypeObject(ex_gis_obj);
+        return NULL;
+    }
+    spatialTypeSetWriteBuffer(ex_gis_obj, (int) buffer);
+
+    rtreeItem *items = RedisModule_Alloc(sizeof(rtreeItem) * (size ? size : 1));
+    rdbBatch *b = RedisModule_Calloc(1, sizeof(rdbBatch));
+    b->o = ex_gis_obj;
+    b->items = items;
+    b->advance = 1;
+    int *counts = NULL;
+    int leaves = 0, cap = 0;
+    uint64_t packed = 0;
+    while (packed < size - loose) {
+        uint64_t n = RedisModule_LoadUnsigned(rdb);
+        if (n == 0 || n > size - loose - packed) {
+            rdbBatchFlush(b);
+            RedisModule_Free(b);
+            RedisModule_Free(counts);
+            RedisModule_Free(items);
+            releaseExGisTypeObject(ex_gis_obj);
+            return NULL;
+        }
+        if (leaves == cap) {
+            cap = cap ? cap * 2 : 64;
+            counts = RedisModule_Realloc(counts, sizeof(int) * cap);
+        }
+        counts[leaves++] = (int) n;
+        packed += n;
+        while (n--) {
+            rdbLoadMember(rdb, b, 1);
+        }
+    }
+    while (loose--) {
+        rdbLoadMember(rdb, b, 1);
+    }
+    rdbBatchFlush(b);
 
-    RedisModuleString *field, *value;
-    while (size--) {
-        field = RedisModule_LoadString(rdb);
-        value = RedisModule_LoadString(rdb);
-        spatialTypeSet(ex_gis_obj, field, value);
-
-        GisModule_FreeStringSafe(NULL, field);
-        GisModule_FreeStringSafe(NULL, value);
+    if (b->dropped) {
+        spatialTypeBuildIndex(ex_gis_obj);
+    } else {
+        spatialTypeLoadIndex(ex_gis_obj, items, (int) size, counts, leaves);
     }
+    RedisModule_Free(b);
+    RedisModule_Free(counts);
+    RedisModule_Free(items);
 
     return ex_gis_obj;
 }
 
-void ExGisTypeRdbSave(RedisModuleIO *rdb, void *value) {
-    ExGisObj *o = value;
-    RedisModuleDict *h = o->s->h;
-    uint64_t size = RedisModule_DictSize(h);
-    RedisModule_SaveUnsigned(rdb, size);
+static void rdbSaveMember(RedisModuleIO *rdb, spatialEntry *e) {
+    RedisModule_SaveString(rdb, e->field);
+    RedisModule_SaveString(rdb, e->value);
+    if (!geomIsSimplePoint((geom) RedisModule_StringPtrLen(e->value, NULL))) {
+        RedisModule_SaveDouble(rdb, e->minX);
+        RedisModule_SaveDouble(rdb, e->minY);
+        RedisModule_SaveDouble(rdb, e->maxX);
+        RedisModule_SaveDouble(rdb, e->maxY);
+    }
+}
 
-    void *field, *val;
-    RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(
-            h, "^", NULL, 0);
-    while ((field = RedisModule_DictNext(NULL, iter, &val)) != NULL) {
-        RedisModule_SaveString(rdb, field);
-        RedisModule_SaveString(rdb, val);
+/* saves the members of a leaf, but the ones in the write buffer which the
+ * leaf holds at their former bounds. */
+static void rdbSaveLeaf(void **items, int count, void *userdata) {
+    RedisModuleIO *rdb = userdata;
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        n += !((spatialEntry *) items[i])->pending;
+    }
+    if (n == 0) {
+        return;
+    }
+    RedisModule_SaveUnsigned(rdb, n);
+    for (int i = 0; i < count; i++) {
+        spatialEntry *e = items[i];
+        if (!e->pending) {
+            rdbSaveMember(rdb, e);
+        }
+    }
+}
 
-        GisModule_FreeStringSafe(NULL, field);
+void ExGisTypeRdbSave(RedisModuleIO *rdb, void *value) {
+    ExGisObj *o = value;
+    spatial *s = o->s;
+    RedisModule_SaveUnsigned(rdb, rtreeFlags(s->tr) & (RTREE_FLOAT | RTREE_RSTAR));
+    RedisModule_SaveUnsigned(rdb, s->pmax);
+    RedisModule_SaveUnsigned(rdb, RedisModule_DictSize(s->h));
+    RedisModule_SaveUnsigned(rdb, s->plen);
+    rtreeLeaves(s->tr, rdbSaveLeaf, rdb);
+    for (int i = 0; i < s->plen; i++) {
+        rdbSaveMember(rdb, s->pending[i].e);
     }
-    RedisModule_DictIteratorStop(iter);
 }
 
+/* The rewrite emits a GIS.MADD per AOF_REWRITE_MEMBERS members with the
+ * stored WKB as is, which GIS.MADD takes back without parsing any text,
+ * then a GIS.INDEX when the options of the key are not the defaults. */
+#define AOF_REWRITE_MEMBERS 256
+
 void ExGisTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key, void *value) {
     ExGisObj *o = value;
     RedisModuleDict *h = o->s->h;
+    RedisModuleString *argv[AOF_REWRITE_MEMBERS * 2];
+    size_t argc = 0;
 
-    void *field, *val;
+    size_t keylen;
+    spatialEntry *e;
     RedisModuleDictIter *iter = RedisModule_DictIteratorStartC(
             h, "^", NULL, 0);
-    while ((field = RedisModule_DictNext(NULL, iter, &val)) != NULL) {
-        char *wkt = geomEncodeWKT((geom) RedisModule_StringPtrLen(val, NULL), 0);
-        RedisModule_EmitAOF(aof, "GIS.ADD", "scc", key, RedisModule_StringPtrLen(field, NULL), wkt);
-
-        RedisModule_Free(wkt);
-        GisModule_FreeStringSafe(NULL, field);
+    while (RedisModule_DictNextC(iter, &keylen, (void **) &e) != NULL) {
+        argv[argc++] = e->field;
+        argv[argc++] = e->value;
+        if (argc == AOF_REWRITE_MEMBERS * 2) {
+            RedisModule_EmitAOF(aof, "GIS.MADD", "sv", key, argv, argc);
+            argc = 0;
+        }
     }
     RedisModule_DictIteratorStop(iter);
+    if (argc > 0) {
+        RedisModule_EmitAOF(aof, "GIS.MADD", "sv", key, argv, argc);
+    }
+
+    int flags = rtreeFlags(o->s->tr) & (RTREE_FLOAT | RTREE_RSTAR);
+    if (flags != spatialRTreeFlags || o->s->pmax != spatialWriteBuffer) {
+        RedisModule_EmitAOF(aof, "GIS.INDEX", "scccccl", key,
+                            "PRECISION", (flags & RTREE_FLOAT) ? "float" : "double",
+                            "SPLIT", (flags & RTREE_RSTAR) ? "rstar" : "quadratic",
+                            "BUFFER", (long long) o->s->pmax);
+    }
 }
 
 size_t ExGisTypeMemUsage(const void *value) {
-    // TODO
-    REDISMODULE_NOT_USED(value);
-    return 0;
+    const ExGisObj *o = value;
+    return sizeof(ExGisObj) + spatialMemUsage(o->s);
 }
 
 void ExGisTypeFree(void *value) {
@@ -588,7 +1580,12 @@ void ExGisTypeDigest(RedisModuleDigest *md, void *value) {
 size_t ExGisTypeFreeEffort(RedisModuleString *key, const void *value) {
     REDISMODULE_NOT_USED(key);
     ExGisObj *ex_gis_obj = (ExGisObj*)(value);
-    return RedisModule_DictSize(ex_gis_obj->s->keyhash);
+    /* with live snapshots freeing the key only drops its reference, the
+     * last snapshot frees it, see spatialFree. */
+    if (ex_gis_obj->s->llen) {
+        return 1;
+    }
+    return RedisModule_DictSize(ex_gis_obj->s->h);
 }
 
 int Module_CreateCommands(RedisModuleCtx *ctx) {
@@ -603,26 +1600,135 @@ int Module_CreateCommands(RedisModuleCtx *ctx) {
 #define CREATE_ROCMD(name, tgt) CREATE_CMD(name, tgt, "readonly fast")
 
     CREATE_WRCMD("gis.add", ExGisAdd_RedisCommand)
+    CREATE_WRCMD("gis.madd", ExGisMAdd_RedisCommand)
     CREATE_ROCMD("gis.get", ExGisGet_RedisCommand)
     CREATE_WRCMD("gis.del", ExGisDel_RedisCommand)
     CREATE_ROCMD("gis.search", ExGisSearch_RedisCommand)
     CREATE_ROCMD("gis.contains", ExGisContains_RedisCommand)
     CREATE_ROCMD("gis.intersects", ExGisIntersects_RedisCommand)
     CREATE_ROCMD("gis.getall", ExGisGetAll_RedisCommand)
+    CREATE_ROCMD("gis.scan", ExGisScan_RedisCommand)
     CREATE_ROCMD("gis.within", ExGisWithIn_RedisCommand)
+    CREATE_ROCMD("gis.nearest", ExGisNearest_RedisCommand)
+    CREATE_ROCMD("gis.count", ExGisCount_RedisCommand)
+    CREATE_WRCMD("gis.fence", ExGisFence_RedisCommand)
+    CREATE_WRCMD("gis.unfence", ExGisUnfence_RedisCommand)
+    CREATE_WRCMD("gis.index", ExGisIndex_RedisCommand)
+    CREATE_CMD("gis.info", ExGisInfo_RedisCommand, "readonly")
 
     return REDISMODULE_OK;
 }
 
+/* Parse the arguments given to MODULE LOAD / loadmodule, which come as
+ * name value pairs:
+ *
+ *   polymap-cache-size <bytes>  memory budget of the polymap cache, 0 (the
+ *                               default) disables the cache.
+ *   rtree-precision double|float
+ *                               coordinate type of the index of new keys,
+ *                               float makes the rtree a third smaller.
+ *   rtree-split quadratic|rstar
+ *                               insertion policy of the index of new keys,
+ *                               rstar builds trees with less overlap at the
+ *                               cost of slower inserts.
+ *   write-buffer <members>      members whose index update new keys buffer
+ *                               and merge in a batch, 0 (the default) updates
+ *                               the index on every write.
+ *   search-threads <threads>    threads helping the main thread search large
+ *                               keys and load keys from the RDB file, 0 (the
+ *                               default) does it on the main thread only.
+ *   search-threads-min-members <members>
+ *                               members a key needs to be searched on the
+ *                               threads.
+ *   snapshot-search-threads <threads>
+ *                               threads running the searches of large keys
+ *                               on a snapshot while the main thread goes on,
+ *                               0 (the default) searches on the main thread.
+ *   snapshot-search-min-members <members>
+ *                               members a key needs to be searched on a
+ *                               snapshot. */
+int Module_ParseArgs(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    for (int i = 0; i < argc; i += 2) {
+        const char *name = RedisModule_StringPtrLen(argv[i], NULL);
+        long long value = 0;
+        if (i == argc - 1) {
+            RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+            return REDISMODULE_ERR;
+        }
+        if (!strcasecmp(name, "polymap-cache-size")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            spatialPolyMapCacheLimit = (size_t) value;
+        } else if (!strcasecmp(name, "rtree-precision")) {
+            if (parsePrecision(RedisModule_StringPtrLen(argv[i + 1], NULL), &spatialRTreeFlags) != REDISMODULE_OK) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+        } else if (!strcasecmp(name, "rtree-split")) {
+            if (parseSplit(RedisModule_StringPtrLen(argv[i + 1], NULL), &spatialRTreeFlags) != REDISMODULE_OK) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+        } else if (!strcasecmp(name, "write-buffer")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0 ||
+                value > SPATIAL_WRITE_BUFFER_MAX) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            spatialWriteBuffer = (int) value;
+        } else if (!strcasecmp(name, "search-threads")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0 ||
+                value > WORKERS_MAX - 1) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            searchThreads = (int) value;
+        } else if (!strcasecmp(name, "search-threads-min-members")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            spatialParallelMinMembers = value;
+        } else if (!strcasecmp(name, "snapshot-search-threads")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0 ||
+                value > WORKERS_MAX) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            snapshotSearchThreads = (int) value;
+        } else if (!strcasecmp(name, "snapshot-search-min-members")) {
+            if (RedisModule_StringToLongLong(argv[i + 1], &value) != REDISMODULE_OK || value < 0) {
+                RedisModule_Log(ctx, "warning", "invalid value for module argument '%s'", name);
+                return REDISMODULE_ERR;
+            }
+            spatialSnapshotMinMembers = value;
+        } else {
+            RedisModule_Log(ctx, "warning", "unknown module argument '%s'", name);
+            return REDISMODULE_ERR;
+        }
+    }
+    return REDISMODULE_OK;
+}
+
 /* This function must be present on each Redis module. It is used in order to
  * register the commands into the Redis server. */
 int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    REDISMODULE_NOT_USED(argv);
-    REDISMODULE_NOT_USED(argc);
-
     if (RedisModule_Init(ctx,"exgistype",1,REDISMODULE_APIVER_1)
         == REDISMODULE_ERR) return REDISMODULE_ERR;
 
+    if (REDISMODULE_ERR == Module_ParseArgs(ctx, argv, argc)) return REDISMODULE_ERR;
+
+    if (searchThreads && workersStart(searchThreads) != 0) {
+        RedisModule_Log(ctx, "warning", "failed to start the search threads");
+        return REDISMODULE_ERR;
+    }
+    if (snapshotSearchThreads && workersStartJobs(snapshotSearchThreads) != 0) {
+        RedisModule_Log(ctx, "warning", "failed to start the snapshot search threads");
+        return REDISMODULE_ERR;
+    }
+
     RedisModuleTypeMethods tm = {
             .version = REDISMODULE_TYPE_METHOD_VERSION,
             .rdb_load = ExGisTypeRdbLoad,
@@ -634,7 +1740,7 @@ int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv, int argc)
             .free_effort = ExGisTypeFreeEffort,
     };
 
-    ExGisType = RedisModule_CreateDataType(ctx,"exgistype",0,&tm);
+    ExGisType = RedisModule_CreateDataType(ctx,"exgistype",EXGIS_ENC_VER,&tm);
     if (ExGisType == NULL) return REDISMODULE_ERR;
 
     if (REDISMODULE_ERR == Module_CreateCommands(ctx)) return REDISMODULE_ERR;
@@ -21,5 +21,6 @@
 #define GIS_WITHDIST (1<<1)
 #define GIS_SORT_ASC (1<<2)
 #define GIS_SORT_DESC (1<<3)
+#define GIS_WITHWKB (1<<4)
 
 #endif // TAIRGIS_H
@@ -0,0 +1,245 @@
+/*
+ * Copyright 2023 Alibaba Tair Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "workers.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* A fixed pool of threads running batches of tasks for the main thread.
+ * The calling thread works on the batch too and workersRunTasks only
+ * returns once every task is done, so the data the tasks read can not
+ * change meanwhile. The tasks are dealt in ranges, one per worker: a
+ * worker runs its own range from the front, and once it is empty steals
+ * the back half of the largest range left. */
+
+typedef struct workerRange {
+    pthread_mutex_t lock;
+    int next, end;
+} workerRange;
+
+static int workersTotal = 1;    // the calling thread and the pool.
+static pthread_t workersThreads[WORKERS_MAX];
+static workerRange workersRanges[WORKERS_MAX];
+static pthread_mutex_t workersLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workersStartCond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workersDoneCond = PTHREAD_COND_INITIALIZER;
+static unsigned long long workersBatch = 0; // bumped for every batch.
+static int workersBusy = 0;                 // pool threads still in the batch.
+static workersTaskFunc workersFn;
+static void *workersArg;
+
+static int rangePop(workerRange *r) {
+    int task = -1;
+    pthread_mutex_lock(&r->lock);
+    if (r->next < r->end) {
+        task = r->next++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return task;
+}
+
+/* moves the back half of the largest other range to the range of worker.
+ * Returns the first task stolen, or -1 once every range is empty. */
+static int rangeSteal(int worker) {
+    for (;;) {
+        int victim = -1, most = 0;
+        for (int i = 0; i < workersTotal; i++) {
+            if (i == worker) {
+                continue;
+            }
+            /* only a hint, checked again when stealing */
+            pthread_mutex_lock(&workersRanges[i].lock);
+            int left = workersRanges[i].end - workersRanges[i].next;
+            pthread_mutex_unlock(&workersRanges[i].lock);
+            if (left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim < 0) {
+            return -1;
+        }
+
+        workerRange *v = &workersRanges[victim];
+        int first = -1, end = -1;
+        pthread_mutex_lock(&v->lock);
+        int left = v->end - v->next;
+        if (left > 0) {
+            end = v->end;
+            first = end - (left + 1) / 2;
+            v->end = first;
+        }
+        pthread_mutex_unlock(&v->lock);
+        if (first >= 0) {
+            workerRange *r = &workersRanges[worker];
+            pthread_mutex_lock(&r->lock);
+            r->next = first + 1;
+            r->end = end;
+            pthread_mutex_unlock(&r->lock);
+            return first;
+        }
+    }
+}
+
+static void workersRunBatch(int worker) {
+    for (;;) {
+        int task = rangePop(&workersRanges[worker]);
+        if (task < 0 && (task = rangeSteal(worker)) < 0) {
+            break;
+        }
+        workersFn(workersArg, worker, task);
+    }
+}
+
+static void *workersMain(void *arg) {
+    int worker = (int) (intptr_t) arg;
+    unsigned long long batch = 0;
+    pthread_mutex_lock(&workersLock);
+    for (;;) {
+        while (workersBatch == batch) {
+            pthread_cond_wait(&workersStartCond, &workersLock);
+        }
+        batch = workersBatch;
+        pthread_mutex_unlock(&workersLock);
+        workersRunBatch(worker);
+        pthread_mutex_lock(&workersLock);
+        if (--workersBusy == 0) {
+            pthread_cond_signal(&workersDoneCond);
+        }
+    }
+    return NULL;
+}
+
+/* Starts threads more workers next to the calling thread, at most
+ * WORKERS_MAX in all. Returns -1 if they could not be created. */
+int workersStart(int threads) {
+    for (int i = 0; i < WORKERS_MAX; i++) {
+        pthread_mutex_init(&workersRanges[i].lock, NULL);
+    }
+    if (threads > WORKERS_MAX - 1) {
+        threads = WORKERS_MAX - 1;
+    }
+    for (int i = 1; i <= threads; i++) {
+        if (pthread_create(&workersThreads[i], NULL, workersMain, (void *) (intptr_t) i) != 0) {
+            return -1;
+        }
+        pthread_detach(workersThreads[i]);
+        workersTotal = i + 1;
+    }
+    return 0;
+}
+
+/* Number of workers, the calling thread included. */
+int workersCount(void) {
+    return workersTotal;
+}
+
+/* Runs fn for the tasks 0 to count - 1 on every worker and returns when
+ * they are done. Must only be called from one thread, the main one. */
+void workersRunTasks(int count, workersTaskFunc fn, void *arg) {
+    if (count <= 0) {
+        return;
+    }
+    if (workersTotal == 1) {
+        for (int i = 0; i < count; i++) {
+            fn(arg, 0, i);
+        }
+        return;
+    }
+    pthread_mutex_lock(&workersLock);
+    for (int i = 0; i < workersTotal; i++) {
+        pthread_mutex_lock(&workersRanges[i].lock);
+        workersRanges[i].next = (int) ((long long) count * i / workersTotal);
+        workersRanges[i].end = (int) ((long long) count * (i + 1) / workersTotal);
+        pthread_mutex_unlock(&workersRanges[i].lock);
+    }
+    workersFn = fn;
+    workersArg = arg;
+    workersBusy = workersTotal - 1;
+    workersBatch++;
+    pthread_cond_broadcast(&workersStartCond);
+    pthread_mutex_unlock(&workersLock);
+
+    workersRunBatch(0);
+
+    pthread_mutex_lock(&workersLock);
+    while (workersBusy > 0) {
+        pthread_cond_wait(&workersDoneCond, &workersLock);
+    }
+    pthread_mutex_unlock(&workersLock);
+}
+
+/* Jobs run on threads of their own, apart from the batches above: the main
+ * thread queues them and goes on, the job tells it when it is done. */
+
+static int jobsThreads = 0;
+static pthread_mutex_t jobsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobsCond = PTHREAD_COND_INITIALIZER;
+static workersJob *jobsHead = NULL, *jobsTail = NULL;
+
+static void *jobsMain(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&jobsLock);
+    for (;;) {
+        while (!jobsHead) {
+            pthread_cond_wait(&jobsCond, &jobsLock);
+        }
+        workersJob *job = jobsHead;
+        jobsHead = job->next;
+        if (!jobsHead) {
+            jobsTail = NULL;
+        }
+        pthread_mutex_unlock(&jobsLock);
+        /* the job may be freed as soon as fn returns */
+        job->fn(job->arg);
+        pthread_mutex_lock(&jobsLock);
+    }
+    return NULL;
+}
+
+/* Starts threads to run the jobs. Returns -1 if they could not be
+ * created. */
+int workersStartJobs(int threads) {
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, jobsMain, NULL) != 0) {
+            return -1;
+        }
+        pthread_detach(thread);
+        jobsThreads = i + 1;
+    }
+    return 0;
+}
+
+/* Number of threads running the jobs, 0 if there are none. */
+int workersJobThreads(void) {
+    return jobsThreads;
+}
+
+/* Queues job->fn(job->arg) to run on one of the job threads. */
+void workersQueueJob(workersJob *job) {
+    pthread_mutex_lock(&jobsLock);
+    job->next = NULL;
+    if (jobsTail) {
+        jobsTail->next = job;
+    } else {
+        jobsHead = job;
+    }
+    jobsTail = job;
+    pthread_cond_signal(&jobsCond);
+    pthread_mutex_unlock(&jobsLock);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2023 Alibaba Tair Team
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#define WORKERS_MAX 64
+
+/* a task gets the worker running it, 0 for the calling thread and 1 to
+ * workersCount() - 1 for the threads of the pool. */
+typedef void (*workersTaskFunc)(void *arg, int worker, int task);
+
+int workersStart(int threads);
+int workersCount(void);
+void workersRunTasks(int count, workersTaskFunc fn, void *arg);
+
+/* a job queued with workersQueueJob, owned by the caller until fn runs. */
+typedef struct workersJob {
+    void (*fn)(void *arg);
+    void *arg;
+    struct workersJob *next;
+} workersJob;
+
+int workersStartJobs(int threads);
+int workersJobThreads(void);
+void workersQueueJob(workersJob *job);
+
+#endif // WORKERS_H
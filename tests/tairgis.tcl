@@ -317,6 +317,64 @@ start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
         r del $area
     }
 
+    test {exgis rdb keeps the index and the write buffer} {
+        for {set i 0} {$i < 2000} {incr i} {
+            set x [expr {120 + ($i % 50) * 0.01}]
+            set y [expr {30 + ($i / 50) * 0.01}]
+            if {$i % 3 == 0} {
+                r gis.add grid p$i "POLYGON (($x $y, [expr {$x + 0.005}] $y, $x [expr {$y + 0.005}], $x $y))"
+            } else {
+                r gis.add grid p$i "POINT ($x $y)"
+            }
+        }
+        # moves left in the write buffer
+        r gis.index grid buffer 64
+        for {set i 1} {$i < 100} {incr i 3} {
+            r gis.add grid p$i "POINT (120.3 30.2)"
+        }
+        set polygon "POLYGON ((120.02 30.02, 120.3 30.03, 120.1 30.35, 120.02 30.02))"
+        set before [lsort [lindex [r gis.intersects grid $polygon withoutvalue] 1]]
+        set near [lindex [r gis.search grid radius 120.3 30.2 1 km withoutvalue] 1]
+        assert {[llength $near] >= 30}
+        set moved [r gis.get grid p1]
+
+        r debug reload
+
+        assert_equal 2000 [r gis.count grid]
+        assert_equal $before [lsort [lindex [r gis.intersects grid $polygon withoutvalue] 1]]
+        assert_equal [lsort $near] [lsort [lindex [r gis.search grid radius 120.3 30.2 1 km withoutvalue] 1]]
+        assert_equal $moved [r gis.get grid p1]
+        r del grid
+    }
+
+    test {exgis rdb and aof keep the index options} {
+        r config set aof-use-rdb-preamble no
+        r gis.add grid a "POINT (120 30)"
+        r gis.add grid b "POINT (120.01 30)"
+        r gis.index grid precision float split rstar buffer 64
+        set info [r gis.info grid]
+        assert_equal float [dict get $info precision]
+        assert_equal rstar [dict get $info split]
+
+        r debug reload
+        set info [r gis.info grid]
+        assert_equal float [dict get $info precision]
+        assert_equal rstar [dict get $info split]
+        r gis.add grid a "POINT (120.02 30)"
+        assert_equal 1 [dict get [r gis.info grid] write-buffer]
+
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+        set info [r gis.info grid]
+        assert_equal float [dict get $info precision]
+        assert_equal rstar [dict get $info split]
+        assert_equal "POINT(120.02 30)" [r gis.get grid a]
+        r gis.add grid b "POINT (120.03 30)"
+        assert_equal 1 [dict get [r gis.info grid] write-buffer]
+        r del grid
+    }
+
     test {exgis aof} {
         r config set aof-use-rdb-preamble no
         set new_field [r gis.add $area polygon1 $polygon_wkt]
@@ -338,6 +396,42 @@ start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
         r del $area
     }
 
+    test {exgis aof rewrite in batches of wkb} {
+        r config set aof-use-rdb-preamble no
+        for {set i 0} {$i < 600} {incr i} {
+            r gis.add grid p$i "POINT ([expr {120 + ($i % 30) * 0.01}] [expr {30 + ($i / 30) * 0.01}])"
+        }
+        r gis.add grid polygon $polygon_wkt
+        set all [r gis.getall grid]
+
+        r bgrewriteaof
+        waitForBgrewriteaof r
+        r debug loadaof
+
+        assert_equal $all [r gis.getall grid]
+        r del grid
+    }
+
+    test {gis.add takes wkb} {
+        r gis.add $area $polygon_name $polygon_wkt
+        set wkb [r gis.get $area $polygon_name withwkb]
+        assert_equal 1 [r gis.add wkbarea $polygon_name $wkb]
+        assert_equal 2 [r gis.madd wkbarea p1 $wkb p2 $polygon_wkt]
+        assert_equal $polygon_wkt [r gis.get wkbarea $polygon_name]
+        assert_equal $polygon_wkt [r gis.get wkbarea p1]
+        assert_equal $wkb [r gis.get wkbarea p1 withwkb]
+
+        # WKB whose counts do not match its length is refused
+        assert_error "*invalid geometry*" {r gis.add wkbarea bad [string range $wkb 0 end-8]}
+        assert_error "*invalid geometry*" {r gis.add wkbarea bad "$wkb\x00"}
+        assert_error "*invalid geometry*" {r gis.add wkbarea bad "\x01\x02\x00\x00\x00\xff\xff\xff\x7f"}
+        assert_error "*invalid geometry*" {r gis.add wkbarea bad "\x01\x03\x00\x00\x00\x01\x00\x00\x00\x05\x00\x00\x00"}
+        assert_error "*invalid geometry*" {r gis.madd wkbarea p3 $polygon_wkt bad [string range $wkb 0 end-8]}
+        assert_equal {} [r gis.get wkbarea bad]
+        assert_equal {} [r gis.get wkbarea p3]
+        r del $area wkbarea
+    }
+
     test {exgis type} {
         set new_field [r gis.add $area $polygon_name $polygon_wkt]
         assert_equal 1 $new_field
@@ -379,6 +473,73 @@ start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
         assert_equal $polygon_wkt [r gis.get $area polygon1]
     }
 
+    test {restore of encoding version 0 and of leaves that do not fit} {
+        r del $area
+        # version 0: campus POLYGON ((30 10, ...)), car POINT (30 11) and road
+        # LINESTRING (10 10, 15 15), field and WKB in dict order
+        set v0 [binary format H* [join {
+            07817b1822b2dca978000203050663616d70757305405d010300000001000000050000000000000000003e4000000000
+            000024400000000000004440000000000000444000000000000034400000000000004440000000000000244000000000
+            000034400000000000003e4000000000000024400503636172051501010000000000000000003e400000000000002640
+            0504726f61640529010200000002000000000000000000244000000000000024400000000000002e400000000000002e
+            4000090047bdce038d884575
+        } ""]]
+        assert_equal "OK" [r restore $area 0 $v0]
+        assert_equal 3 [r gis.count $area]
+        assert_equal $polygon_wkt [r gis.get $area campus]
+        assert_equal "LINESTRING(10 10,15 15)" [r gis.get $area road]
+        assert_equal {campus car} [lsort [lindex [r gis.contains $area $point_wkt withoutwkt] 1]]
+        r del $area
+
+        # one leaf of 20 points p0..p19, more than a node holds: the index
+        # is built again instead of keeping the leaf
+        set wide [binary format H* [join {
+            07817b1822b2dca978010200020002140200021405027030051501010000000000000000005e400000000000003e4005
+            02703105150101000000713d0ad7a3005e400000000000003e400502703205150101000000e17a14ae47015e40000000
+            0000003e40050270330515010100000052b81e85eb015e400000000000003e400502703405150101000000c3f5285c8f
+            025e400000000000003e4005027035051501010000003333333333035e400000000000003e4005027036051501010000
+            00a4703d0ad7035e400000000000003e40050270370515010100000014ae47e17a045e400000000000003e4005027038
+            0515010100000085eb51b81e055e400000000000003e400502703905150101000000f6285c8fc2055e40000000000000
+            3e400503703130051501010000006666666666065e400000000000003e40050370313105150101000000d7a3703d0a07
+            5e400000000000003e4005037031320515010100000048e17a14ae075e400000000000003e4005037031330515010100
+            0000b81e85eb51085e400000000000003e40050370313405150101000000295c8fc2f5085e400000000000003e400503
+            703135051501010000009a99999999095e400000000000003e400503703136051501010000000ad7a3703d0a5e400000
+            000000003e400503703137051501010000007b14ae47e10a5e400000000000003e40050370313805150101000000ec51
+            b81e850b5e400000000000003e400503703139051501010000005c8fc2f5280c5e400000000000003e40000900e8ee81
+            f431c8cd26
+        } ""]]
+        assert_equal "OK" [r restore $area 0 $wide]
+        assert_equal 20 [r gis.count $area]
+        assert_equal 2 [dict get [r gis.info $area] height]
+        assert_equal 20 [lindex [r gis.search $area radius 120.1 30 100 km withoutvalue] 0]
+        r del $area
+
+        # a leaf of 3 with p0 twice and the polygon zone left in the write
+        # buffer, the leaves no longer match the members
+        set dup [binary format H* [join {
+            07817b1822b2dca978010200020002040201020305027030051501010000000000000000005e400000000000003e4005
+            02703105150101000000713d0ad7a3005e400000000000003e4005027030051501010000000000000000405e40000000
+            0000003f4005047a6f6e6505404d010300000001000000040000000000000000005e400000000000003e40e17a14ae47
+            015e400000000000003e400000000000005e4085eb51b81e053e400000000000005e400000000000003e400400000000
+            00005e40040000000000003e4004e17a14ae47015e400485eb51b81e053e40000900b45970245c7e1492
+        } ""]]
+        assert_equal "OK" [r restore $area 0 $dup]
+        assert_equal 3 [r gis.count $area]
+        assert_equal "POINT(120 30)" [r gis.get $area p0]
+        assert_equal {p0 p1 zone} [lsort [lindex [r gis.search $area radius 120 30 10 km withoutvalue] 1]]
+        r debug reload
+        assert_equal {p0 p1 zone} [lsort [lindex [r gis.search $area radius 120 30 10 km withoutvalue] 1]]
+        r del $area
+
+        # a leaf of 3 in a key of 2 members
+        set over [binary format H* [join {
+            07817b1822b2dca978010200020002020200020305027030051501010000000000000000005e400000000000003e4005
+            02703105150101000000713d0ad7a3005e400000000000003e40000900fbd342114cf10431
+        } ""]]
+        assert_error "*Bad data format*" {r restore $area 0 $over}
+        assert_equal 0 [r exists $area]
+    }
+
     test {gis.contains multipolygon} {
         set con_area beijing
         set con_polygonname tengxun
@@ -426,6 +587,301 @@ start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
 
         r del sect
     }
+
+    test {gis.madd} {
+        r del batch
+
+        assert_equal 3 [r gis.madd batch a "POINT (1 1)" b "POINT (2 2)" c "POLYGON ((0 0, 5 0, 5 5, 0 5, 0 0))"]
+        assert_equal {a c} [lsort [lindex [r gis.search batch radius 1 1 50 km withoutvalue] 1]]
+
+        catch {r gis.madd batch d "POINT (3 3)" e "POINT (bad)"} e
+        assert_match {*invalid geometry*} $e
+        assert_equal "" [r gis.get batch d]
+
+        assert_equal 1 [r gis.madd batch a "POINT (4 4)"]
+        assert_equal {b c} [lsort [lindex [r gis.search batch radius 1 1 200 km withoutvalue] 1]]
+        assert_equal 3 [llength [r gis.getall batch withoutwkt]]
+
+        r del batch
+    }
+
+    test {gis.add update moves the member in the index} {
+        r del moving
+
+        assert_equal 1 [r gis.add moving car "POINT (10 10)"]
+        assert_equal 1 [r gis.add moving car "POINT (50 50)"]
+
+        assert_equal 0 [lindex [r gis.search moving radius 10 10 10 km] 0]
+        assert_equal {1 car} [r gis.search moving radius 50 50 10 km withoutvalue]
+
+        assert_equal OK [r gis.del moving car]
+        assert_equal 0 [r exists moving]
+    }
+
+    test {gis.add small moves stay searchable} {
+        r del moving
+        for {set i 0} {$i < 300} {incr i} {
+            r gis.add moving p$i "POINT ([expr {100 + ($i % 20) * 0.01}] [expr {30 + ($i / 20) * 0.01}])"
+        }
+        for {set step 1} {$step <= 3} {incr step} {
+            for {set i 0} {$i < 300} {incr i} {
+                r gis.add moving p$i "POINT ([expr {100 + ($i % 20) * 0.01 + $step * 0.00001}] [expr {30 + ($i / 20) * 0.01}])"
+            }
+        }
+        assert_equal {1 p7} [r gis.search moving radius 100.07003 30 1 m withoutvalue]
+        r gis.add moving p7 "POINT (-50 -20)"
+        assert_equal 0 [lindex [r gis.search moving radius 100.07003 30 1 m] 0]
+        assert_equal {1 p7} [r gis.search moving radius -50 -20 1 m withoutvalue]
+        r del moving
+    }
+
+    test {gis.index precision float keeps results exact} {
+        r del idx
+        r gis.add idx a "POINT (10.1 20.2)" b "POINT (10.5 20.5)"
+        assert_equal OK [r gis.index idx precision float]
+        assert_equal {1 {a {POINT(10.1 20.2)}}} [r gis.search idx radius 10.1 20.2 1 m]
+        r gis.add idx a "POINT (10.2 20.2)"
+        assert_equal {1 {a {POINT(10.2 20.2)}}} [r gis.search idx radius 10.2 20.2 1 m]
+        assert_equal OK [r gis.index idx precision double]
+        assert_equal {1 {a {POINT(10.2 20.2)}}} [r gis.search idx radius 10.2 20.2 1 m]
+        assert_error "*precision must be double or float*" {r gis.index idx precision half}
+        assert_error "*no such key*" {r gis.index nokey precision float}
+        r del idx
+    }
+
+    test {gis.index split rstar} {
+        r del idx
+        r gis.add idx a "POINT (10.1 20.2)"
+        assert_equal OK [r gis.index idx split rstar precision float]
+        for {set i 0} {$i < 200} {incr i} {
+            r gis.add idx p$i "POINT ([expr {$i % 20}] [expr {$i / 20}])"
+        }
+        assert_equal {1 {p45 {POINT(5 2)}}} [r gis.search idx radius 5 2 1 m]
+        for {set i 0} {$i < 200} {incr i 2} {
+            r gis.del idx p$i
+        }
+        assert_equal {1 {p47 {POINT(7 2)}}} [r gis.search idx radius 7 2 1 m]
+        assert_equal {0 {}} [r gis.search idx radius 6 2 1 m]
+        assert_error "*split must be quadratic or rstar*" {r gis.index idx split linear}
+        r del idx
+    }
+
+    test {gis.index buffer} {
+        r del idx
+        r gis.add idx a "POINT (10 10)"
+        assert_equal OK [r gis.index idx buffer 8]
+        r gis.add idx a "POINT (10.001 10)"
+        r gis.add idx b "POINT (20 20)"
+        assert_equal 0 [lindex [r gis.search idx radius 10 10 1 m] 0]
+        assert_equal {1 a} [r gis.search idx radius 10.001 10 1 m withoutvalue]
+        assert_equal {1 b} [r gis.search idx radius 20 20 1 m withoutvalue]
+        r gis.del idx b
+        assert_equal 0 [lindex [r gis.search idx radius 20 20 1 m] 0]
+        for {set i 0} {$i < 20} {incr i} {
+            r gis.add idx p$i "POINT (1 $i)"
+        }
+        assert_equal {1 {p5 {POINT(1 5)}}} [r gis.nearest idx 1 5 1]
+        assert_equal 21 [r gis.search idx radius 1 10 2000 km output count]
+        assert_equal OK [r gis.index idx buffer 0]
+        assert_equal 21 [r gis.search idx radius 1 10 2000 km output count]
+        assert_error "*buffer must be between 0 and 4096*" {r gis.index idx buffer 5000}
+        r del idx
+    }
+
+    test {gis.info and memory usage} {
+        r del info
+        r gis.add info a "POINT (10 10)"
+        set small [r memory usage info]
+        for {set i 0} {$i < 200} {incr i} {
+            r gis.add info p$i "POINT ([expr {$i % 20}] [expr {$i / 20}])"
+        }
+        r gis.add info poly "POLYGON ((0 0, 5 0, 5 5, 0 0))"
+        set info [r gis.info info]
+        assert_equal 202 [dict get $info members]
+        assert_equal {POINT 201 POLYGON 1} [dict get $info types]
+        assert_equal double [dict get $info precision]
+        assert {[dict get $info height] >= 2}
+        assert {[dict get $info fill] > 0 && [dict get $info fill] <= 1}
+        assert {[dict get $info index-memory] < [dict get $info memory]}
+        assert {[r memory usage info] > $small}
+        for {set i 0} {$i < 200} {incr i} {
+            r gis.del info p$i
+        }
+        r gis.del info poly
+        assert_equal {POINT 1} [dict get [r gis.info info] types]
+        assert {[r memory usage info] < [dict get $info memory]}
+        assert_error "*no such key*" {r gis.info nokey}
+        r del info
+    }
+
+    test {gis.count} {
+        r del cnt
+        for {set i 0} {$i < 200} {incr i} {
+            r gis.add cnt p$i "POINT ([expr {120 + ($i % 20) * 0.01}] [expr {30 + ($i / 20) * 0.01}])"
+        }
+        assert_equal 200 [r gis.count cnt]
+        assert_equal 0 [r gis.count nokey radius 120 30 1 km]
+        set polygon "POLYGON ((120.02 30.02, 120.12 30.02, 120.12 30.06, 120.02 30.02))"
+        assert_equal [r gis.search cnt geom $polygon output count] [r gis.count cnt geom $polygon]
+        assert_equal [r gis.search cnt radius 120.1 30.05 3 km output count] [r gis.count cnt radius 120.1 30.05 3 km]
+        assert_equal [r gis.search cnt member p50 2 km output count] [r gis.count cnt member p50 2 km]
+        set reply [r gis.count cnt radius 120.1 30.05 3 km approx]
+        set exact [r gis.count cnt radius 120.1 30.05 3 km]
+        assert {abs([lindex $reply 0] - $exact) <= [lindex $reply 1]}
+        assert_error "*member not found*" {r gis.count cnt member nobody 1 km}
+        assert_error "*match is not supported*" {r gis.count cnt radius 120 30 1 km match p*}
+        r del cnt
+    }
+
+    test {gis.search cursor} {
+        r del pages
+        for {set i 0} {$i < 100} {incr i} {
+            r gis.add pages p$i "POINT ([expr {120 + ($i % 10) * 0.01}] [expr {30 + ($i / 10) * 0.01}])"
+        }
+        set cursor 0
+        set found {}
+        set calls 0
+        while 1 {
+            set reply [r gis.search pages radius 120.05 30.05 5 km cursor $cursor limit 7 withoutvalue]
+            set cursor [lindex $reply 0]
+            lappend found {*}[lindex $reply 1 1]
+            r gis.add pages new$calls "POINT (120.05 30.05)"
+            incr calls
+            if {$cursor eq "0"} break
+        }
+        assert {$calls > 1}
+        set expected [lindex [r gis.search pages radius 120.05 30.05 5 km withoutvalue] 1]
+        foreach field [lsort $found] {
+            if {[string match p* $field]} {lappend stable $field}
+        }
+        set members {}
+        foreach field $expected {
+            if {[string match p* $field]} {lappend members $field}
+        }
+        assert_equal [lsort $members] $stable
+        assert_error "*cursor can not be used*" {r gis.search pages radius 120 30 1 km cursor 0 count 2}
+        assert_error "*invalid cursor*" {r gis.search pages radius 120 30 1 km cursor -1}
+        r del pages
+
+        # the pages follow the centers, a moved member is not followed
+        for {set i 0} {$i < 10} {incr i} {
+            r gis.add pages p$i "POINT ([expr {120 + $i * 0.01}] 30)"
+        }
+        set reply [r gis.search pages radius 120.05 30 20 km cursor 0 limit 3 withoutvalue]
+        set cursor [lindex $reply 0]
+        set found [lindex $reply 1 1]
+        assert_equal {p0 p1 p2} $found
+        # returned, moved past the cursor: returned again
+        r gis.add pages p0 "POINT (120.095 30)"
+        # not returned yet, moved behind the cursor: skipped
+        r gis.add pages p8 "POINT (119.99 30)"
+        while {$cursor ne "0"} {
+            set reply [r gis.search pages radius 120.05 30 20 km cursor $cursor limit 3 withoutvalue]
+            set cursor [lindex $reply 0]
+            lappend found {*}[lindex $reply 1 1]
+        }
+        assert_equal {p0 p0 p1 p2 p3 p4 p5 p6 p7 p9} [lsort $found]
+        r del pages
+    }
+
+    test {gis.scan} {
+        r del scanned
+        for {set i 0} {$i < 50} {incr i} {
+            r gis.add scanned p$i "POINT (1 $i)"
+        }
+        set cursor 0
+        set found {}
+        while 1 {
+            set reply [r gis.scan scanned $cursor count 8 withoutvalue]
+            set cursor [lindex $reply 0]
+            lappend found {*}[lindex $reply 1]
+            r gis.del scanned p49
+            if {$cursor eq "0"} break
+        }
+        assert_equal 49 [llength $found]
+        assert_equal 49 [llength [lsort -unique $found]]
+        assert_equal {0 {p1 {POINT(1 1)}}} [r gis.scan scanned 0 count 100 match p1]
+        assert_equal {0 {}} [r gis.scan nokey 0]
+        assert_error "*invalid cursor*" {r gis.scan scanned abc}
+        r del scanned
+    }
+
+    test {gis.fence publishes enter/exit/cross/del} {
+        r del fenced
+
+        set rd [redis_deferring_client]
+        $rd subscribe alerts
+        $rd read
+
+        assert_equal 1 [r gis.fence fenced alerts geom "POLYGON ((2 -1, 3 -1, 3 1, 2 1, 2 -1))" match "car*"]
+        r gis.add fenced bike "POINT (2.5 0)"
+        r gis.add fenced car "POINT (2.5 0)"
+        assert_equal {message alerts {enter car}} [$rd read]
+        r gis.add fenced car "POINT (5 0)"
+        assert_equal {message alerts {exit car}} [$rd read]
+        r gis.add fenced car "POINT (0 0)"
+        assert_equal {message alerts {cross car}} [$rd read]
+        r gis.add fenced car "POINT (2.5 0.5)"
+        assert_equal {message alerts {enter car}} [$rd read]
+        r gis.del fenced car
+        assert_equal {message alerts {del car}} [$rd read]
+
+        assert_equal 1 [r gis.unfence fenced alerts]
+        assert_equal 0 [r gis.unfence fenced alerts]
+        $rd close
+        r del fenced
+    }
+
+    test {gis.fence keeps no key without members} {
+        r del fenced
+        set rd [redis_deferring_client]
+        $rd subscribe alerts
+        $rd read
+
+        # the fences are not part of the keyspace
+        assert_equal 1 [r gis.fence fenced alerts radius 1 1 10 km]
+        assert_equal 0 [r exists fenced]
+        assert_error "*member not found*" {r gis.fence fenced other member car 1 km}
+        # the options of a search are not taken, MEMBER is only an option
+        # at the place of one
+        assert_error "*syntax error*" {r gis.fence fenced other radius 1 1 10 km count 3}
+        assert_error "*syntax error*" {r gis.fence fenced other radius 1 1 10 km withwkb}
+        assert_error "*syntax error*" {r gis.fence fenced other radius 1 1 10 km detect}
+        assert_equal 1 [r gis.fence fenced other radius 1 1 10 km match member]
+        assert_equal 1 [r gis.unfence fenced other]
+        r gis.add fenced car "POINT (1 1)"
+        assert_equal {message alerts {enter car}} [$rd read]
+        r gis.del fenced car
+        assert_equal {message alerts {del car}} [$rd read]
+        assert_equal 0 [r exists fenced]
+
+        # they stay on the area across a reload
+        r debug reload
+        assert_equal 0 [r exists fenced]
+        r gis.add fenced car "POINT (1 1)"
+        assert_equal {message alerts {enter car}} [$rd read]
+        assert_equal 1 [r gis.unfence fenced alerts]
+        r del fenced
+
+        assert_error "*invalid geometry*" {r gis.add fenced car "POINT (1"}
+        assert_equal 0 [r exists fenced]
+        $rd close
+    }
+
+    test {gis.get/gis.getall/gis.search withwkb} {
+        r del wkb
+
+        r gis.add wkb a "POINT (1 1)"
+        set raw [r gis.get wkb a withwkb]
+        assert_equal 21 [string length $raw]
+        assert_equal [list a $raw] [r gis.getall wkb withwkb]
+        assert_equal [list 1 [list a $raw]] [r gis.search wkb radius 1 1 10 km withwkb]
+
+        r gis.add wkb b $raw
+        assert_equal "POINT(1 1)" [r gis.get wkb b]
+
+        r del wkb
+    }
 }
 
 start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
@@ -499,6 +955,21 @@ start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
             $master del $area
         }
 
+        test {gis.add/gis.madd replicate wkb master-slave} {
+            assert_equal 2 [$master gis.add $area polygon1 $polygon_wkt point1 $point_wkt]
+            catch {$master gis.add $area point2 $point_wkt polygon2 "POLYGON (("} err
+            assert_match {*ERR*} $err
+            assert_equal 1 [$master gis.madd $area polygon3 [$master gis.get $area polygon1 WITHWKB]]
+
+            $master WAIT 1 5000
+
+            assert_equal [$master gis.getall $area] [$slave gis.getall $area]
+            assert_equal [$master gis.get $area point2] [$slave gis.get $area point2]
+            assert_equal "" [$slave gis.get $area polygon2]
+
+            $master del $area
+        }
+
         test {rdb master-slave} {
             set new_field [$master gis.add $area $polygon_name $polygon_wkt]
             assert_equal 1 $new_field
@@ -586,5 +1057,164 @@ start_server {tags {"gis-geo"}} {
     test {gis.search by member withdist (sorted)} {
         r gis.search nyc member "wtc one" 7 km asc withdist withoutvalue
     } {5 {{wtc one} 0.0000 {union square} 3.2544 4545 6.1972 {central park n/q/r} 6.6998 {lic market} 6.8967}}
+
+    test {gis.nearest simple} {
+        r gis.nearest nyc -73.9798091 40.7598464 3 withoutvalue
+    } {3 {{central park n/q/r} 4545 {union square}}}
+
+    test {gis.nearest withdist} {
+        r gis.nearest nyc -73.9798091 40.7598464 3 unit km withdist withoutvalue
+    } {3 {{central park n/q/r} 0.7749 4545 2.3650 {union square} 2.7695}}
+
+    test {gis.nearest count larger than area} {
+        lindex [r gis.nearest nyc -73.9798091 40.7598464 100 withoutvalue] 0
+    } {7}
+
+    test {gis.search with MATCH} {
+        lsort [lindex [r gis.search nyc radius -73.9798091 40.7598464 10 km match "*n*r*" withoutvalue] 1]
+    } {{central park n/q/r} {union square}}
+
+    test {gis.search with MATCH prefix and COUNT} {
+        r gis.search nyc radius -73.9798091 40.7598464 10 km match "u*" count 1 withoutvalue
+    } {1 {{union square}}}
+
+    test {gis.search OUTPUT COUNT} {
+        r gis.search nyc radius -73.9798091 40.7598464 10 km output count
+    } {6}
+
+    test {gis.search OUTPUT POINT/HASH/QUAD/TILE} {
+        assert_equal {1 {{central park n/q/r} {-73.9733487 40.7648057}}} [r gis.search nyc radius -73.9798091 40.7598464 3 km count 1 output point]
+        assert_equal {1 {{central park n/q/r} dr5rutn20}} [r gis.search nyc radius -73.9798091 40.7598464 3 km count 1 output hash 9]
+        assert_equal {1 {{central park n/q/r} 032010110132012}} [r gis.search nyc radius -73.9798091 40.7598464 3 km count 1 output quad 15]
+        assert_equal {1 {{central park n/q/r} {9650 12313}}} [r gis.search nyc radius -73.9798091 40.7598464 3 km count 1 output tile 15]
+    }
+
+    test {gis.search OUTPUT with invalid precision} {
+        catch {r gis.search nyc radius -73.9798091 40.7598464 3 km output hash 13} e
+        set e
+    } {ERR*precision*}
+
+    test {gis.nearest with MATCH} {
+        r gis.nearest nyc -73.9798091 40.7598464 2 match "[jq]*" withoutvalue
+    } {2 {q4 jfk}}
+
+    test {gis.nearest with invalid count} {
+        catch {r gis.nearest nyc -73.9798091 40.7598464 0} e
+        set e
+    } {ERR*count must be > 0*}
+}
+
+
+start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
+    r module load $testmodule search-threads 3 search-threads-min-members 10
+
+    test {gis.search on the search threads} {
+        for {set i 0} {$i < 400} {incr i} {
+            r gis.add grid p$i "POINT ([expr {120 + ($i % 20) * 0.01}] [expr {30 + ($i / 20) * 0.01}])"
+        }
+        set polygon "POLYGON ((120.02 30.02, 120.17 30.03, 120.1 30.18, 120.02 30.02))"
+        # LIMIT keeps the search on the main thread
+        set serial [lindex [r gis.search grid geom $polygon limit 1000 withoutvalue] 1]
+        set parallel [lindex [r gis.search grid geom $polygon withoutvalue] 1]
+        assert {[llength $serial] > 0}
+        assert_equal [lsort $serial] [lsort $parallel]
+        assert_equal [llength $serial] [r gis.search grid geom $polygon output count]
+        set nearest [lindex [r gis.nearest grid 120.1 30.1 5 withoutvalue] 1]
+        assert_equal [lsort $nearest] [lsort [lindex [r gis.search grid radius 120.1 30.1 50 km count 5 withoutvalue] 1]]
+        r del grid
+    }
 }
 
+start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
+    r module load $testmodule polymap-cache-size 1048576
+
+    test {gis.search with the polymap cache} {
+        r gis.add area poly "POLYGON ((0 0, 10 0, 10 10, 0 10, 0 0))" line "LINESTRING (20 20, 30 30)" \
+            multi "MULTIPOLYGON (((40 40, 50 40, 50 50, 40 40)), ((60 60, 70 60, 70 70, 60 60)))"
+        set before [r memory usage area]
+        for {set i 0} {$i < 3} {incr i} {
+            assert_equal {1 poly} [r gis.contains area "POINT (5 5)" withoutwkt]
+            assert_equal {1 line} [r gis.intersects area "LINESTRING (20 30, 30 20)" withoutwkt]
+            assert_equal {1 multi} [r gis.contains area "POINT (65 61)" withoutwkt]
+        }
+        # the cached polymaps are accounted to the key
+        assert {[r memory usage area] > $before}
+
+        # updated and deleted members drop their cached polymap
+        r gis.add area poly "POLYGON ((100 100, 110 100, 110 110, 100 110, 100 100))"
+        assert_equal {0 {}} [r gis.contains area "POINT (5 5)" withoutwkt]
+        assert_equal {1 poly} [r gis.contains area "POINT (105 105)" withoutwkt]
+        r gis.del area line
+        assert_equal {0 {}} [r gis.intersects area "LINESTRING (20 30, 30 20)" withoutwkt]
+
+        # large keys are freed on the bio thread with their polymaps
+        for {set k 0} {$k < 4} {incr k} {
+            for {set i 0} {$i < 100} {incr i} {
+                r gis.add big$k p$i "POLYGON (($i 0, [expr {$i + 5}] 0, [expr {$i + 5}] 5, $i 0))"
+            }
+            assert_equal 5 [lindex [r gis.contains big$k "POINT (52.5 0.5)" withoutwkt] 0]
+            r unlink big$k
+        }
+        r flushall async
+        r gis.add area poly "POLYGON ((0 0, 10 0, 10 10, 0 10, 0 0))"
+        set before [r memory usage area]
+        assert_equal {1 poly} [r gis.contains area "POINT (5 5)" withoutwkt]
+        assert {[r memory usage area] > $before}
+        r del area
+    }
+}
+
+start_server {tags {"ex_gis"} overrides {bind 0.0.0.0}} {
+    r module load $testmodule snapshot-search-threads 2 snapshot-search-min-members 10
+
+    test {gis.search on a snapshot} {
+        for {set i 0} {$i < 400} {incr i} {
+            r gis.add grid p$i "POINT ([expr {120 + ($i % 20) * 0.01}] [expr {30 + ($i / 20) * 0.01}])"
+        }
+        set polygon "POLYGON ((120.02 30.02, 120.17 30.03, 120.1 30.18, 120.02 30.02))"
+        # LIMIT keeps the search on the main thread
+        set serial [lindex [r gis.search grid geom $polygon limit 1000 withoutvalue] 1]
+        set snapshot [lindex [r gis.search grid geom $polygon withoutvalue] 1]
+        assert {[llength $serial] > 0}
+        assert_equal [lsort $serial] [lsort $snapshot]
+        assert_equal [llength $serial] [r gis.within grid $polygon output count]
+
+        # writes and deletes going on while the snapshot is searched, the
+        # search sees the key as it was when it was taken. client list still
+        # shows the command once it is replied, so the overlap is not
+        # certain here, rtreeSnapshot in src/spatial/rtree_test.c covers it
+        set rd [redis_deferring_client]
+        $rd client setname snapshot
+        $rd read
+        $rd gis.search grid geom $polygon withoutvalue
+        wait_for_condition 50 10 {
+            [string match "*name=snapshot*cmd=gis.search*" [r client list]]
+        } else {
+            fail "the search was not started"
+        }
+        for {set i 0} {$i < 400} {incr i 2} {
+            r gis.add grid p$i "POINT (121 31)"
+        }
+        r del grid
+        assert_equal [lsort $serial] [lsort [lindex [$rd read] 1]]
+        assert_equal 0 [r exists grid]
+
+        # the key freed on the bio thread while the snapshot is searched
+        for {set i 0} {$i < 400} {incr i} {
+            r gis.add grid p$i "POINT ([expr {120 + ($i % 20) * 0.01}] [expr {30 + ($i / 20) * 0.01}])"
+        }
+        $rd client setname flushed
+        $rd read
+        $rd gis.search grid geom $polygon withoutvalue
+        wait_for_condition 50 10 {
+            [string match "*name=flushed*cmd=gis.search*" [r client list]]
+        } else {
+            fail "the search was not started"
+        }
+        r flushall async
+        assert_equal [lsort $serial] [lsort [lindex [$rd read] 1]]
+        $rd close
+        assert_equal 0 [r exists grid]
+        r ping
+    } {PONG}
+}